@@ -23,6 +23,9 @@ $(BUILD_DIR)/boot/%.o: $(SRC_DIR)/boot/%.asm
 $(BUILD_DIR)/boot/%.o: $(SRC_DIR)/boot/%.cpp $(HEADER_FILES)
 	$(CC64) -o $@ -c $< $(C_WARNINGS) $(CC64_FLAGS)
 
+# Run behind the interrupt entry in idt64.asm that does not save the SSE registers
+$(BUILD_DIR)/boot/apic.o $(BUILD_DIR)/boot/scheduler.o $(BUILD_DIR)/boot/threads.o $(BUILD_DIR)/boot/time.o $(BUILD_DIR)/boot/virtualmemmgmt.o: CC64_FLAGS += $(INTERRUPT_CONTEXT_FLAGS)
+
 # Remove elements from directory stack
 d := $(dirstack_$(sp))
 sp := $(basename $(sp))
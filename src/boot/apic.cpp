@@ -1,15 +1,26 @@
 #include <acpi.h>
 #include <apic.h>
+#include <async.h>
+#include <atomic>
 #include <commonstrings.h>
 #include <cstring>
+#include <drivers/timers/hpet.h>
 #include <terminal.h>
 
+#define APIC_TIMER_DIVIDE_BY_1 0xb
+#define APIC_TIMER_MASKED ((uint64_t)1 << 16)
+#define APIC_TIMER_TSC_DEADLINE ((uint64_t)2 << 17)
+#define MSIX_ENTRY_MASKED 1
+
 APIC::CPU *APIC::bootCpu = nullptr;
 std::vector<APIC::CPU> APIC::cpus;
 std::vector<APIC::InterruptSourceOverrideEntry> APIC::interruptOverrideEntries;
 std::vector<APIC::IOEntry> APIC::ioEntries;
 
 static void *ioApic = nullptr;
+static uint8_t timerVector = 0;
+static Async::Spinlock routesLock;	// guards routes, CPU::routedInterrupts, and IOAPIC registers
+static APIC::InterruptRoute *routes = nullptr;
 
 static const char* const initApicStr = "Initializing APIC";
 static const char* const apicInitCompleteStr = "APIC initialized\n\n";
@@ -30,6 +41,10 @@ static const char* const noIoapicStr = "no IOAPIC";
 static const char* const cpusFoundStr = "CPUs found [";
 static const char* const require2CpusStr = "Require at least 2 CPUs\n";
 
+static bool canRouteTo(const APIC::CPU *cpu);
+static APIC::CPU* leastLoadedCpu();
+static void programRoute(const APIC::InterruptRoute &route);
+
 bool APIC::parse() {
 	using namespace Kernel::Memory;
 
@@ -210,6 +225,322 @@ void APIC::writeIo(const uint8_t offset, const uint32_t value) {
 	*(volatile uint32_t*)((uint64_t)ioApic + 0x10) = value;
 }
 
+// Returns the CPU entry with given APIC ID, nullptr if there is none
+APIC::CPU* APIC::findCpu(uint32_t apicId) {
+	for (auto &cpu : cpus) {
+		if (cpu.apicId == apicId) {
+			return &cpu;
+		}
+	}
+	return nullptr;
+}
+
+// Spreads all routes evenly over the CPUs that run the dispatch loop
+// Call it once more CPUs come online, routes keep their vectors and only change destination
+void APIC::rebalanceInterrupts() {
+	routesLock.lock();
+	for (auto &cpu : cpus) {
+		cpu.routedInterrupts = 0;
+	}
+	for (InterruptRoute *route = routes; route; route = route->next) {
+		route->cpu = leastLoadedCpu();
+		++route->cpu->routedInterrupts;
+		programRoute(*route);
+	}
+	routesLock.unlock();
+}
+
+// Delivers the IOAPIC pin irq as vector to cpu, or to the CPU with the fewest routes if cpu is nullptr
+// The pin is set up edge triggered, active high, in fixed delivery mode
+// Returns false if route is already in use, vector is 0, or cpu cannot receive interrupts
+bool APIC::routeIrq(InterruptRoute &route, Kernel::IRQ irq, uint8_t vector, CPU *cpu) {
+	routesLock.lock();
+	if (route.type != InterruptRoute::Type::None || !vector || (cpu && !canRouteTo(cpu))) {
+		routesLock.unlock();
+		return false;
+	}
+	route.type = InterruptRoute::Type::Irq;
+	route.irq = irq;
+	route.vector = vector;
+	route.cpu = cpu ? cpu : leastLoadedCpu();
+	++route.cpu->routedInterrupts;
+	route.next = routes;
+	routes = &route;
+	programRoute(route);
+	routesLock.unlock();
+	return true;
+}
+
+// Delivers the messages of the MSI capability as vector to cpu, or to the CPU with the fewest routes if cpu is nullptr
+// Only one message is enabled
+// Returns false if route is already in use, vector is 0, or cpu cannot receive interrupts
+bool APIC::routeMsi(InterruptRoute &route, PCIe::MSICapability *msi, uint8_t vector, CPU *cpu) {
+	routesLock.lock();
+	if (route.type != InterruptRoute::Type::None || !vector || !msi || (cpu && !canRouteTo(cpu))) {
+		routesLock.unlock();
+		return false;
+	}
+	route.type = InterruptRoute::Type::Msi;
+	route.msi = msi;
+	route.vector = vector;
+	route.cpu = cpu ? cpu : leastLoadedCpu();
+	++route.cpu->routedInterrupts;
+	route.next = routes;
+	routes = &route;
+	msi->multiMessageEnable = 0;
+	if (msi->bit64Capable) {
+		((PCIe::MSI64Capability*)msi)->messageAddress = 0;
+	}
+	programRoute(route);
+	msi->enable = 1;
+	routesLock.unlock();
+	return true;
+}
+
+// Delivers the MSI-X table entry as vector to cpu, or to the CPU with the fewest routes if cpu is nullptr
+// The entry is unmasked, enabling the MSI-X capability itself is left to the driver
+// Returns false if route is already in use, vector is 0, or cpu cannot receive interrupts
+bool APIC::routeMsix(InterruptRoute &route, volatile PCIe::MSIXTableEntry *entry, uint8_t vector, CPU *cpu) {
+	routesLock.lock();
+	if (route.type != InterruptRoute::Type::None || !vector || !entry || (cpu && !canRouteTo(cpu))) {
+		routesLock.unlock();
+		return false;
+	}
+	route.type = InterruptRoute::Type::Msix;
+	route.msixEntry = entry;
+	route.vector = vector;
+	route.cpu = cpu ? cpu : leastLoadedCpu();
+	++route.cpu->routedInterrupts;
+	route.next = routes;
+	routes = &route;
+	programRoute(route);
+	routesLock.unlock();
+	return true;
+}
+
+// Moves the route to cpu, the handler may still run on the previous CPU for interrupts already in flight
+// Returns false if the route is not set up or cpu cannot receive interrupts
+bool APIC::setAffinity(InterruptRoute &route, CPU *cpu) {
+	routesLock.lock();
+	if (route.type == InterruptRoute::Type::None || !canRouteTo(cpu)) {
+		routesLock.unlock();
+		return false;
+	}
+	--route.cpu->routedInterrupts;
+	route.cpu = cpu;
+	++route.cpu->routedInterrupts;
+	programRoute(route);
+	routesLock.unlock();
+	return true;
+}
+
+// Masks the IOAPIC pin or MSI-X entry or disables the MSI capability of the route so its vector can be freed
+void APIC::unroute(InterruptRoute &route) {
+	routesLock.lock();
+	if (route.type == InterruptRoute::Type::None) {
+		routesLock.unlock();
+		return;
+	}
+	if (route.type == InterruptRoute::Type::Irq) {
+		IORedirectionEntry entry = readIoRedirectionEntry(route.irq);
+		entry.mask = 1;
+		writeIo(IOAPIC_READTBL_LOW(route.irq), entry.lowDword);
+	} else if (route.type == InterruptRoute::Type::Msi) {
+		route.msi->enable = 0;
+	} else {
+		route.msixEntry->vectorControl = route.msixEntry->vectorControl | MSIX_ENTRY_MASKED;
+	}
+	for (InterruptRoute **link = &routes; *link; link = &(*link)->next) {
+		if (*link == &route) {
+			*link = route.next;
+			break;
+		}
+	}
+	--route.cpu->routedInterrupts;
+	route.next = nullptr;
+	route.type = InterruptRoute::Type::None;
+	route.cpu = nullptr;
+	routesLock.unlock();
+}
+
 void APIC::acknowledgeLocalInterrupt() {
 	Kernel::writeMsr(Kernel::MSR::x2ApicEOI, 0);
 }
+
+// Sends a fixed interrupt with given vector to a CPU
+// The ICR write is not serializing, memory written before it is ordered by the caller if the target reads it
+void APIC::sendIpi(const CPU &cpu, uint8_t vector) {
+	Kernel::writeMsr(Kernel::MSR::x2ApicInterruptCommand, ((uint64_t)cpu.apicId << 32) | vector);
+}
+
+// Returns the CPU entry of the CPU executing this function
+// Returns nullptr if setCurrentCpu has not been called on this CPU yet, the entry code in kernelasm.asm
+// points the GS base at a null pointer until then
+APIC::CPU* APIC::getCurrentCpu() {
+	static_assert(offsetof(CPU, self) == 0);
+	CPU *cpu;
+	asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+// Stores the CPU entry in the GS base of the CPU executing this function
+// User code can change the GS base by loading a segment selector, so ring 3 runs with the GS base swapped
+// into the kernel GS base, which it has no way to reach
+// syscallEntry, the interrupt entry points and userPreemptionTrampoline swap the two on every switch between rings
+// cpus must not be resized after this
+void APIC::setCurrentCpu(CPU *cpu) {
+	cpu->self = cpu;
+	Kernel::writeMsr(Kernel::MSR::gsBase, (uint64_t)cpu);
+	// Mappings removed before other CPUs could see this CPU online are not shot down here, flush them now
+	std::atomic_ref(cpu->online).store(true);
+	Kernel::flushCurrentTLB();
+}
+
+// Sets up the local APIC timer of the CPU executing this function
+// TSC-deadline mode is used instead of the local APIC timer's own counter when the CPU supports it and the TSC is invariant,
+// the TSC frequency calibrated by Time::initialize then applies to every CPU
+// Deadlines are armed relative to the local TSC so they hold even if its offset differs from the other CPUs'
+// Otherwise the local APIC timer is calibrated against the HPET main counter
+// Must be called on every CPU after setCurrentCpu and Time::initialize
+// Returns true only if the timer frequency is known
+bool APIC::initializeTimer() {
+	using namespace Drivers::Timers;
+
+	CPU *cpu = getCurrentCpu();
+	if (!cpu || !HPET::registers) {
+		return false;
+	}
+
+	// All CPUs share the IDT so the timer vector is installed only once
+	if (!timerVector) {
+		timerVector = Kernel::IDT::allocateVector(apicTimerHandler, nullptr);
+		if (!timerVector) {
+			return false;
+		}
+	}
+
+	cpu->tscDeadline = isTscDeadlineSupported() && Kernel::Time::tscFrequency;
+	Kernel::writeMsr(Kernel::MSR::x2ApicDivideConfiguration, APIC_TIMER_DIVIDE_BY_1);
+	Kernel::writeMsr(Kernel::MSR::x2ApicLvtTimer, APIC_TIMER_MASKED | timerVector);
+	if (cpu->tscDeadline) {
+		cpu->timerFrequency = Kernel::Time::tscFrequency;
+	} else {
+		// Let the local APIC timer count down from the maximum with interrupts masked
+		// for APIC_TIMER_CALIBRATION_TIME nanoseconds of HPET time
+		const uint64_t hpetStart = HPET::readCounter();
+		const uint64_t hpetEnd = hpetStart + HPET::nanosecondsToTicks(APIC_TIMER_CALIBRATION_TIME);
+		Kernel::writeMsr(Kernel::MSR::x2ApicInitialCount, UINT32_MAX);
+		uint64_t hpetNow;
+		while ((hpetNow = HPET::readCounter()) < hpetEnd) {
+			__builtin_ia32_pause();
+		}
+		const uint64_t apicElapsed = UINT32_MAX - Kernel::readMsr(Kernel::MSR::x2ApicCurrentCount);
+		Kernel::writeMsr(Kernel::MSR::x2ApicInitialCount, 0);
+		const uint64_t elapsedTime = HPET::ticksToNanoseconds(hpetNow - hpetStart);
+		if (elapsedTime == 0) {
+			return false;
+		}
+		cpu->timerFrequency = apicElapsed * 1000000000 / elapsedTime;
+	}
+	if (cpu->timerFrequency == 0) {
+		return false;
+	}
+	cpu->timerTicksPerNanosecond =
+		((cpu->timerFrequency / 1000000000) << 32) +
+		((cpu->timerFrequency % 1000000000) << 32) / 1000000000;
+
+	// Unmask the timer in one-shot or TSC-deadline mode
+	// The LVT write must be serialized before the first write to the TSC deadline
+	Kernel::writeMsr(
+		Kernel::MSR::x2ApicLvtTimer,
+		(cpu->tscDeadline ? APIC_TIMER_TSC_DEADLINE : 0) | timerVector
+	);
+	asm volatile("mfence" ::: "memory");
+	return true;
+}
+
+// Arms the timer of the CPU executing this function to interrupt once after given nanoseconds
+// A deadline armed earlier on the same CPU is replaced
+void APIC::setTimerDeadline(uint64_t nanoseconds) {
+	CPU *cpu = getCurrentCpu();
+	if (!cpu || !cpu->timerFrequency) {
+		return;
+	}
+	uint64_t ticks = (uint64_t)(((unsigned __int128)nanoseconds * cpu->timerTicksPerNanosecond) >> 32);
+	if (ticks == 0) {
+		ticks = 1;
+	}
+	if (cpu->tscDeadline) {
+		Kernel::writeMsr(Kernel::MSR::tscDeadline, __builtin_ia32_rdtsc() + ticks);
+	} else {
+		Kernel::writeMsr(Kernel::MSR::x2ApicInitialCount, ticks > UINT32_MAX ? UINT32_MAX : ticks);
+	}
+}
+
+// Disarms the timer of the CPU executing this function
+void APIC::stopTimer() {
+	CPU *cpu = getCurrentCpu();
+	if (!cpu) {
+		return;
+	}
+	Kernel::writeMsr(cpu->tscDeadline ? Kernel::MSR::tscDeadline : Kernel::MSR::x2ApicInitialCount, 0);
+}
+
+void apicTimerHandler(void*, Kernel::Threads::InterruptFrame *frame) {
+	APIC::acknowledgeLocalInterrupt();
+	Kernel::Threads::preemptIfDue(frame);
+}
+
+// IOAPIC and MSI destinations are 8-bit APIC IDs since there is no interrupt remapping
+// Only CPUs that run the dispatch loop have a run queue
+static bool canRouteTo(const APIC::CPU *cpu) {
+	return cpu && cpu->runQueue && cpu->apicId <= UINT8_MAX;
+}
+
+// Falls back to the boot CPU which is always routable
+// Must be called with routesLock held
+static APIC::CPU* leastLoadedCpu() {
+	APIC::CPU *leastLoaded = APIC::bootCpu;
+	for (auto &cpu : APIC::cpus) {
+		if (canRouteTo(&cpu) && cpu.routedInterrupts < leastLoaded->routedInterrupts) {
+			leastLoaded = &cpu;
+		}
+	}
+	return leastLoaded;
+}
+
+// Points the route's pin, MSI capability, or MSI-X entry at its vector and CPU
+// The destination is written before the IOAPIC pin is unmasked, an MSI address is a single write,
+// and an MSI-X entry is masked while it changes so the device holds its message pending,
+// hence an interrupt raised meanwhile reaches either the old or the new CPU
+// Must be called with routesLock held
+static void programRoute(const APIC::InterruptRoute &route) {
+	using namespace APIC;
+
+	if (route.type == InterruptRoute::Type::Irq) {
+		IORedirectionEntry entry = readIoRedirectionEntry(route.irq);
+		entry.vector = route.vector;
+		entry.deliveryMode = 0;
+		entry.destinationMode = 0;
+		entry.pinPolarity = 0;
+		entry.triggerMode = 0;
+		entry.mask = 0;
+		entry.destination = route.cpu->apicId;
+		writeIo(IOAPIC_READTBL_HIGH(route.irq), entry.highDword);
+		writeIo(IOAPIC_READTBL_LOW(route.irq), entry.lowDword);
+	} else if (route.type == InterruptRoute::Type::Msi) {
+		// The upper half of a 64-bit message address stays 0 and the data is the same for every destination
+		route.msi->messageAddress = APIC_MSI_ADDRESS_BASE | (route.cpu->apicId << APIC_MSI_DESTINATION_SHIFT);
+		if (route.msi->bit64Capable) {
+			((PCIe::MSI64Capability*)route.msi)->data = route.vector;
+		} else {
+			route.msi->data = route.vector;
+		}
+	} else if (route.type == InterruptRoute::Type::Msix) {
+		route.msixEntry->vectorControl = route.msixEntry->vectorControl | MSIX_ENTRY_MASKED;
+		route.msixEntry->messageAddress = APIC_MSI_ADDRESS_BASE | (route.cpu->apicId << APIC_MSI_DESTINATION_SHIFT);
+		route.msixEntry->messageAddressUpper = 0;
+		route.msixEntry->data = route.vector;
+		route.msixEntry->vectorControl = route.msixEntry->vectorControl & ~(uint32_t)MSIX_ENTRY_MASKED;
+	}
+}
@@ -3,6 +3,7 @@
 section .text
 	global disableLegacyPic
 	global enableX2Apic
+	global isTscDeadlineSupported
 
 disableLegacyPic:
 	mov al, 0xff
@@ -32,3 +33,13 @@ enableX2Apic:
 	inc rax
 x2ApicNotPresent:
 	ret
+
+isTscDeadlineSupported:
+	push rbx	; Preserve rbx to stay compatible with System V ABI
+	mov eax, 1
+	cpuid
+	xor rax, rax
+	bt ecx, 24
+	setc al
+	pop rbx
+	ret
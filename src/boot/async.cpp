@@ -1,6 +1,9 @@
 #include <async.h>
 
+// Kernel threads are not preempted while holding a spinlock
+// so that coroutines running on the same CPU never spin on a lock held by a switched out thread
 void Async::Spinlock::lock() {
+	Kernel::Threads::disablePreemption();
 	while (flag.test_and_set(std::memory_order_acquire)) {
 		while (flag.test(std::memory_order_relaxed)) {
 			__builtin_ia32_pause();
@@ -10,4 +13,218 @@ void Async::Spinlock::lock() {
 
 void Async::Spinlock::unlock() {
 	flag.clear();
+	Kernel::Threads::enablePreemption();
+}
+
+void Async::InterruptSafeSpinlock::lock() {
+	const bool interruptsEnabled = !inInterruptContext();
+	Kernel::IDT::disableInterrupts();
+	this->spinlock.lock();
+	this->interruptsEnabled = interruptsEnabled;
+}
+
+void Async::InterruptSafeSpinlock::unlock() {
+	const bool interruptsEnabled = this->interruptsEnabled;
+	this->spinlock.unlock();
+	if (interruptsEnabled) {
+		Kernel::IDT::enableInterrupts();
+	}
+}
+
+bool Async::Semaphore::Awaiter::await_ready() noexcept {
+	return this->semaphore.count.fetch_sub(1, std::memory_order_acquire) > 0;
+}
+
+bool Async::Semaphore::Awaiter::await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+	this->node.coroutine = awaitingCoroutine;
+	this->semaphore.waitLock.lock();
+	if (this->semaphore.pendingWakeups > 0) {
+		// A release already went by while this coroutine was on its way to the wait list
+		--this->semaphore.pendingWakeups;
+		this->semaphore.waitLock.unlock();
+		return false;
+	}
+	this->semaphore.waiters.push(this->node);
+	this->semaphore.waitLock.unlock();
+	return true;
+}
+
+bool Async::Semaphore::tryAcquire() noexcept {
+	int64_t permits = this->count.load(std::memory_order_relaxed);
+	while (permits > 0) {
+		if (this->count.compare_exchange_weak(permits, permits - 1, std::memory_order_acquire)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void Async::Semaphore::release() noexcept {
+	if (this->count.fetch_add(1, std::memory_order_release) >= 0) {
+		return;
+	}
+	this->waitLock.lock();
+	AwaitingNode *waiter = this->waiters.pop();
+	if (!waiter) {
+		++this->pendingWakeups;
+	}
+	this->waitLock.unlock();
+	if (waiter) {
+		Kernel::Scheduler::queueEvent(waiter->coroutine);
+	}
+}
+
+bool Async::Event::Awaiter::await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+	this->node.coroutine = awaitingCoroutine;
+	this->event.waitLock.lock();
+	if (this->event.isSet()) {
+		this->event.waitLock.unlock();
+		return false;
+	}
+	this->event.waiters.push(this->node);
+	this->event.waitLock.unlock();
+	return true;
+}
+
+void Async::Event::set() noexcept {
+	this->waitLock.lock();
+	this->signalled.store(true, std::memory_order_release);
+	AwaitingNode *waiter = this->waiters.takeAll();
+	this->waitLock.unlock();
+	while (waiter) {
+		// The node lives in the waiter's frame which may be gone as soon as it is queued
+		AwaitingNode *next = waiter->next;
+		Kernel::Scheduler::queueEvent(waiter->coroutine);
+		waiter = next;
+	}
+}
+
+void Async::Event::reset() noexcept {
+	this->signalled.store(false, std::memory_order_release);
+}
+
+// Calls the callbacks of all subscribed nodes once, later cancels do nothing
+void Async::CancellationToken::cancel() noexcept {
+	if (this->cancelled.exchange(true, std::memory_order_acq_rel)) {
+		return;
+	}
+	this->lock.lock();
+	AwaitingNode *node = this->subscribers;
+	this->subscribers = nullptr;
+	while (node) {
+		AwaitingNode *next = node->next;
+		node->next = nullptr;
+		node->callback(*node);
+		node = next;
+	}
+	this->lock.unlock();
+}
+
+// Returns false without subscribing if the token is already cancelled
+bool Async::CancellationToken::subscribe(AwaitingNode &node) noexcept {
+	this->lock.lock();
+	if (this->isCancelled()) {
+		this->lock.unlock();
+		return false;
+	}
+	node.next = this->subscribers;
+	this->subscribers = &node;
+	this->lock.unlock();
+	return true;
+}
+
+// Does nothing if the node is not subscribed, for instance after its callback has run
+void Async::CancellationToken::unsubscribe(AwaitingNode &node) noexcept {
+	this->lock.lock();
+	for (AwaitingNode **link = &this->subscribers; *link; link = &(*link)->next) {
+		if (*link == &node) {
+			*link = node.next;
+			node.next = nullptr;
+			break;
+		}
+	}
+	this->lock.unlock();
+}
+
+bool Async::RWLock::tryLock() noexcept {
+	uint64_t expected = 0;
+	return this->state.compare_exchange_strong(expected, writerBit, std::memory_order_acquire);
+}
+
+bool Async::RWLock::tryLockShared() noexcept {
+	uint64_t current = this->state.load(std::memory_order_relaxed);
+	while (!(current & (writerBit | waitersBit))) {
+		if (this->state.compare_exchange_weak(current, current + 1, std::memory_order_acquire)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns false if the lock was taken after all and the coroutine should not suspend
+bool Async::RWLock::enqueue(AwaitingNode &node, bool exclusive) noexcept {
+	this->waitLock.lock();
+	uint64_t current = this->state.load(std::memory_order_relaxed);
+	while (true) {
+		const bool available = exclusive
+			? !(current & (writerBit | readersMask))
+			: !(current & writerBit) && this->waitingWriters.empty();
+		const uint64_t desired = available
+			? (exclusive ? (current | writerBit) : (current + 1))
+			: (current | waitersBit);
+		if (this->state.compare_exchange_weak(current, desired, std::memory_order_acquire)) {
+			if (!available) {
+				(exclusive ? this->waitingWriters : this->waitingReaders).push(node);
+			}
+			this->waitLock.unlock();
+			return !available;
+		}
+	}
+}
+
+void Async::RWLock::unlock() noexcept {
+	uint64_t expected = writerBit;
+	if (this->state.compare_exchange_strong(expected, 0, std::memory_order_release)) {
+		return;
+	}
+	this->state.fetch_and(~writerBit, std::memory_order_release);
+	this->wakeWaiters();
+}
+
+void Async::RWLock::unlockShared() noexcept {
+	if (this->state.fetch_sub(1, std::memory_order_release) - 1 == waitersBit) {
+		this->wakeWaiters();
+	}
+}
+
+// Hands the lock to the next writer or else to every waiting reader at once
+// Fast paths cannot touch state while waitersBit is set and nobody holds the lock so plain stores are safe here
+void Async::RWLock::wakeWaiters() noexcept {
+	this->waitLock.lock();
+	const uint64_t current = this->state.load(std::memory_order_relaxed);
+	if ((current & (writerBit | readersMask)) || !(current & waitersBit)) {
+		// Someone took the lock in the meantime and will wake the waiters when done
+		this->waitLock.unlock();
+		return;
+	}
+	AwaitingNode *waiter = this->waitingWriters.pop();
+	if (waiter) {
+		const bool othersWaiting = !this->waitingWriters.empty() || !this->waitingReaders.empty();
+		this->state.store(writerBit | (othersWaiting ? waitersBit : 0), std::memory_order_relaxed);
+		this->waitLock.unlock();
+		Kernel::Scheduler::queueEvent(waiter->coroutine);
+		return;
+	}
+	waiter = this->waitingReaders.takeAll();
+	uint64_t readers = 0;
+	for (AwaitingNode *reader = waiter; reader; reader = reader->next) {
+		++readers;
+	}
+	this->state.store(readers, std::memory_order_relaxed);
+	this->waitLock.unlock();
+	while (waiter) {
+		AwaitingNode *next = waiter->next;
+		Kernel::Scheduler::queueEvent(waiter->coroutine);
+		waiter = next;
+	}
 }
@@ -4,6 +4,7 @@
 
 ; Access bits
 PRESENT        equ 1 << 7
+DPL_3          equ 3 << 5
 NOT_SYS        equ 1 << 4
 EXEC           equ 1 << 3
 RW             equ 1 << 1
@@ -35,6 +36,32 @@ GDT_START:
 	db GRAN_4K | LONG_MODE	; limit[16..19] (low), ignored
 	db 0	; base[24..31], ignored
 
+; SYSRET takes the user selectors from STAR[63:48] = 0x18
+; the data segment at +8 and the 64-bit code segment at +16, so keep these three in this order
+; selector 0x18 - 32-bit user code segment descriptor, only present to fix the SYSRET layout
+	dw 0xffff	; limit[0..15]
+	dw 0	; base[0..15]
+	db 0	; base[16..23]
+	db PRESENT | DPL_3 | NOT_SYS | EXEC | RW	; Access
+	db GRAN_4K | SZ_32 | 0xf	; limit[16..19]
+	db 0	; base[24..31]
+
+; selector 0x20 - 64-bit user data segment descriptor
+	dw 0	; limit[0..15], ignored
+	dw 0	; base[0..15], ignored
+	db 0	; base[16..23], ignored
+	db PRESENT | DPL_3 | NOT_SYS | RW	; Access
+	db GRAN_4K | LONG_MODE	; limit[16..19] (low), ignored
+	db 0	; base[24..31], ignored
+
+; selector 0x28 - 64-bit user code segment descriptor
+	dw 0	; limit[0..15], ignored
+	dw 0	; base[0..15], ignored
+	db 0	; base[16..23], ignored
+	db PRESENT | DPL_3 | NOT_SYS | EXEC | RW	; Access
+	db GRAN_4K | LONG_MODE	; limit[16..19] (low), ignored
+	db 0	; base[24..31], ignored
+
 	times 4096 - ($-$$) db 0	; Make the GDT 4 KiB long
 GDT_END:
 
@@ -1,3 +1,4 @@
+#include <async.h>
 #include <cstring>
 #include <kernel.h>
 #include <terminal.h>
@@ -5,6 +6,8 @@
 // The heap region list cannot be a vector unfortunately
 // since std::vector itself uses new internally which requires a heap
 static Kernel::Memory::Heap::Header *heapList = nullptr;
+// Guards heapList and every region in it, any CPU may allocate at any time
+static Async::InterruptSafeSpinlock heapLock;
 
 static bool validHeap(Kernel::Memory::Heap::Header *heap);
 static Kernel::Memory::Heap::Entry* nextHeapEntry(
@@ -36,6 +39,7 @@ const size_t Kernel::Memory::Heap::entryTableSize = Kernel::Memory::Heap::newReg
 // Returns a memory chunk from one of the kernel heap regions
 // Unsafe to call before at least one heap region is created
 void* Kernel::Memory::Heap::allocate(size_t count) {
+	heapLock.lock();
 	if (!heapList) {
 		terminalPrintString(noHeapsStr, strlen(noHeapsStr));
 		panic();
@@ -100,16 +104,19 @@ void* Kernel::Memory::Heap::allocate(size_t count) {
 	currentHeap = heapList;
 	while (currentHeap) {
 		if (!validHeap(currentHeap)) {
+			heapLock.unlock();
 			return nullptr;
 		}
 		currentHeap = currentHeap->next;
 	}
 
+	heapLock.unlock();
 	return allocatedValue;
 }
 
 void Kernel::Memory::Heap::free(void *address) {
 	uint64_t addr = (uint64_t)address;
+	heapLock.lock();
 	Header *heap = heapList;
 	bool freed = false;
 	while (heap) {
@@ -145,11 +152,13 @@ void Kernel::Memory::Heap::free(void *address) {
 	Header *currentHeap = heapList;
 	while (currentHeap) {
 		if (!validHeap(currentHeap)) {
+			heapLock.unlock();
 			return;
 		}
 		currentHeap = currentHeap->next;
 	}
 
+	heapLock.unlock();
 	if (freed) {
 		return;
 	}
@@ -185,6 +194,8 @@ static bool validHeap(Kernel::Memory::Heap::Header *heap) {
 // and adds it to the heap regions list
 // Assumes the newHeapAddress passed is a region in kernel address space
 // of total size of heap + entry table
+// The region is set up before it is linked under the heap lock,
+// which is not held while pages are requested since the virtual memory manager allocates from the heap
 // Returns true if the operation was successful
 bool Kernel::Memory::Heap::create(void *newHeapAddress, void **entryTable) {
 	const size_t heapPageCount = newRegionSize / pageSize;
@@ -221,7 +232,16 @@ bool Kernel::Memory::Heap::create(void *newHeapAddress, void **entryTable) {
 	) {
 		return false;
 	}
-	Header *currentHeap = nullptr;
+	Header *currentHeap = (Header*)newHeapAddress;
+	currentHeap->entryCount = 0;
+	currentHeap->entryTable = entryTable;
+	currentHeap->remaining = newRegionSize - sizeof(Header) - sizeof(Entry);
+	currentHeap->size = newRegionSize;
+	currentHeap->next = nullptr;
+	Entry *freeEntry = (Entry*)((uint64_t)currentHeap + sizeof(Header));
+	freeEntry->signature = Signature::Free;
+	freeEntry->size = currentHeap->remaining;
+	heapLock.lock();
 	if (!heapList) {
 		heapList = (Header*)newHeapAddress;
 		heapList->previous = nullptr;
@@ -233,15 +253,7 @@ bool Kernel::Memory::Heap::create(void *newHeapAddress, void **entryTable) {
 		currentHeap->next = (Header*)newHeapAddress;
 		((Header*)newHeapAddress)->previous = currentHeap;
 	}
-	currentHeap = (Header*)newHeapAddress;
-	currentHeap->entryCount = 0;
-	currentHeap->entryTable = entryTable;
-	currentHeap->remaining = newRegionSize - sizeof(Header) - sizeof(Entry);
-	currentHeap->size = newRegionSize;
-	currentHeap->next = nullptr;
-	Entry *freeEntry = (Entry*)((uint64_t)currentHeap + sizeof(Header));
-	freeEntry->signature = Signature::Free;
-	freeEntry->size = currentHeap->remaining;
+	heapLock.unlock();
 	return true;
 }
 
@@ -292,6 +304,7 @@ static bool validHeapEntry(
 void Kernel::Memory::Heap::listRegions(bool forwardDirection) {
 	terminalPrintString(listStr, strlen(listStr));
 	terminalPrintString(listHeaderStr, strlen(listHeaderStr));
+	heapLock.lock();
 	Header *currentHeap = heapList;
 	if (!forwardDirection) {
 		while (currentHeap->next) {
@@ -309,4 +322,5 @@ void Kernel::Memory::Heap::listRegions(bool forwardDirection) {
 		terminalPrintChar('\n');
 		currentHeap = forwardDirection ? currentHeap->next : currentHeap->previous;
 	}
+	heapLock.unlock();
 }
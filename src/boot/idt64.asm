@@ -1,5 +1,20 @@
 [bits 64]
 
+; Keep in sync with IDT_DYNAMIC_VECTOR_START, IDT_DYNAMIC_VECTOR_END, and IDT_VECTOR_STUB_SIZE in kernel.h
+DYNAMIC_VECTOR_START equ 0x20
+DYNAMIC_VECTOR_END equ 0xf0
+VECTOR_STUB_SIZE equ 16
+VECTOR_HANDLER_SIZE equ 16	; sizeof(Kernel::IDT::VectorHandler)
+
+; Swaps in the kernel GS base if the interrupt frame with its cs at given offset from rsp leaves or returns to ring 3
+; See APIC::setCurrentCpu
+%macro SWAPGS_IF_USER 1
+	test byte [rsp + %1], 3
+	jz %%kernel
+	swapgs
+%%kernel:
+%endmacro
+
 section .bss align=16
 IDT_START:
 	resb 4096	; Make the 64-bit IDT 4 KiB long
@@ -26,10 +41,6 @@ idtDescriptor:
 	withErrorStr db ' with error ', 0
 	onCpuStr db ' on CPU [', 0
 
-section .data align=16
-	global availableInterrupt
-	availableInterrupt dq 0x20
-
 section .text
 	extern doneStr
 	extern ellipsisStr
@@ -37,6 +48,7 @@ section .text
 	extern terminalPrintDecimal
 	extern terminalPrintHex
 	extern terminalPrintString
+	extern vectorHandlers
 	global boundRangeHandler
 	global breakpointHandler
 	global debugHandler
@@ -44,6 +56,7 @@ section .text
 	global divisionByZeroHandler
 	global doubleFaultHandler
 	global enableInterrupts
+	global extendedStateVectorStubs
 	global gpFaultHandler
 	global invalidOpcodeHandler
 	global loadIdt
@@ -51,6 +64,7 @@ section .text
 	global noSseHandler
 	global overflowHandler
 	global pageFaultHandler
+	global vectorStubs
 loadIdt:
 	lidt [idtDescriptor]
 	ret
@@ -64,6 +78,7 @@ enableInterrupts:
 	ret
 
 divisionByZeroHandler:
+	SWAPGS_IF_USER 8
 	push rdi	; Align stack to 16-byte boundary
 	mov rdi, divisionByZeroStr
 	xor rsi, rsi
@@ -88,6 +103,7 @@ divisionByZeroHandler:
 	iretq
 
 debugHandler:
+	SWAPGS_IF_USER 8
 	push rdi	; Align stack to 16-byte boundary
 	mov rdi, debugStr
 	xor rsi, rsi
@@ -112,6 +128,7 @@ debugHandler:
 	iretq
 
 nmiHandler:
+	SWAPGS_IF_USER 8
 	push rdi	; Align stack to 16-byte boundary
 	mov rdi, nmiHandlerStr
 	xor rsi, rsi
@@ -131,6 +148,7 @@ nmiHandler:
 	iretq
 
 breakpointHandler:
+	SWAPGS_IF_USER 8
 	push rdi	; Align stack to 16-byte boundary
 	mov rdi, breakpointStr
 	xor rsi, rsi
@@ -155,6 +173,7 @@ breakpointHandler:
 	iretq
 
 overflowHandler:
+	SWAPGS_IF_USER 8
 	push rdi	; Align stack to 16-byte boundary
 	mov rdi, overflowStr
 	xor rsi, rsi
@@ -179,6 +198,7 @@ overflowHandler:
 	iretq
 
 boundRangeHandler:
+	SWAPGS_IF_USER 8
 	push rdi	; Align stack to 16-byte boundary
 	mov rdi, boundRangeStr
 	xor rsi, rsi
@@ -203,6 +223,7 @@ boundRangeHandler:
 	iretq
 
 invalidOpcodeHandler:
+	SWAPGS_IF_USER 8
 	push rdi	; Align stack to 16-byte boundary
 	mov rdi, invalidOpcodeStr
 	xor rsi, rsi
@@ -227,6 +248,7 @@ invalidOpcodeHandler:
 	iretq
 
 noSseHandler:
+	SWAPGS_IF_USER 8
 	push rdi	; Align stack to 16-byte boundary
 	mov rdi, noSseStr
 	xor rsi, rsi
@@ -251,6 +273,7 @@ noSseHandler:
 	iretq
 
 doubleFaultHandler:
+	SWAPGS_IF_USER 16	; Above the error code
 	mov rdi, doubleFaultStr
 	xor rsi, rsi
 	mov sil, 13
@@ -269,6 +292,7 @@ doubleFaultHandler:
 	iretq
 
 gpFaultHandler:
+	SWAPGS_IF_USER 16	; Above the error code
 	mov rdi, gpFaultStr
 	xor rsi, rsi
 	mov sil, 29
@@ -300,6 +324,7 @@ gpFaultHandler:
 	iretq
 
 pageFaultHandler:
+	SWAPGS_IF_USER 16	; Above the error code
 	mov rdi, pageFaultStr1
 	xor rsi, rsi
 	mov sil, 15
@@ -343,3 +368,74 @@ pageFaultHandler:
 	cli
 	hlt
 	iretq
+
+; Saves the registers a C++ call may clobber, calls vectorHandlers[vector].handler(vectorHandlers[vector].context, frame)
+; with the vector pushed by a stub on top of the interrupt frame, and restores the registers
+; The handler keeps rbx, rbp, and r12 to r15 intact itself like any C++ function
+%macro CALL_VECTOR_HANDLER 0
+	push rax
+	push rcx
+	push rdx
+	push rsi
+	push rdi
+	push r8
+	push r9
+	push r10
+	push r11
+	sub rsp, 8	; Align stack to 16-byte boundary
+	cld
+	mov rax, [rsp + 80]	; Vector is above the padding and the 9 saved registers
+	lea rsi, [rsp + 88]	; Interrupt frame pushed by the CPU is above the vector
+	shl rax, 4	; VECTOR_HANDLER_SIZE
+	mov rdi, [vectorHandlers + rax + 8]
+	call [vectorHandlers + rax]
+	add rsp, 8
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdi
+	pop rsi
+	pop rdx
+	pop rcx
+	pop rax
+%endmacro
+
+%macro VECTOR_STUBS 1
+%assign vector DYNAMIC_VECTOR_START
+%rep DYNAMIC_VECTOR_END - DYNAMIC_VECTOR_START
+	push qword vector
+	jmp %1
+	align VECTOR_STUB_SIZE
+%assign vector vector + 1
+%endrep
+%endmacro
+
+; Two stubs per dynamic vector, IDT::allocateVector installs the one of the vector it hands out
+; Each stub pushes its vector and jumps to the common entry that calls the handler registered for it
+align VECTOR_STUB_SIZE
+vectorStubs:
+	VECTOR_STUBS interruptCommon
+
+align VECTOR_STUB_SIZE
+extendedStateVectorStubs:
+	VECTOR_STUBS extendedStateInterruptCommon
+
+; Leaves the SSE registers alone, the handler must not use them
+interruptCommon:
+	SWAPGS_IF_USER 16	; Above the vector and rip
+	CALL_VECTOR_HANDLER
+	SWAPGS_IF_USER 16	; The handler may have changed the frame
+	add rsp, 8	; Drop the vector
+	iretq
+
+; Also saves the x87 and SSE state for handlers that use it
+; FXSAVE covers all the extended state since XCR0 is never set up, see sse4.asm
+extendedStateInterruptCommon:
+	fxsave64 [rsp + 64]		; 40 bytes of IRQ stack frame + 8 bytes of vector + 16-byte offset into InterruptDataZone
+	SWAPGS_IF_USER 16
+	CALL_VECTOR_HANDLER
+	SWAPGS_IF_USER 16
+	fxrstor64 [rsp + 64]
+	add rsp, 8	; Drop the vector
+	iretq
@@ -8,7 +8,6 @@
 #include <drivers/ps2/mouse.h>
 #include <drivers/storage/ahci/controller.h>
 #include <drivers/storage/ahci/device.h>
-#include <drivers/timers.h>
 #include <kernel.h>
 #include <pcie.h>
 #include <random.h>
@@ -41,14 +40,21 @@ static const char* const creatingTssStr = "Creating TSS";
 static const char* const loadingIdtStr = "Loading IDT";
 static const char* const createStackStr = "Creating stack";
 static const char* const apuInitDoneStr = "CPUs initialized\n\n";
+static const char* const calibratingTimerStr = "Calibrating local APIC timer";
 
 static Async::Thenable<void> startPcieDrivers();
 static Async::Thenable<void> createFileSystems();
 static Async::Thenable<void> findRootFs();
 static Async::Thenable<void> bootApus();
 static Async::Thenable<void> initPs2Devices();
+static uint8_t reserveVector();
 
 static Kernel::ApuAwaiter *apuAwaiter = nullptr;
+static std::atomic<uint64_t> usedVectors[256 / 64] = {};	// bitmap of vectors handed out by IDT::allocateVector
+
+static_assert(sizeof(Kernel::IDT::VectorHandler) == 16, "VECTOR_HANDLER_SIZE in idt64.asm is out of date");
+
+Kernel::IDT::VectorHandler Kernel::IDT::vectorHandlers[256] = {};
 
 bool Kernel::debug = false;
 InfoTable Kernel::infoTable;
@@ -156,6 +162,10 @@ extern "C" [[noreturn]] void bpuMain(
 	if (!APIC::bootCpu) {
 		Kernel::panic();
 	}
+	APIC::setCurrentCpu(APIC::bootCpu);
+	Kernel::Memory::Virtual::refillPageTablePool();
+	Kernel::Scheduler::initializeCpu();
+	Kernel::Tasks::initializeCpu();
 
 	// Create TSS and install it
 	terminalPrintString(creatingTssStr, strlen(creatingTssStr));
@@ -190,14 +200,36 @@ extern "C" [[noreturn]] void bpuMain(
 	terminalPrintChar('\n');
 	terminalPrintChar('\n');
 
+	if (!Kernel::Memory::Virtual::initializeTlbShootdown()) {
+		Kernel::panic();
+	}
+
 	if (!Kernel::Scheduler::start()) {
 		Kernel::panic();
 	}
 
+	if (!Kernel::Time::initialize()) {
+		Kernel::panic();
+	}
+
+	terminalPrintString(calibratingTimerStr, strlen(calibratingTimerStr));
+	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
+	if (!APIC::initializeTimer()) {
+		terminalPrintString(failedStr, strlen(failedStr));
+		terminalPrintChar('\n');
+		Kernel::panic();
+	}
+	terminalPrintString(doneStr, strlen(doneStr));
+	terminalPrintChar('\n');
+
 	Kernel::IDT::enableInterrupts();
 	terminalPrintString(enabledInterruptsStr, strlen(enabledInterruptsStr));
 	terminalPrintChar('\n');
 
+	if (!Kernel::Tasks::startSyscallBenchmark(SYSCALL_BENCHMARK_ITERATIONS)) {
+		Kernel::panic();
+	}
+
 	// Enumerate PCIe devices
 	if (!PCIe::enumerate()) {
 		Kernel::panic();
@@ -216,8 +248,8 @@ extern "C" [[noreturn]] void bpuMain(
 			.then(initPs2Devices);
 	#pragma GCC diagnostic pop
 
-	// Wait perpetually and let the scheduler and interrupts do their thing
-	Kernel::perpetualWait();
+	// Run events from now on along with all the APUs
+	Kernel::Scheduler::dispatchLoop();
 }
 
 static Async::Thenable<void> initPs2Devices() {
@@ -231,7 +263,7 @@ static Async::Thenable<void> initPs2Devices() {
 
 	while (true) {
 		terminalPrintString("bbbbbbbbbb\n", 11);
-		Drivers::Timers::spinDelay(1000);
+		co_await Async::sleepFor(1000000);
 	}
 	co_return;
 }
@@ -257,6 +289,38 @@ bool Kernel::IDT::setup() {
 	return true;
 }
 
+// Installs handler at the lowest free vector in [IDT_DYNAMIC_VECTOR_START, IDT_DYNAMIC_VECTOR_END)
+// The IDT is shared so the vector means the same on every CPU, route it to a CPU with APIC::routeIrq or APIC::routeMsi
+// handler is called with context through the vector's stub in idt64.asm, which saves only the registers
+// a C++ call may clobber, so one handler can serve many vectors
+// The SSE registers are left as they are unless saveExtendedState is set, handlers that do not set it must not
+// touch them, so they must live in translation units built with -mgeneral-regs-only and not call code that is not
+// Returns 0 if all vectors are in use
+uint8_t Kernel::IDT::allocateVector(InterruptHandler handler, void *context, bool saveExtendedState) {
+	const uint8_t vector = reserveVector();
+	if (vector) {
+		vectorHandlers[vector] = {.handler = handler, .context = context};
+		uint8_t *stubs = saveExtendedState ? extendedStateVectorStubs : vectorStubs;
+		installEntry(
+			vector,
+			(void (*)())&stubs[(vector - IDT_DYNAMIC_VECTOR_START) * IDT_VECTOR_STUB_SIZE],
+			2
+		);
+	}
+	return vector;
+}
+
+// Makes a vector from allocateVector available again
+// Whatever routes to it must be removed first, an interrupt arriving afterwards raises a general protection fault
+void Kernel::IDT::freeVector(uint8_t vector) {
+	if (vector < IDT_DYNAMIC_VECTOR_START || vector >= IDT_DYNAMIC_VECTOR_END) {
+		return;
+	}
+	idt64Base[vector].present = 0;
+	vectorHandlers[vector] = {.handler = nullptr, .context = nullptr};
+	usedVectors[vector / 64].fetch_and(~((uint64_t)1 << (vector % 64)), std::memory_order_release);
+}
+
 bool Kernel::IDT::installEntry(uint8_t interruptNumber, void (*handler)(), uint8_t ist) {
 	if (ist > 7) {
 		return false;
@@ -333,6 +397,7 @@ extern "C" [[noreturn]] void apuMain() {
 	if (!enableSse4()) {
 		Kernel::panic();
 	}
+	Kernel::Memory::Virtual::loadPat();
 	terminalPrintString(onlineStr, strlen(onlineStr));
 	terminalPrintSpaces4();
 	terminalPrintSpaces4();
@@ -374,6 +439,10 @@ extern "C" [[noreturn]] void apuMain() {
 	for (auto &cpu : APIC::cpus) {
 		if (cpu.apicId == apuApicId) {
 			cpu.apicPhyAddr = Kernel::readMsr(Kernel::MSR::x2ApicEnable) & 0xffffff000;
+			APIC::setCurrentCpu(&cpu);
+			Kernel::Memory::Virtual::refillPageTablePool();
+			Kernel::Scheduler::initializeCpu();
+			Kernel::Tasks::initializeCpu();
 			break;
 		}
 	}
@@ -410,6 +479,18 @@ extern "C" [[noreturn]] void apuMain() {
 	terminalPrintString(doneStr, strlen(doneStr));
 	terminalPrintChar('\n');
 
+	terminalPrintSpaces4();
+	terminalPrintSpaces4();
+	terminalPrintString(calibratingTimerStr, strlen(calibratingTimerStr));
+	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
+	if (!APIC::initializeTimer()) {
+		terminalPrintString(failedStr, strlen(failedStr));
+		terminalPrintChar('\n');
+		Kernel::panic();
+	}
+	terminalPrintString(doneStr, strlen(doneStr));
+	terminalPrintChar('\n');
+
 	terminalPrintSpaces4();
 	terminalPrintSpaces4();
 	Kernel::IDT::enableInterrupts();
@@ -418,16 +499,11 @@ extern "C" [[noreturn]] void apuMain() {
 	if (apuAwaiter) {
 		apuAwaiter->resumeBpu();
 	}
+	// The resumed coroutine checks this CPU's TSC against its own meanwhile
+	Kernel::Time::syncTsc();
 
-	char tag[13] = "aaaaaaaaaaa\n";
-	tag[10] = '0' + apuApicId;
-	while (true) {
-		terminalPrintString(tag, 12);
-		Drivers::Timers::spinDelay(10000);
-	}
-
-	// Wait perpetually and let the scheduler and interrupts do their thing
-	Kernel::perpetualWait();
+	// Run events along with the other CPUs
+	Kernel::Scheduler::dispatchLoop();
 }
 
 static Async::Thenable<void> bootApus() {
@@ -497,6 +573,7 @@ static Async::Thenable<void> bootApus() {
 			terminalPrintString(sipiSentStr, strlen(sipiSentStr));
 			terminalPrintString(ellipsisStr, strlen(ellipsisStr));
 			co_await Kernel::ApuAwaiter(cpu.apicId);
+			Kernel::Time::serveTscSync();
 			terminalPrintSpaces4();
 			terminalPrintSpaces4();
 			terminalPrintString(initApuDoneStr, strlen(initApuDoneStr));
@@ -504,6 +581,9 @@ static Async::Thenable<void> bootApus() {
 		}
 	}
 
+	// Interrupts routed so far all target the boot CPU
+	APIC::rebalanceInterrupts();
+
 	terminalPrintString(apuInitDoneStr, strlen(apuInitDoneStr));
 	co_return;
 }
@@ -528,8 +608,10 @@ static Async::Thenable<void> startPcieDrivers() {
 static Async::Thenable<void> findRootFs() {
 	using namespace Drivers;
 	
+	// Look for the root FS marker file on every filesystem at once
+	std::vector<Async::Thenable<FS::OpenFileResult>> lookups;
 	for (const auto &fs : FS::filesystems) {
-		const auto rootFsResult = std::move(co_await FS::openFile(
+		lookups.push_back(FS::openFile(
 			(
 				std::string("/boot/") +
 				std::string(Kernel::infoTable.rootFsGuid, Kernel::infoTable.rootFsGuid + 36) +
@@ -538,9 +620,13 @@ static Async::Thenable<void> findRootFs() {
 			FS::OpenFileType::Read,
 			fs
 		));
+	}
+	const auto rootFsResults = std::move(co_await Async::whenAll(std::move(lookups)));
+	for (size_t i = 0; i < rootFsResults.size(); ++i) {
+		const auto &rootFsResult = rootFsResults.at(i);
 		if (rootFsResult.status == FS::Status::Ok) {
 			co_await FS::closeFile(rootFsResult.file);
-			FS::root = fs;
+			FS::root = FS::filesystems.at(i);
 		} else {
 			terminalPrintString(rootFailStr, strlen(rootFailStr));
 			terminalPrintString(withErrorStr, strlen(withErrorStr));
@@ -571,29 +657,41 @@ static Async::Thenable<void> createFileSystems() {
 	terminalPrintChar('\n');
 
 	// Create filesystems from AHCI devices
+	// Probe every device at once and add the filesystems found in device order
+	struct Probe {
+		size_t controllerNumber;
+		std::shared_ptr<AHCI::Device> device;
+	};
+	std::vector<Probe> probes;
+	std::vector<Async::Thenable<std::shared_ptr<FS::JolietISO>>> isoProbes;
 	for (size_t controllerCount = 0; const auto &controller : AHCI::controllers) {
 		for (const auto &device : controller.getDevices()) {
 			// Try with JolietISO for SATAPI devices first because that is the most likely FS
 			if (AHCI::Device::Type::Satapi == device->getType()) {
-				auto iso = std::move(co_await FS::JolietISO::isJolietIso(device));
-				if (iso) {
-					FS::filesystems.push_back(iso);
-					terminalPrintSpaces4();
-					iso->getGuid().print(true);
-					terminalPrintChar(' ');
-					terminalPrintString(isoFoundStr, strlen(isoFoundStr));
-					terminalPrintChar(' ');
-					terminalPrintString(atAhciStr, strlen(atAhciStr));
-					terminalPrintChar(' ');
-					terminalPrintDecimal(controllerCount);
-					terminalPrintChar(':');
-					terminalPrintDecimal(device->getPortNumber());
-					terminalPrintChar('\n');
-				}
+				probes.push_back({.controllerNumber = controllerCount, .device = device});
+				isoProbes.push_back(FS::JolietISO::isJolietIso(device));
 			}
 		}
 		++controllerCount;
 	}
+	const auto isos = std::move(co_await Async::whenAll(std::move(isoProbes)));
+	for (size_t i = 0; i < isos.size(); ++i) {
+		const auto &iso = isos.at(i);
+		if (iso) {
+			FS::filesystems.push_back(iso);
+			terminalPrintSpaces4();
+			iso->getGuid().print(true);
+			terminalPrintChar(' ');
+			terminalPrintString(isoFoundStr, strlen(isoFoundStr));
+			terminalPrintChar(' ');
+			terminalPrintString(atAhciStr, strlen(atAhciStr));
+			terminalPrintChar(' ');
+			terminalPrintDecimal(probes.at(i).controllerNumber);
+			terminalPrintChar(':');
+			terminalPrintDecimal(probes.at(i).device->getPortNumber());
+			terminalPrintChar('\n');
+		}
+	}
 
 	// Create filesystems from other device types here when appropriate drivers are added
 
@@ -616,18 +714,14 @@ void Kernel::panic() {
 	Kernel::hangSystem();
 }
 
-Kernel::ApuAwaiter::ApuAwaiter(uint32_t apicId) : apicId(apicId) {}
+Kernel::ApuAwaiter::ApuAwaiter(uint32_t apicId) : apicId(apicId), awaitingCoroutine(nullptr) {}
 
 Kernel::ApuAwaiter::~ApuAwaiter() {
-	if (this->awaitingCoroutine) {
-		delete this->awaitingCoroutine;
-		this->awaitingCoroutine = nullptr;
-	}
 	apuAwaiter = nullptr;
 }
 
 void Kernel::ApuAwaiter::await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
-	this->awaitingCoroutine = new std::coroutine_handle<>(awaitingCoroutine);
+	this->awaitingCoroutine = awaitingCoroutine;
 	apuAwaiter = this;
 	Kernel::writeMsr(Kernel::MSR::x2ApicErrorStatus, 0);
 	Kernel::writeMsr(Kernel::MSR::x2ApicInterruptCommand, ((uint64_t)apicId << 32) | 0x4600 | (APU_BOOTLOADER_ORIGIN >> 12));
@@ -635,6 +729,17 @@ void Kernel::ApuAwaiter::await_suspend(std::coroutine_handle<> awaitingCoroutine
 
 void Kernel::ApuAwaiter::resumeBpu() noexcept {
 	if (this->awaitingCoroutine) {
-		Kernel::Scheduler::queueEvent(*this->awaitingCoroutine);
+		Kernel::Scheduler::queueEvent(this->awaitingCoroutine);
+	}
+}
+
+// Claims the lowest free dynamic vector, returns 0 if there is none
+static uint8_t reserveVector() {
+	for (size_t vector = IDT_DYNAMIC_VECTOR_START; vector < IDT_DYNAMIC_VECTOR_END; ++vector) {
+		const uint64_t bit = (uint64_t)1 << (vector % 64);
+		if (!(usedVectors[vector / 64].fetch_or(bit, std::memory_order_acq_rel) & bit)) {
+			return vector;
+		}
 	}
+	return 0;
 }
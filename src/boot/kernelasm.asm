@@ -1,6 +1,23 @@
 [bits 64]
 
 CPU_STACK_SIZE equ 0x10000
+MSR_GS_BASE equ 0xc0000101
+
+; Points the GS base at noCurrentCpu so that APIC::getCurrentCpu returns nullptr until setCurrentCpu
+; Must come after the last segment register load, which clears the GS base
+%macro CLEAR_CURRENT_CPU 0
+	push rdx
+	mov ecx, MSR_GS_BASE
+	mov rax, noCurrentCpu
+	mov rdx, rax
+	shr rdx, 32
+	wrmsr
+	pop rdx
+%endmacro
+
+section .rodata align=8
+noCurrentCpu:
+	dq 0	; APIC::CPU::self
 
 ;Reserve space for BPU stack
 section .bss align=16
@@ -21,6 +38,7 @@ bpuLongModeStart:
 	mov ss, ax
 	mov rsp, bpuStack + CPU_STACK_SIZE
 	xor rbp, rbp
+	CLEAR_CURRENT_CPU
 
 	; Setup 64-bit GDT
 	lgdt [gdtDescriptor]
@@ -29,7 +47,9 @@ bpuLongModeStart:
 
 section .text
 	extern apuMain
+	global flushCurrentTLB
 	global flushTLB
+	global flushTLBEntry
 	global haltSystem
 	global hangSystem
 	global loadTss
@@ -48,14 +68,24 @@ apuLongModeStart:
 	mov ss, ax
 	mov rsp, rdi
 	xor rbp, rbp
+	CLEAR_CURRENT_CPU
 	call apuMain
 
+flushCurrentTLB:
+	mov rax, cr3
+	mov cr3, rax
+	ret
+
 flushTLB:
 	cli
 	mov cr3, rdi
 	; FIXME: must set the interrupt flag back to its original state
 	ret
 
+flushTLBEntry:
+	invlpg [rdi]
+	ret
+
 haltSystem:
 	hlt
 	ret
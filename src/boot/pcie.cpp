@@ -4,8 +4,16 @@
 #include <pcie.h>
 #include <terminal.h>
 
+#define PCI_BAR_IO_SPACE 0x1
+#define PCI_BAR_TYPE_64 0x4
+#define PCI_BAR_TYPE_MASK 0x6
+#define PCI_BAR_PREFETCHABLE 0x8
+#define PCI_BAR_ADDRESS_MASK (~(uint64_t)0xf)
 #define PCI_CAPABILITIES_LIST_AVAILABLE (1 << 4)
 #define PCI_MSI_CAPABAILITY_ID 0x5
+#define PCI_MSIX_CAPABILITY_ID 0x11
+#define PCI_MSIX_BAR_INDEX_MASK 0x7
+#define PCI_MSIX_ENTRY_MASKED 1
 
 #define PCI_BUS_COUNT 256
 #define PCI_DEVICE_COUNT 32
@@ -15,7 +23,13 @@
 
 static bool enumerateBus(uint64_t baseAddress, uint8_t bus);
 static bool enumerateDevice(uint64_t baseAddress, uint8_t bus, uint8_t device);
-static bool enumerateFunction(uint8_t function, PCIe::BaseHeader *pcieHeader, PCIe::MSICapability **msi);
+static bool enumerateFunction(
+	uint8_t function,
+	PCIe::BaseHeader *pcieHeader,
+	PCIe::MSICapability **msi,
+	PCIe::MSIXCapability **msix
+);
+static void* mapBarPages(const PCIe::Function &function, size_t barIndex, size_t firstPage, size_t pageCount, bool uncached);
 static void* mapBDFPage(uint64_t baseAddress, uint8_t bus, uint8_t device, uint8_t function);
 
 static const char* const initPciStr = "Enumerating PCIe devices";
@@ -28,6 +42,7 @@ static const char* const deviceStr = " device ";
 static const char* const multiStr = " multi function";
 static const char* const funcStr = "Function ";
 static const char* const msiStr = "[msi]";
+static const char* const msixStr = "[msi-x]";
 static const char* const unmapFailStr = "Failed to unmap configuration page";
 
 std::vector<PCIe::Function> PCIe::functions;
@@ -62,6 +77,81 @@ bool PCIe::enumerate() {
 	return true;
 }
 
+// Maps pageCount pages of a memory BAR of a type 0 function to kernel address space
+// Prefetchable BARs are mapped write-combining so that writes can be burst, others are mapped uncached
+// Returns nullptr if the BAR is an I/O space BAR or the mapping fails
+void* PCIe::mapBar(const Function &function, size_t barIndex, size_t pageCount) {
+	return mapBarPages(function, barIndex, 0, pageCount, false);
+}
+
+// Maps the MSI-X table of a function to kernel address space uncached with every entry masked
+// Returns nullptr if the function has no MSI-X capability or the mapping fails
+volatile PCIe::MSIXTableEntry* PCIe::mapMsixTable(const Function &function) {
+	using namespace Kernel::Memory;
+
+	if (!function.msix) {
+		return nullptr;
+	}
+	const size_t entryCount = function.msix->tableSize + 1;
+	const uint32_t offset = function.msix->table & ~(uint32_t)PCI_MSIX_BAR_INDEX_MASK;
+	const size_t firstPage = offset / pageSize;
+	const size_t pageCount = (offset % pageSize + entryCount * sizeof(MSIXTableEntry) + pageSize - 1) / pageSize;
+	// The table must not be write-combined even if it lives in a prefetchable BAR
+	void *pages = mapBarPages(function, function.msix->table & PCI_MSIX_BAR_INDEX_MASK, firstPage, pageCount, true);
+	if (!pages) {
+		return nullptr;
+	}
+	volatile MSIXTableEntry *table = (volatile MSIXTableEntry*)((uint64_t)pages + offset % pageSize);
+	for (size_t i = 0; i < entryCount; ++i) {
+		table[i].vectorControl = table[i].vectorControl | PCI_MSIX_ENTRY_MASKED;
+	}
+	return table;
+}
+
+static void* mapBarPages(const PCIe::Function &function, size_t barIndex, size_t firstPage, size_t pageCount, bool uncached) {
+	using namespace Kernel::Memory;
+
+	if (barIndex > 5 || pageCount == 0) {
+		return nullptr;
+	}
+	uint32_t *bars = (uint32_t*)((uint64_t)function.configurationSpace + sizeof(PCIe::BaseHeader));
+	uint64_t bar = bars[barIndex];
+	if (bar & PCI_BAR_IO_SPACE) {
+		return nullptr;
+	}
+	if ((bar & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64) {
+		if (barIndex == 5) {
+			return nullptr;
+		}
+		bar |= (uint64_t)bars[barIndex + 1] << 32;
+	}
+	PageRequestResult requestResult = Virtual::requestPages(
+		pageCount,
+		(
+			RequestType::Kernel |
+			RequestType::PhysicalContiguous |
+			RequestType::VirtualContiguous
+		)
+	);
+	if (
+		requestResult.address != INVALID_ADDRESS &&
+		requestResult.allocatedCount == pageCount &&
+		Virtual::mapPages(
+			requestResult.address,
+			(void*)((bar & PCI_BAR_ADDRESS_MASK) + firstPage * pageSize),
+			pageCount,
+			RequestType::Writable | (
+				(!uncached && (bar & PCI_BAR_PREFETCHABLE)) ?
+					RequestType::WriteCombining :
+					RequestType::CacheDisable
+			)
+		)
+	) {
+		return requestResult.address;
+	}
+	return nullptr;
+}
+
 static void* mapBDFPage(uint64_t baseAddress, uint8_t bus, uint8_t device, uint8_t function) {
 	using namespace Kernel::Memory;
 
@@ -98,7 +188,12 @@ static bool enumerateBus(uint64_t baseAddress, uint8_t bus) {
 	return true;
 }
 
-static bool enumerateFunction(uint8_t function, PCIe::BaseHeader *pcieHeader, PCIe::MSICapability **msi) {
+static bool enumerateFunction(
+	uint8_t function,
+	PCIe::BaseHeader *pcieHeader,
+	PCIe::MSICapability **msi,
+	PCIe::MSIXCapability **msix
+) {
 	terminalPrintSpaces4();
 	terminalPrintSpaces4();
 	terminalPrintSpaces4();
@@ -114,25 +209,27 @@ static bool enumerateFunction(uint8_t function, PCIe::BaseHeader *pcieHeader, PC
 		// FIXME: should enumerate secondary bus
 	}
 
-	// Enumerate all capabilities and find MSI64 (64-bit capable message signaled interrupt capability)
+	// Enumerate all capabilities and find MSI (message signaled interrupt) and MSI-X capabilities
+	*msi = nullptr;
+	*msix = nullptr;
 	if (pcieHeader->status & PCI_CAPABILITIES_LIST_AVAILABLE) {
 		uint8_t capabilityOffset = ((PCIe::Type0Header*)pcieHeader)->capabilities;
-		bool msiFound = false;
 		while (capabilityOffset != 0) {
 			uint8_t *capabilityId = (uint8_t*)((uint64_t)pcieHeader + capabilityOffset);
 			if (*capabilityId == PCI_MSI_CAPABAILITY_ID) {
 				*msi = (PCIe::MSICapability*)capabilityId;
-				msiFound = true;
-				break;
-			} else {
-				capabilityOffset = *(capabilityId + 1);
+			} else if (*capabilityId == PCI_MSIX_CAPABILITY_ID) {
+				*msix = (PCIe::MSIXCapability*)capabilityId;
 			}
+			capabilityOffset = *(capabilityId + 1);
 		}
-		if (msiFound) {
+		if (*msi) {
 			terminalPrintChar(' ');
 			terminalPrintString(msiStr, strlen(msiStr));
-		} else {
-			*msi = nullptr;
+		}
+		if (*msix) {
+			terminalPrintChar(' ');
+			terminalPrintString(msixStr, strlen(msixStr));
 		}
 	}
 	terminalPrintChar('\n');
@@ -181,7 +278,8 @@ static bool enumerateDevice(uint64_t baseAddress, uint8_t bus, uint8_t device) {
 	}
 	terminalPrintChar('\n');
 	PCIe::MSICapability *msi;
-	if (!enumerateFunction(function, pcieHeader, &msi)) {
+	PCIe::MSIXCapability *msix;
+	if (!enumerateFunction(function, pcieHeader, &msi, &msix)) {
 		return false;
 	}
 	PCIe::Function currentFunction;
@@ -190,6 +288,7 @@ static bool enumerateDevice(uint64_t baseAddress, uint8_t bus, uint8_t device) {
 	currentFunction.function = function;
 	currentFunction.configurationSpace = pcieHeader;
 	currentFunction.msi = msi;
+	currentFunction.msix = msix;
 	PCIe::functions.push_back(currentFunction);
 	if (pcieHeader->headerType & PCI_MULTI_FUNCTION_DEVICE) {
 		for (function = 1; function < PCI_FUNCTION_COUNT; ++function) {
@@ -213,7 +312,7 @@ static bool enumerateDevice(uint64_t baseAddress, uint8_t bus, uint8_t device) {
 				}
 				continue;
 			}
-			if (!enumerateFunction(function, pcieHeader, &msi)) {
+			if (!enumerateFunction(function, pcieHeader, &msi, &msix)) {
 				return false;
 			}
 			currentFunction.bus = bus;
@@ -221,6 +320,7 @@ static bool enumerateDevice(uint64_t baseAddress, uint8_t bus, uint8_t device) {
 			currentFunction.function = function;
 			currentFunction.configurationSpace = pcieHeader;
 			currentFunction.msi = msi;
+			currentFunction.msix = msix;
 			PCIe::functions.push_back(currentFunction);
 		}
 	}
@@ -1,4 +1,5 @@
 #include <acpi.h>
+#include <async.h>
 #include <commonstrings.h>
 #include <cstring>
 #include <kernel.h>
@@ -8,6 +9,8 @@ static size_t phyMemPagesAvailableCount = 0;
 static size_t phyMemPagesTotalCount = 0;
 static size_t phyMemTotalSize = 0;
 static size_t phyMemUsableSize = 0;
+// Guards the buddy bitmaps and phyMemPagesAvailableCount, any CPU may request or free pages at any time
+static Async::InterruptSafeSpinlock physicalLock;
 
 static const char* const initPhyMemStr = "Initializing physical memory management";
 static const char* const initPhyMemCompleteStr = "Physical memory management initialized\n\n";
@@ -22,6 +25,10 @@ static const char* const rangeOfUsed = "Range of used physical memory\n";
 static const char* const creatingBuddyStr = "Creating buddy bitmaps";
 static const char* const physicalNamespaceStr = "Kernel::Memory::Physical::";
 
+static Kernel::Memory::PageRequestResult allocatePages(size_t count, uint32_t flags);
+static bool buddiesOfType(void* address, size_t order, size_t count, Kernel::Memory::MarkPageType type);
+static void mark(void* address, size_t count, Kernel::Memory::MarkPageType type);
+
 const size_t Kernel::Memory::pageSizeShift = 12;
 const size_t Kernel::Memory::pageSize = 1 << pageSizeShift;
 
@@ -138,6 +145,17 @@ bool Kernel::Memory::Physical::initialize(
 // If RequestType::PhysicalContiguous flag is not passed, then count must be < 512 (i.e. < 2MiB)
 // Unsafe to call this function until virtual memory manager is initialized
 Kernel::Memory::PageRequestResult Kernel::Memory::Physical::requestPages(size_t count, uint32_t flags) {
+	physicalLock.lock();
+	const PageRequestResult result = allocatePages(count, flags);
+	physicalLock.unlock();
+	return result;
+}
+
+// Body of Physical::requestPages, must be called with physicalLock held
+static Kernel::Memory::PageRequestResult allocatePages(size_t count, uint32_t flags) {
+	using namespace Kernel::Memory;
+	using namespace Kernel::Memory::Physical;
+
 	PageRequestResult result;
 	if (
 		count == 0 ||
@@ -168,7 +186,7 @@ Kernel::Memory::PageRequestResult Kernel::Memory::Physical::requestPages(size_t
 		if (allocated) {
 			result.address = (void*)(allocateStartIndex * pageSize);
 			result.allocatedCount = count;
-			markPages(result.address, count, MarkPageType::Used);
+			mark(result.address, count, MarkPageType::Used);
 			return result;
 		}
 	} else if (!(flags & RequestType::PhysicalContiguous) && count <= buddySizes[PHY_MEM_BUDDY_MAX_ORDER - 1]) {
@@ -210,7 +228,7 @@ Kernel::Memory::PageRequestResult Kernel::Memory::Physical::requestPages(size_t
 				currentBitmap >>= 1;
 			}
 			addr = (bit + byte * 8) << (pageSizeShift + closestLevel);
-			markPages((void*) addr, buddySizes[closestLevel], MarkPageType::Used);
+			mark((void*) addr, buddySizes[closestLevel], MarkPageType::Used);
 			result.allocatedCount = buddySizes[closestLevel];
 			result.address = (void*) addr;
 			return result;
@@ -236,7 +254,7 @@ Kernel::Memory::PageRequestResult Kernel::Memory::Physical::requestPages(size_t
 						currentBitmap >>= 1;
 					}
 					addr = (bit + byte * 8) << (pageSizeShift + i);
-					markPages((void*) addr, buddySizes[i], MarkPageType::Used);
+					mark((void*) addr, buddySizes[i], MarkPageType::Used);
 					result.allocatedCount = buddySizes[i];
 					result.address = (void*) addr;
 					return result;
@@ -261,6 +279,16 @@ Kernel::Memory::Physical::BuddyBitmapIndex::BuddyBitmapIndex(void* address, size
 
 // Marks physical pages as used or free in the physical memory manager
 void Kernel::Memory::Physical::markPages(void* address, size_t count, MarkPageType type) {
+	physicalLock.lock();
+	mark(address, count, type);
+	physicalLock.unlock();
+}
+
+// Body of Physical::markPages, must be called with physicalLock held
+static void mark(void* address, size_t count, Kernel::Memory::MarkPageType type) {
+	using namespace Kernel::Memory;
+	using namespace Kernel::Memory::Physical;
+
 	if (count == 0) {
 		return;
 	}
@@ -294,7 +322,7 @@ void Kernel::Memory::Physical::markPages(void* address, size_t count, MarkPageTy
 	for (size_t i = 1; i < PHY_MEM_BUDDY_MAX_ORDER; ++i) {
 		uint64_t currentLevelAddr = addr & buddyMasks[i];
 		while (currentLevelAddr < endAddr) {
-			bool bothBuddiesFree = areBuddiesOfType((void*)currentLevelAddr, i - 1, 2, MarkPageType::Free);
+			bool bothBuddiesFree = buddiesOfType((void*)currentLevelAddr, i - 1, 2, MarkPageType::Free);
 			if (!bothBuddiesFree) {
 				BuddyBitmapIndex index((void*)currentLevelAddr, i);
 				buddyBitmaps[i][index.byte] |= (1 << index.bit);
@@ -369,6 +397,17 @@ void Kernel::Memory::Physical::listUsedBuddies(size_t order) {
 // Returns true if all the physical buddies starting at a given address and order
 // are of given type, false if even one buddy is different
 bool Kernel::Memory::Physical::areBuddiesOfType(void* address, size_t order, size_t count, MarkPageType type) {
+	physicalLock.lock();
+	const bool result = buddiesOfType(address, order, count, type);
+	physicalLock.unlock();
+	return result;
+}
+
+// Body of Physical::areBuddiesOfType, must be called with physicalLock held
+static bool buddiesOfType(void* address, size_t order, size_t count, Kernel::Memory::MarkPageType type) {
+	using namespace Kernel::Memory;
+	using namespace Kernel::Memory::Physical;
+
 	if (count == 0) {
 		return true;
 	}
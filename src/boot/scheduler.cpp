@@ -1,44 +1,434 @@
 #include <apic.h>
+#include <async.h>
+#include <atomic>
 #include <commonstrings.h>
 #include <cstring>
 #include <drivers/timers/hpet.h>
 #include <kernel.h>
-#include <queue>
 #include <terminal.h>
 
+#define SCHEDULER_AGING_LIMIT 16
 #define SCHEDULER_EVENT_DISPATCH_LIMIT 100
-#define SCHEDULER_FREQUENCY 100
+#define SCHEDULER_EVENT_QUEUE_SIZE 1024
+#define SCHEDULER_DEEP_IDLE_ROUNDS 64
+#define SCHEDULER_IDLE_SPIN 2000
+#define SCHEDULER_RUN_QUEUE_SIZE 256
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_SHIFT 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_SHIFT)
+#define TIMER_WHEEL_TICK_SHIFT 20
 
 static const char* const initSchedulerStr = "Initializing scheduler";
 static const char* const initSchedulerCompleteStr = "Scheduler initialized\n\n";
 static const char* const checkHpetStr = "Checking HPET presence";
-static const char* const timerInitFailedStr = "Failed to initialize periodic timers\n";
+static const char* const timerInitFailedStr = "Failed to initialize timers\n";
+static const char* const eventQueueFullStr = "\nScheduler event queue full\n";
+static const char* const runQueueFailedStr = "\nFailed to create CPU run queue\n";
+static const char* const noTimerWheelStr = "\nTimer added on a CPU without a timer wheel\n";
 
-static std::queue<std::coroutine_handle<>> eventQueue;
+static const char* const cpuStatisticsStr = "Scheduler statistics of CPU ";
+static const char* const dispatchedStr = "    Dispatched ";
+static const char* const stolenStr = ", stolen ";
+static const char* const limitHitsStr = ", dispatch limit hit ";
+static const char* const latencyStr = "    Dispatch latency (TSC cycles, log2 buckets)\n";
+static const char* const queueDepthStr = "    Run queue depth (log2 buckets)\n";
+static const char* const eventsPerDispatchStr = "    Events per dispatch (log2 buckets)\n";
+static const char* const timesStr = " times\n";
 
-static void enableHpet();
+// Events carry the TSC value of when they were queued to measure dispatch latency
+struct QueuedEvent {
+	std::coroutine_handle<> event = nullptr;
+	uint64_t queuedAt = 0;
+};
+
+using EventQueue = Async::BoundedQueue<QueuedEvent, SCHEDULER_RUN_QUEUE_SIZE>;
+
+// Every CPU has its own run queue which other CPUs steal from when they have nothing to run
+// It holds a queue per priority level and levels are served highest priority first
+// A level passed over SCHEDULER_AGING_LIMIT times while higher levels ran gets the next turn so it is never starved
+class Kernel::Scheduler::RunQueue {
+	private:
+		EventQueue levels[SCHEDULER_PRIORITY_LEVELS];
+		// Only touched by the CPU owning the run queue
+		size_t passedOver[SCHEDULER_PRIORITY_LEVELS] = {};
+
+	public:
+		// Priority of the event being run by the owning CPU, inherited by the events it queues
+		Priority running = Normal;
+
+		alignas(64) Statistics statistics;
+
+		// Monitored by the owning CPU while it sleeps in MWAIT, other CPUs write it to wake it up
+		// Kept on its own cache line so that only wake ups touch the monitored line
+		alignas(64) std::atomic<uint64_t> doorbell = 0;
+		std::atomic<bool> sleeping = false;
+
+		[[nodiscard]] bool push(const QueuedEvent &event, Priority priority) {
+			return this->levels[priority].push(event);
+		}
+
+		// Must only be called by the owning CPU
+		bool pop(QueuedEvent &event, Priority &priority) {
+			for (size_t level = 1; level < SCHEDULER_PRIORITY_LEVELS; ++level) {
+				if (this->passedOver[level] >= SCHEDULER_AGING_LIMIT) {
+					this->passedOver[level] = 0;
+					if (this->levels[level].pop(event)) {
+						priority = (Priority)level;
+						return true;
+					}
+				}
+			}
+			for (size_t level = 0; level < SCHEDULER_PRIORITY_LEVELS; ++level) {
+				if (this->levels[level].pop(event)) {
+					for (size_t lower = level + 1; lower < SCHEDULER_PRIORITY_LEVELS; ++lower) {
+						++this->passedOver[lower];
+					}
+					priority = (Priority)level;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Other CPUs take the highest priority event without aging
+		bool steal(QueuedEvent &event, Priority level) {
+			return this->levels[level].pop(event);
+		}
+
+		size_t getSize() const {
+			size_t size = 0;
+			for (const auto &level : this->levels) {
+				size += level.getSize();
+			}
+			return size;
+		}
+
+		bool isEmpty() const {
+			for (const auto &level : this->levels) {
+				if (!level.isEmpty()) {
+					return false;
+				}
+			}
+			return true;
+		}
+};
+
+// Hierarchical timing wheel of a CPU with ticks of 2^TIMER_WHEEL_TICK_SHIFT nanoseconds (~1ms)
+// Level n holds timers expiring within TIMER_WHEEL_SLOTS^(n + 1) ticks, in slots of TIMER_WHEEL_SLOTS^n ticks
+// Higher level slots are cascaded down to lower levels as ticks advance
+// Insert and cancel are O(1)
+// Timers are expired from the CPU's dispatch loop hence the lock is never taken in interrupt context
+class Kernel::Scheduler::TimerWheel {
+	private:
+		Async::Spinlock lock;
+		Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS] = {};
+		uint64_t currentTick = 0;
+		uint64_t armedTick = 0;
+		size_t count = 0;
+
+		// Links the timer in the slot where it expires
+		// Timers due at or before earliestTick go in the slot of earliestTick
+		void insert(Timer &timer, uint64_t earliestTick) {
+			// Round the expiry up so that a timer never expires early
+			uint64_t expiryTick = (timer.expiry + (1UL << TIMER_WHEEL_TICK_SHIFT) - 1) >> TIMER_WHEEL_TICK_SHIFT;
+			if (expiryTick < earliestTick) {
+				expiryTick = earliestTick;
+			}
+			size_t level = 0;
+			uint64_t delta = expiryTick - this->currentTick;
+			while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1UL << (TIMER_WHEEL_SLOT_SHIFT * (level + 1)))) {
+				++level;
+			}
+			if (delta >= (1UL << (TIMER_WHEEL_SLOT_SHIFT * TIMER_WHEEL_LEVELS))) {
+				// Beyond the range of the wheel, park in the farthest slot and reinsert when it is cascaded
+				expiryTick = this->currentTick + (1UL << (TIMER_WHEEL_SLOT_SHIFT * TIMER_WHEEL_LEVELS)) - 1;
+			}
+			Timer **head = &this->slots[level][(expiryTick >> (TIMER_WHEEL_SLOT_SHIFT * level)) & (TIMER_WHEEL_SLOTS - 1)];
+			timer.next = *head;
+			timer.previousNext = head;
+			if (timer.next) {
+				timer.next->previousNext = &timer.next;
+			}
+			*head = &timer;
+			timer.wheel = this;
+			++this->count;
+		}
+
+		void unlink(Timer &timer) {
+			*timer.previousNext = timer.next;
+			if (timer.next) {
+				timer.next->previousNext = timer.previousNext;
+			}
+			timer.next = nullptr;
+			timer.previousNext = nullptr;
+			timer.wheel = nullptr;
+			--this->count;
+		}
+
+		// Moves all timers of a slot to the front of a list
+		void takeSlot(Timer *&slot, Timer *&list) {
+			while (slot) {
+				Timer *timer = slot;
+				this->unlink(*timer);
+				timer->next = list;
+				list = timer;
+			}
+		}
+
+	public:
+		TimerWheel(uint64_t now) : currentTick(now >> TIMER_WHEEL_TICK_SHIFT) {}
+
+		void add(Timer &timer) {
+			this->lock.lock();
+			this->insert(timer, this->currentTick + 1);
+			this->lock.unlock();
+		}
+
+		// Returns true only if the timer was unlinked before it expired
+		bool cancel(Timer &timer) {
+			this->lock.lock();
+			bool cancelled = timer.wheel == this;
+			if (cancelled) {
+				this->unlink(timer);
+			}
+			this->lock.unlock();
+			return cancelled;
+		}
+
+		// Advances the wheel to now and returns the list of expired timers linked through next
+		Timer* advance(uint64_t now) {
+			Timer *expired = nullptr;
+			const uint64_t nowTick = now >> TIMER_WHEEL_TICK_SHIFT;
+			this->lock.lock();
+			if (!this->count) {
+				this->currentTick = nowTick;
+			}
+			while (this->currentTick < nowTick) {
+				++this->currentTick;
+				// Cascade higher levels whose slot boundary was just crossed
+				for (size_t level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+					if (this->currentTick & ((1UL << (TIMER_WHEEL_SLOT_SHIFT * level)) - 1)) {
+						break;
+					}
+					Timer *cascaded = nullptr;
+					this->takeSlot(
+						this->slots[level][(this->currentTick >> (TIMER_WHEEL_SLOT_SHIFT * level)) & (TIMER_WHEEL_SLOTS - 1)],
+						cascaded
+					);
+					while (cascaded) {
+						Timer *timer = cascaded;
+						cascaded = cascaded->next;
+						this->insert(*timer, this->currentTick);
+					}
+				}
+				this->takeSlot(this->slots[0][this->currentTick & (TIMER_WHEEL_SLOTS - 1)], expired);
+				if (!this->count) {
+					this->currentTick = nowTick;
+				}
+			}
+			this->lock.unlock();
+			return expired;
+		}
+
+		// Returns the first tick the wheel has work at, which is the first non-empty level 0 slot
+		// or the next level 1 boundary where higher levels are cascaded, whichever comes first
+		// Returns 0 if no timers are pending or a deadline at or before that tick is already armed
+		// Used to arm the CPU timer only for ticks that expire or cascade timers
+		uint64_t nextTickToArm() {
+			this->lock.lock();
+			if (!this->count) {
+				this->lock.unlock();
+				return 0;
+			}
+			const uint64_t cascadeTick = (this->currentTick | (TIMER_WHEEL_SLOTS - 1)) + 1;
+			uint64_t nextTick = cascadeTick;
+			for (uint64_t tick = this->currentTick + 1; tick < cascadeTick; ++tick) {
+				if (this->slots[0][tick & (TIMER_WHEEL_SLOTS - 1)]) {
+					nextTick = tick;
+					break;
+				}
+			}
+			if (this->armedTick > this->currentTick && this->armedTick <= nextTick) {
+				nextTick = 0;
+			} else {
+				this->armedTick = nextTick;
+			}
+			this->lock.unlock();
+			return nextTick;
+		}
+};
+
+// Holds events queued by CPUs without a run queue and overflow from full run queues
+static Async::BoundedQueue<QueuedEvent, SCHEDULER_EVENT_QUEUE_SIZE> sharedQueues[SCHEDULER_PRIORITY_LEVELS];
+
+// MWAIT hints for short and long idle periods, used only if MONITOR/MWAIT is supported
+static bool mwaitSupported = false;
+static uint32_t shallowIdleHint = 0;
+static uint32_t deepIdleHint = 0;
+static std::atomic<size_t> sleepingCpus = 0;
+
+static size_t dispatchEvents();
+static bool eventsAvailable();
+static size_t expireTimers(APIC::CPU *cpu);
+static bool getEvent(APIC::CPU *cpu, QueuedEvent &event, Kernel::Scheduler::Priority &priority, bool &stolen);
+static size_t histogramBucket(uint64_t value);
+static void printHistogram(const uint64_t (&histogram)[SCHEDULER_HISTOGRAM_BUCKETS]);
+static void idle(APIC::CPU *cpu, size_t idleRounds);
+static void initializeIdle();
+static size_t runDeferredWork(APIC::CPU *cpu);
+static void wakeIdleCpu(const APIC::CPU *cpu);
 
 Kernel::Scheduler::TimerType Kernel::Scheduler::timerUsed = Kernel::Scheduler::TimerType::None;
 
-void Kernel::Scheduler::timerLoop() {
-	// Dispatch events synchronously until the queue has dispatchable events and < SCHEDULER_EVENT_DISPATCH_LIMIT in 1 loop
-	// FIXME: should lock the event queue
-	size_t dispatchedEventsCount = 0;
-	while (!eventQueue.empty() && dispatchedEventsCount < SCHEDULER_EVENT_DISPATCH_LIMIT) {
-		std::coroutine_handle<> x = eventQueue.front();
-		if (x && !x.done()) {
-			x.resume();
+// Runs events of this CPU's run queue, steals from other CPUs when it is empty
+// Also runs the CPU's deferred interrupt work and kernel threads
+// Every CPU ends up here once it is initialized and never leaves
+void Kernel::Scheduler::dispatchLoop() {
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	size_t idleRounds = 0;
+	while (true) {
+		// Kernel threads get a time slice after every dispatch round so coroutines and threads take turns
+		size_t work = runDeferredWork(cpu);
+		work += expireTimers(cpu);
+		work += dispatchEvents();
+		work += Threads::runNext();
+		if (work) {
+			idleRounds = 0;
+			continue;
 		}
-		eventQueue.pop();
-		++dispatchedEventsCount;
+		// Nothing to run anywhere, use the idle time to top up the page table pool
+		Memory::Virtual::refillPageTablePool();
+		idle(cpu, idleRounds);
+		++idleRounds;
+	}
+}
+
+// Queues the bottom half of an interrupt handler on the CPU executing this function
+// A running kernel thread has its time slice cut short so that the work is not held up behind it
+// Meant to be called from interrupt context
+void Kernel::Scheduler::queueDeferredWork(DeferredWork &work) {
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	if (!cpu || work.pending.exchange(true)) {
+		return;
+	}
+	const bool interruptsEnabled = !Async::inInterruptContext();
+	IDT::disableInterrupts();
+	work.next = cpu->deferredWork;
+	cpu->deferredWork = &work;
+	if (cpu->currentThread) {
+		cpu->sliceEnd = 0;
+		APIC::setTimerDeadline(0);
 	}
+	if (interruptsEnabled) {
+		IDT::enableInterrupts();
+	}
+}
+
+// Creates the run queue of the CPU executing this function
+// Must be called after APIC::setCurrentCpu
+void Kernel::Scheduler::initializeCpu() {
+	using namespace Memory;
+
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	if (!cpu || cpu->runQueue) {
+		return;
+	}
+	// Run queues are placed on their own pages since the heap cannot align them to cache lines
+	const size_t pageCount = (sizeof(RunQueue) + pageSize - 1) / pageSize;
+	const auto requestResult = Virtual::requestPages(
+		pageCount,
+		(
+			RequestType::AllocatePhysical |
+			RequestType::Kernel |
+			RequestType::VirtualContiguous |
+			RequestType::Writable
+		)
+	);
+	if (requestResult.address == INVALID_ADDRESS || requestResult.allocatedCount != pageCount) {
+		terminalPrintString(runQueueFailedStr, strlen(runQueueFailedStr));
+		panic();
+	}
+	cpu->runQueue = new (requestResult.address) RunQueue();
+	cpu->timerWheel = new TimerWheel(Time::nowNs());
+}
 
-	// TODO: do rest of scheduling
+// Adds a timer expiring after given nanoseconds to the timer wheel of the CPU executing this function
+// The timer must not be already added
+void Kernel::Scheduler::addTimer(Timer &timer, uint64_t nanoseconds) {
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	if (!cpu || !cpu->timerWheel) {
+		terminalPrintString(noTimerWheelStr, strlen(noTimerWheelStr));
+		panic();
+	}
+	timer.expiry = Time::nowNs() + nanoseconds;
+	cpu->timerWheel->add(timer);
 }
 
+// Removes a timer from the timer wheel it was added to, can be called from any CPU
+// Returns true only if the timer had not expired yet
+bool Kernel::Scheduler::cancelTimer(Timer &timer) {
+	TimerWheel *wheel = timer.wheel;
+	return wheel && wheel->cancel(timer);
+}
+
+// Copies the dispatch statistics of a CPU, returns false if it has no run queue
+// The copy is taken without stopping the CPU so counters may be a few events apart
+bool Kernel::Scheduler::getStatistics(size_t cpuIndex, Statistics &statistics) {
+	if (cpuIndex >= APIC::cpus.size() || !APIC::cpus[cpuIndex].runQueue) {
+		return false;
+	}
+	statistics = APIC::cpus[cpuIndex].runQueue->statistics;
+	return true;
+}
+
+// Prints the non-empty histogram buckets and counters of every CPU
+void Kernel::Scheduler::printStatistics() {
+	Statistics statistics;
+	for (size_t i = 0; i < APIC::cpus.size(); ++i) {
+		if (!getStatistics(i, statistics)) {
+			continue;
+		}
+		terminalPrintString(cpuStatisticsStr, strlen(cpuStatisticsStr));
+		terminalPrintDecimal(APIC::cpus[i].apicId);
+		terminalPrintChar('\n');
+		terminalPrintString(dispatchedStr, strlen(dispatchedStr));
+		terminalPrintDecimal(statistics.dispatchedEvents);
+		terminalPrintString(stolenStr, strlen(stolenStr));
+		terminalPrintDecimal(statistics.stolenEvents);
+		terminalPrintString(limitHitsStr, strlen(limitHitsStr));
+		terminalPrintDecimal(statistics.dispatchLimitHits);
+		terminalPrintString(timesStr, strlen(timesStr));
+		terminalPrintString(latencyStr, strlen(latencyStr));
+		printHistogram(statistics.dispatchLatency);
+		terminalPrintString(queueDepthStr, strlen(queueDepthStr));
+		printHistogram(statistics.queueDepth);
+		terminalPrintString(eventsPerDispatchStr, strlen(eventsPerDispatchStr));
+		printHistogram(statistics.eventsPerDispatch);
+	}
+}
+
+// Returns the priority of the event running on the CPU executing this function
+Kernel::Scheduler::Priority Kernel::Scheduler::currentPriority() {
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	return (cpu && cpu->runQueue) ? cpu->runQueue->running : Normal;
+}
+
+// Queues an event with InterruptCompletion priority in interrupt context
+// and with the priority of the running event otherwise
 void Kernel::Scheduler::queueEvent(std::coroutine_handle<> event) {
-	// FIXME: should lock the event queue
-	eventQueue.push(event);
+	queueEvent(event, Async::inInterruptContext() ? InterruptCompletion : currentPriority());
+}
+
+// Queues an event on the run queue of the CPU executing this function
+// Safe to call from interrupt context
+void Kernel::Scheduler::queueEvent(std::coroutine_handle<> event, Priority priority) {
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	const QueuedEvent queuedEvent = {.event = event, .queuedAt = __builtin_ia32_rdtsc()};
+	if (!(cpu && cpu->runQueue && cpu->runQueue->push(queuedEvent, priority)) && !sharedQueues[priority].push(queuedEvent)) {
+		terminalPrintString(eventQueueFullStr, strlen(eventQueueFullStr));
+		panic();
+	}
+	wakeIdleCpu(cpu);
 }
 
 bool Kernel::Scheduler::start() {
@@ -46,7 +436,8 @@ bool Kernel::Scheduler::start() {
 	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
 	terminalPrintChar('\n');
 
-	// Find a timer that can generate periodic interrupts
+	// Find a free running counter to serve as the clocksource and as the reference the TSC and local APIC timers are calibrated against
+	// Timer deadlines are delivered by every CPU's local APIC timer
 	// Currently only HPET drivers are present
 	bool timerInitialized = false;
 
@@ -78,43 +469,254 @@ bool Kernel::Scheduler::start() {
 		return false;
 	}
 
-	switch (timerUsed) {
-		case HPET:
-			enableHpet();
-			break;
-		default:
-			terminalPrintString(timerInitFailedStr, strlen(timerInitFailedStr));
-			panic();
-	}
+	initializeIdle();
 
 	terminalPrintString(initSchedulerCompleteStr, strlen(initSchedulerCompleteStr));
 	return true;
 }
 
-static void enableHpet() {
-	using namespace Drivers::Timers::HPET;
-
-	// Install the timer IRQ handler
-	APIC::IORedirectionEntry timerEntry = APIC::readIoRedirectionEntry(Kernel::IRQ::Timer);
-	Kernel::IDT::installEntry(Kernel::IDT::availableInterrupt, &hpetHandlerWrapper, 2);
-	timerEntry.vector = Kernel::IDT::availableInterrupt;
-	timerEntry.deliveryMode = 0;
-	timerEntry.destinationMode = 0;
-	timerEntry.pinPolarity = 0;
-	timerEntry.triggerMode = 0;
-	timerEntry.mask = 0;
-	timerEntry.destination = APIC::bootCpu->apicId;
-	APIC::writeIoRedirectionEntry(Kernel::IRQ::Timer, timerEntry);
-	++Kernel::IDT::availableInterrupt;
-	// HPET registers must be written at 8-byte boundaries hence setting the bit fields directly is not possible
-	#pragma GCC diagnostic push
-	#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
-	uint64_t *configure = (uint64_t*)(void*)periodicTimer;
-	*configure |= ((Kernel::IRQ::Timer << 9) | TimerParamters::Enable | TimerParamters::Periodic | TimerParamters::PeriodicInterval);
-	const size_t second1 = 1000000000000000UL / registers->period;
-	periodicTimer->comparatorValue = second1 / SCHEDULER_FREQUENCY;
-	configure = (uint64_t*)(void*)registers;
-	configure[2] |= 1;
-	#pragma GCC diagnostic pop
-	timerInterruptCallback = Kernel::Scheduler::timerLoop;
+// Dispatches events synchronously until there are no dispatchable events or SCHEDULER_EVENT_DISPATCH_LIMIT are dispatched
+// Returns the number of events dispatched
+static size_t dispatchEvents() {
+	using namespace Kernel::Scheduler;
+
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	if (!cpu || !cpu->runQueue) {
+		return 0;
+	}
+	RunQueue *runQueue = cpu->runQueue;
+	Statistics &statistics = runQueue->statistics;
+	++statistics.queueDepth[histogramBucket(runQueue->getSize())];
+	size_t dispatchedEventsCount = 0;
+	QueuedEvent event;
+	Priority priority;
+	bool stolen;
+	while (dispatchedEventsCount < SCHEDULER_EVENT_DISPATCH_LIMIT && getEvent(cpu, event, priority, stolen)) {
+		const uint64_t now = __builtin_ia32_rdtsc();
+		// TSCs of different CPUs may be slightly apart so a stolen event can look queued in the future
+		++statistics.dispatchLatency[histogramBucket(now > event.queuedAt ? now - event.queuedAt : 0)];
+		statistics.stolenEvents += stolen;
+		if (event.event && !event.event.done()) {
+			runQueue->running = priority;
+			event.event.resume();
+		}
+		++dispatchedEventsCount;
+	}
+	// Events queued outside of any event, like those of expired timers, get normal priority
+	runQueue->running = Normal;
+	if (dispatchedEventsCount) {
+		statistics.dispatchedEvents += dispatchedEventsCount;
+		++statistics.eventsPerDispatch[histogramBucket(dispatchedEventsCount)];
+		if (dispatchedEventsCount == SCHEDULER_EVENT_DISPATCH_LIMIT && !runQueue->isEmpty()) {
+			++statistics.dispatchLimitHits;
+		}
+	}
+	return dispatchedEventsCount;
+}
+
+// Expires due timers of the CPU's timer wheel by calling their callbacks or queueing their events
+// Arms the CPU timer for the next tick while timers are pending so that an idle CPU gets woken up for them
+// Returns the number of timers expired
+static size_t expireTimers(APIC::CPU *cpu) {
+	using namespace Kernel::Scheduler;
+
+	if (!cpu || !cpu->timerWheel) {
+		return 0;
+	}
+	const uint64_t now = Kernel::Time::nowNs();
+	Timer *expired = cpu->timerWheel->advance(now);
+	size_t expiredCount = 0;
+	while (expired) {
+		Timer *timer = expired;
+		expired = expired->next;
+		timer->next = nullptr;
+		if (timer->expiry > now) {
+			// Timers beyond the range of the wheel were parked early
+			cpu->timerWheel->add(*timer);
+			continue;
+		}
+		if (timer->callback) {
+			timer->callback(*timer);
+		} else {
+			queueEvent(timer->event);
+		}
+		++expiredCount;
+	}
+	// The CPU timer is shared with kernel thread time slices, which arm it for no later than wheelDeadline
+	if (cpu->wheelDeadline <= now) {
+		cpu->wheelDeadline = 0;
+	}
+	const uint64_t nextTick = cpu->timerWheel->nextTickToArm();
+	if (nextTick) {
+		cpu->wheelDeadline = nextTick << TIMER_WHEEL_TICK_SHIFT;
+		APIC::setTimerDeadline(cpu->wheelDeadline > now ? cpu->wheelDeadline - now : 0);
+	}
+	return expiredCount;
+}
+
+// Pops an event from the CPU's own run queue
+// If it is empty steals the highest priority event from the other CPUs' run queues and lastly from the shared queues
+// Returns false if no event is available anywhere
+static bool getEvent(APIC::CPU *cpu, QueuedEvent &event, Kernel::Scheduler::Priority &priority, bool &stolen) {
+	using namespace Kernel::Scheduler;
+
+	stolen = false;
+	if (cpu && cpu->runQueue && cpu->runQueue->pop(event, priority)) {
+		return true;
+	}
+	stolen = true;
+	// Start looking from the next CPU so that idle CPUs don't all steal from the same victim
+	const size_t cpuCount = APIC::cpus.size();
+	const size_t cpuIndex = cpu ? cpu - APIC::cpus.data() : 0;
+	for (size_t level = 0; level < SCHEDULER_PRIORITY_LEVELS; ++level) {
+		priority = (Priority)level;
+		for (size_t i = 1; i < cpuCount; ++i) {
+			APIC::CPU &victim = APIC::cpus[(cpuIndex + i) % cpuCount];
+			if (victim.runQueue && victim.runQueue->steal(event, priority)) {
+				return true;
+			}
+		}
+		if (sharedQueues[level].pop(event)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns the histogram bucket of a value, see Kernel::Scheduler::Statistics
+static size_t histogramBucket(uint64_t value) {
+	if (!value) {
+		return 0;
+	}
+	const size_t bucket = 64 - __builtin_clzll(value);
+	return bucket < SCHEDULER_HISTOGRAM_BUCKETS ? bucket : SCHEDULER_HISTOGRAM_BUCKETS - 1;
+}
+
+// Prints every non-empty bucket as its lower bound and count
+static void printHistogram(const uint64_t (&histogram)[SCHEDULER_HISTOGRAM_BUCKETS]) {
+	for (size_t bucket = 0; bucket < SCHEDULER_HISTOGRAM_BUCKETS; ++bucket) {
+		if (histogram[bucket]) {
+			terminalPrintSpaces4();
+			terminalPrintSpaces4();
+			terminalPrintDecimal(bucket ? 1UL << (bucket - 1) : 0);
+			terminalPrintString(": ", 2);
+			terminalPrintDecimal(histogram[bucket]);
+			terminalPrintChar('\n');
+		}
+	}
+}
+
+// Returns true if any run queue or shared queue seems to hold an event
+static bool eventsAvailable() {
+	for (const auto &cpu : APIC::cpus) {
+		if (cpu.runQueue && !cpu.runQueue->isEmpty()) {
+			return true;
+		}
+	}
+	for (const auto &sharedQueue : sharedQueues) {
+		if (!sharedQueue.isEmpty()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Spins for a while since events often arrive right after the queues drain
+// then sleeps in MWAIT on the CPU's doorbell until another CPU rings it or an interrupt like the CPU timer arrives
+// Must be called with interrupts enabled
+// Moves to the deepest C-state once the CPU has been idle for SCHEDULER_DEEP_IDLE_ROUNDS wake ups in a row
+static void idle(APIC::CPU *cpu, size_t idleRounds) {
+	Kernel::Scheduler::RunQueue *runQueue = cpu ? cpu->runQueue : nullptr;
+	if (!mwaitSupported || !runQueue) {
+		__builtin_ia32_pause();
+		return;
+	}
+	for (size_t i = 0; i < SCHEDULER_IDLE_SPIN; ++i) {
+		if (eventsAvailable() || cpu->deferredWork) {
+			return;
+		}
+		__builtin_ia32_pause();
+	}
+	runQueue->sleeping.store(true);
+	sleepingCpus.fetch_add(1);
+	// Interrupts stay disabled from the last look until MWAIT starts, otherwise an interrupt in between
+	// could queue deferred work, queue a local event or expire the wheel's deadline without waking the CPU
+	Kernel::IDT::disableInterrupts();
+	__builtin_ia32_monitor((const void*)&runQueue->doorbell, 0, 0);
+	// An event queued before the monitor was armed would not wake the CPU, hence look once more
+	// A wheel deadline that passed already fired its interrupt during the spin
+	if (
+		!eventsAvailable() &&
+		!cpu->deferredWork &&
+		!(cpu->wheelDeadline && cpu->wheelDeadline <= Kernel::Time::nowNs())
+	) {
+		Kernel::Scheduler::enableInterruptsAndMwait(idleRounds >= SCHEDULER_DEEP_IDLE_ROUNDS ? deepIdleHint : shallowIdleHint);
+	} else {
+		Kernel::IDT::enableInterrupts();
+	}
+	sleepingCpus.fetch_sub(1);
+	runQueue->sleeping.store(false, std::memory_order_relaxed);
+}
+
+// Picks MWAIT hints from the C-states enumerated by CPUID
+// C1 for short idle periods and the deepest C-state with its deepest sub-state for long ones
+static void initializeIdle() {
+	using namespace Kernel::Scheduler;
+
+	if (!isMwaitSupported()) {
+		return;
+	}
+	mwaitSupported = true;
+	const uint32_t subStates = getMwaitSubStates();
+	for (uint32_t cState = 7; cState >= 1; --cState) {
+		const uint32_t count = (subStates >> (cState * 4)) & 0xf;
+		if (count) {
+			deepIdleHint = ((cState - 1) << 4) | (count - 1);
+			break;
+		}
+	}
+}
+
+// Runs all deferred work queued on the CPU in one batch with interrupts enabled
+// Work is marked not pending before its callback runs so that an interrupt arriving meanwhile queues it again
+// Returns the number of deferred work items run
+static size_t runDeferredWork(APIC::CPU *cpu) {
+	if (!cpu->deferredWork) {
+		return 0;
+	}
+	Kernel::IDT::disableInterrupts();
+	Kernel::Scheduler::DeferredWork *work = cpu->deferredWork;
+	cpu->deferredWork = nullptr;
+	Kernel::IDT::enableInterrupts();
+	size_t count = 0;
+	while (work) {
+		Kernel::Scheduler::DeferredWork *next = work->next;
+		work->pending.store(false);
+		work->callback(*work);
+		work = next;
+		++count;
+	}
+	return count;
+}
+
+// Rings the doorbell of a CPU sleeping in MWAIT so that it picks up a newly queued event
+// Remote CPUs are woken by the write to their monitored line alone, no IPI is needed
+static void wakeIdleCpu(const APIC::CPU *cpu) {
+	// The queued event must be visible before looking for sleeping CPUs
+	// otherwise a CPU could go to sleep after missing both the event and the doorbell
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleepingCpus.load(std::memory_order_relaxed) == 0) {
+		return;
+	}
+	for (auto &sleeper : APIC::cpus) {
+		if (
+			&sleeper != cpu &&
+			sleeper.runQueue &&
+			sleeper.runQueue->sleeping.load(std::memory_order_relaxed) &&
+			sleeper.runQueue->sleeping.exchange(false)
+		) {
+			sleeper.runQueue->doorbell.fetch_add(1, std::memory_order_release);
+			return;
+		}
+	}
 }
@@ -0,0 +1,46 @@
+[bits 64]
+
+section .text
+	global enableInterruptsAndMwait
+	global getMwaitSubStates
+	global isMwaitSupported
+
+; Enables interrupts and waits in MWAIT with the hints in edi on the monitor armed by the caller
+; STI holds off interrupts until after the next instruction, so an interrupt arriving
+; after the caller's last check with interrupts disabled ends the MWAIT instead of being taken before it
+enableInterruptsAndMwait:
+	mov eax, edi
+	xor ecx, ecx
+	sti
+	mwait
+	ret
+
+isMwaitSupported:
+	push rbx	; Preserve rbx to stay compatible with System V ABI
+	mov eax, 1
+	cpuid
+	xor rax, rax
+	bt ecx, 3
+	setc al
+	pop rbx
+	ret
+
+; Returns CPUID leaf 5 EDX, the number of MWAIT sub-states of C0 to C7 in 4 bits each
+; Returns 0 if leaf 5 or its MWAIT extensions are not enumerated
+getMwaitSubStates:
+	push rbx
+	xor eax, eax
+	cpuid
+	cmp eax, 5
+	jb mwaitLeafNotPresent
+	mov eax, 5
+	cpuid
+	bt ecx, 0
+	jnc mwaitLeafNotPresent
+	mov eax, edx
+	pop rbx
+	ret
+mwaitLeafNotPresent:
+	xor rax, rax
+	pop rbx
+	ret
@@ -34,6 +34,8 @@ const uint8_t DEFAULT_TERMINAL_COLOR = 0x0f;
 const uint8_t pageSizeShift = 12;
 const uint64_t pageSize = 1 << pageSizeShift;
 const uint64_t pageSizeMask = ~(((uint64_t)1 << pageSizeShift) - 1);
+const uint32_t largePageSize = 0x200000;
+const uint32_t largePageMask = largePageSize - 1;
 const size_t virtualPageIndexShift = 9;
 const uint64_t virtualPageIndexMask = ((uint64_t)1 << virtualPageIndexShift) - 1;
 InfoTable *infoTable = nullptr;
@@ -223,6 +225,30 @@ void allocatePagingEntry(PML4E *entry, uint32_t address, bool writable, bool exe
 	entry->physicalAddress = address >> pageSizeShift;
 }
 
+// Returns the page directory entry that maps a virtual address
+// The PDPT and PD are created at newPageStart if they are not present
+PDE* getPageDirectoryEntry(PML4E *pml4t, uint64_t virtualAddress, uint32_t &newPageStart) {
+	virtualAddress >>= pageSizeShift + virtualPageIndexShift;
+	size_t pdIndex = virtualAddress & virtualPageIndexMask;
+	virtualAddress >>= virtualPageIndexShift;
+	size_t pdptIndex = virtualAddress & virtualPageIndexMask;
+	virtualAddress >>= virtualPageIndexShift;
+	size_t pml4tIndex = virtualAddress & virtualPageIndexMask;
+	if (!pml4t[pml4tIndex].present) {
+		memset((void *)newPageStart, 0, pageSize);
+		allocatePagingEntry(&(pml4t[pml4tIndex]), newPageStart, true, true);
+		newPageStart += pageSize;
+	}
+	PDPTE *pdpt = (PDPTE *)((uint32_t)pml4t[pml4tIndex].physicalAddress << pageSizeShift);
+	if (!pdpt[pdptIndex].present) {
+		memset((void *)newPageStart, 0, pageSize);
+		allocatePagingEntry(&(pdpt[pdptIndex]), newPageStart, true, true);
+		newPageStart += pageSize;
+	}
+	PDE *pd = (PDE *)((uint32_t)pdpt[pdptIndex].physicalAddress << pageSizeShift);
+	return &(pd[pdIndex]);
+}
+
 extern "C" int loader32Main(
 	uint32_t loader32VirtualMemSize,
 	InfoTable *infoTableAddress,
@@ -285,20 +311,26 @@ extern "C" int loader32Main(
 		if (programHeader[i].segmentType != ELF_SEGMENT_TYPE_LOAD) {
 			continue;
 		}
-		// Align size to 4KiB page boundary
-		uint64_t size = programHeader[i].segmentSizeInMemory & pageSizeMask;
-		if (size != programHeader[i].segmentSizeInMemory) {
-			size += pageSize;
+		// Segments are placed in physical memory at the same offset from the kernel base
+		// as their virtual address from KERNEL_ORIGIN, so the kernel spans till the end of the last segment
+		// Align end to 4KiB page boundary
+		uint64_t end = programHeader[i].virtualAddress - KERNEL_ORIGIN + programHeader[i].segmentSizeInMemory;
+		if (end & ~pageSizeMask) {
+			end = (end & pageSizeMask) + pageSize;
+		}
+		if (end > kernelVirtualMemSize) {
+			kernelVirtualMemSize = end;
 		}
-		kernelVirtualMemSize += size;
 	}
+	// The last segment is mapped with 2MiB pages as well, so the kernel owns memory till the next 2MiB boundary
+	kernelVirtualMemSize = (kernelVirtualMemSize + largePageMask) & ~(uint64_t)largePageMask;
 	printString("KernelVirtualMemSize = 0x");
 	printHex(&kernelVirtualMemSize, sizeof(kernelVirtualMemSize));
 	printString("\n");
 
 	// Check if enough space is available to load kernel process, kernel ELF
 	// (i.e. base address < (LOADER32_ORIGIN + loader 32 size)
-	// and length of region > (kernelVirtualMemSize + kernelElfSize))
+	// and length of region > (kernelVirtualMemSize + kernelElfSize + 2MiB for aligning the kernel base))
 	bool enoughSpace = false;
 	printString("Number of MMAP entries = 0x");
 	printHex(&infoTable->mmapEntryCount, sizeof(infoTable->mmapEntryCount));
@@ -307,7 +339,7 @@ extern "C" int loader32Main(
 	for (size_t i = 0; i < infoTable->mmapEntryCount; ++i) {
 		if (
 			(mmap[i].base <= ((uint64_t)LOADER32_ORIGIN + loader32VirtualMemSize)) &&
-			(mmap[i].length >= (kernelElfSize + kernelVirtualMemSize))
+			(mmap[i].length >= (kernelElfSize + kernelVirtualMemSize + largePageSize))
 		) {
 			enoughSpace = true;
 			break;
@@ -321,7 +353,8 @@ extern "C" int loader32Main(
 	printString("Loading kernel...\n");
 
 	// Enter the kernel physical memory base address in the info table
-	uint32_t kernelBase = LOADER32_ORIGIN + loader32VirtualMemSize;
+	// The base is 2MiB aligned so that 2MiB aligned segments can be mapped with 2MiB pages
+	uint32_t kernelBase = (LOADER32_ORIGIN + loader32VirtualMemSize + largePageMask) & ~largePageMask;
 	infoTable->kernelPhyMemBase = (uint64_t)kernelBase;
 	uint32_t kernelElfBase = kernelBase + (uint32_t)kernelVirtualMemSize;
 	printString("KernelELFBase = 0x");
@@ -365,7 +398,6 @@ extern "C" int loader32Main(
 		infoTable->pml4tPhysicalAddress += pageSize;
 	}
 	identityMapMemory((uint64_t*)(uint32_t)infoTable->pml4tPhysicalAddress);
-	uint32_t memorySeekp = kernelBase;
 	printString("KernelBase = 0x");
 	printHex(&kernelBase, sizeof(kernelBase));
 	printString("\n");
@@ -376,7 +408,6 @@ extern "C" int loader32Main(
 	PML4E *pml4t = (PML4E *)(uint32_t)infoTable->pml4tPhysicalAddress;
 	// New pages that need to be made should start from this address and add pageSize to it.
 	uint32_t newPageStart = infoTable->pml4tPhysicalAddress + pml4Count * pageSize;
-	uint32_t kernelSize = 0;
 	elfHeader = (ELF64Header*)kernelElfBase;
 	programHeader = (ELF64ProgramHeader*)(kernelElfBase + (uint32_t)elfHeader->headerTablePosition);
 	for (uint16_t i = 0; i < elfHeader->headerEntryCount; ++i) {
@@ -385,6 +416,9 @@ extern "C" int loader32Main(
 		}
 		const uint32_t sizeInMemory = (uint32_t)programHeader[i].segmentSizeInMemory;
 		const uint32_t flags = programHeader[i].segmentFlags;
+		const bool writable = flags & ELF_SEGMENT_FLAG_WRITABLE;
+		const bool executable = flags & ELF_SEGMENT_FLAG_EXECUTABLE;
+		uint32_t memorySeekp = kernelBase + (uint32_t)(programHeader[i].virtualAddress - KERNEL_ORIGIN);
 		printString("- SizeInMemory = 0x");
 		printHex(&sizeInMemory, sizeof(sizeInMemory));
 
@@ -399,7 +433,6 @@ extern "C" int loader32Main(
 		if (sizeInMemory - pageCount * pageSize) {
 			++pageCount;
 		}
-		kernelSize += pageCount * pageSize;
 		printString("  PageCount = 0x");
 		printHex(&pageCount, sizeof(pageCount));
 		printString("\n");
@@ -410,52 +443,38 @@ extern "C" int loader32Main(
 		printString("\n");
 		for (size_t j = 0; j < pageCount; ++j, memorySeekp += pageSize) {
 			uint64_t virtualAddress = programHeader[i].virtualAddress + j * pageSize;
-			virtualAddress >>= pageSizeShift;
-			size_t ptIndex = virtualAddress & virtualPageIndexMask;
-			virtualAddress >>= virtualPageIndexShift;
-			size_t pdIndex = virtualAddress & virtualPageIndexMask;
-			virtualAddress >>= virtualPageIndexShift;
-			size_t pdptIndex = virtualAddress & virtualPageIndexMask;
-			virtualAddress >>= virtualPageIndexShift;
-			size_t pml4tIndex = virtualAddress & virtualPageIndexMask;
-			if (pml4t[pml4tIndex].present) {
-				PDPTE *pdpt = (PDPTE *)((uint32_t)pml4t[pml4tIndex].physicalAddress << pageSizeShift);
-				if (pdpt[pdptIndex].present) {
-					PDE *pd = (PDE *)((uint32_t)pdpt[pdptIndex].physicalAddress << pageSizeShift);
-					if (pd[pdIndex].present) {
-						PTE *pt = (PTE *)((uint32_t)pd[pdIndex].physicalAddress << pageSizeShift);
-						if (!pt[ptIndex].present) {
-							allocatePagingEntry(&(pt[ptIndex]), memorySeekp, flags & ELF_SEGMENT_FLAG_WRITABLE, flags & ELF_SEGMENT_FLAG_EXECUTABLE);
-						}
-					} else {
-						allocatePagingEntry(&(pd[pdIndex]), newPageStart, true, true);
-						PTE *pt = (PTE *)newPageStart;
-						newPageStart += pageSize;
-						allocatePagingEntry(&(pt[ptIndex]), memorySeekp, flags & ELF_SEGMENT_FLAG_WRITABLE, flags & ELF_SEGMENT_FLAG_EXECUTABLE);
-					}
-				} else {
-					allocatePagingEntry(&(pdpt[pdptIndex]), newPageStart, true, true);
-					PDE *pd = (PDE *)newPageStart;
-					newPageStart += pageSize;
-					allocatePagingEntry(&(pd[pdIndex]), newPageStart, true, true);
-					PTE *pt = (PTE *)newPageStart;
-					newPageStart += pageSize;
-					allocatePagingEntry(&(pt[ptIndex]), memorySeekp, flags & ELF_SEGMENT_FLAG_WRITABLE, flags & ELF_SEGMENT_FLAG_EXECUTABLE);
-				}
-			} else {
-				allocatePagingEntry(&(pml4t[pml4tIndex]), newPageStart, true, true);
-				PDPTE *pdpt = (PDPTE *)newPageStart;
-				newPageStart += pageSize;
-				allocatePagingEntry(&(pdpt[pdptIndex]), newPageStart, true, true);
-				PDE *pd = (PDE *)newPageStart;
-				newPageStart += pageSize;
-				allocatePagingEntry(&(pd[pdIndex]), newPageStart, true, true);
-				PTE *pt = (PTE *)newPageStart;
+			PDE *pde = getPageDirectoryEntry(pml4t, virtualAddress, newPageStart);
+			if (pde->present && pde->largePage) {
+				printString("\nKernel segments share a 2MiB page! Cannot boot!");
+				return 1;
+			}
+			if (
+				!pde->present &&
+				((uint32_t)virtualAddress & largePageMask) == 0 &&
+				(memorySeekp & largePageMask) == 0
+			) {
+				// link.ld starts every segment at a 2MiB boundary and the kernel size is rounded up to one,
+				// so the 2MiB chunk including any padding after the segment's end belongs only to this segment
+				// Map it with a single 2MiB page
+				allocatePagingEntry(pde, memorySeekp, writable, executable);
+				pde->largePage = 1;
+				j += largePageSize / pageSize - 1;
+				memorySeekp += largePageSize - pageSize;
+				continue;
+			}
+			if (!pde->present) {
+				memset((void *)newPageStart, 0, pageSize);
+				allocatePagingEntry(pde, newPageStart, true, true);
 				newPageStart += pageSize;
-				allocatePagingEntry(&(pt[ptIndex]), memorySeekp, flags & ELF_SEGMENT_FLAG_WRITABLE, flags & ELF_SEGMENT_FLAG_EXECUTABLE);
+			}
+			PTE *pt = (PTE *)((uint32_t)pde->physicalAddress << pageSizeShift);
+			size_t ptIndex = (virtualAddress >> pageSizeShift) & virtualPageIndexMask;
+			if (!pt[ptIndex].present) {
+				allocatePagingEntry(&(pt[ptIndex]), memorySeekp, writable, executable);
 			}
 		}
 	}
+	uint32_t kernelSize = (uint32_t)kernelVirtualMemSize;
 
 	// Get kernel global constructors and store their info in the InfoTable
 	ELF64SectionHeader *sectionHeaders = (ELF64SectionHeader*)(kernelElfBase + (uint32_t)elfHeader->sectionTablePosition);
@@ -0,0 +1,227 @@
+#include <apic.h>
+#include <cstddef>
+#include <cstring>
+#include <kernel.h>
+#include <terminal.h>
+
+static const char* const syscallBenchmarkStr = "Syscall round trip [";
+static const char* const cyclesStr = " TSC cycles]\n";
+
+static const uint64_t alignmentCheckFlag = 1 << 18;
+static const uint64_t directionFlag = 1 << 10;
+static const uint64_t interruptFlag = 1 << 9;
+static const uint64_t trapFlag = 1 << 8;
+static const uint64_t syscallEnable = 1;	// EFER.SCE
+static const uint64_t kernelCodeSelector = 0x08;
+// SYSRET loads SS from this + 8 and CS from this + 16, see gdt64.asm
+static const uint64_t userSelectorBase = 0x18;
+static const uint64_t userSpaceEnd = 0x800000000000;
+static const size_t userStackSize = 0x10000;
+
+static_assert(offsetof(APIC::CPU, syscallStack) == 8, "CPU_SYSCALL_STACK in tasksasm.asm is out of date");
+static_assert(offsetof(APIC::CPU, userStackPointer) == 16, "CPU_USER_STACK_POINTER in tasksasm.asm is out of date");
+
+static bool areInterruptsEnabled();
+static int64_t exitSyscall(uint64_t exitCode, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+static int64_t nullSyscall(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+static void printSyscallBenchmark(Kernel::Tasks::Task *task);
+static void runTask(void *argument);
+static int64_t yieldSyscall(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+// Indexed by Kernel::Tasks::Syscall in syscallEntry
+extern "C" const Kernel::Tasks::SyscallHandler syscallTable[Kernel::Tasks::Syscall::Count] = {
+	nullSyscall,
+	exitSyscall,
+	yieldSyscall
+};
+extern "C" const uint64_t syscallCount = Kernel::Tasks::Syscall::Count;
+
+// Creates a task with an empty user space
+// Returns nullptr if the task's PML4 could not be allocated
+Kernel::Tasks::Task* Kernel::Tasks::create() {
+	using namespace Memory;
+
+	void *addressSpace = Virtual::createAddressSpace();
+	if (addressSpace == INVALID_ADDRESS) {
+		return nullptr;
+	}
+	Task *task = new Task();
+	task->addressSpace = addressSpace;
+	// Laid out like the lower half of the general address space list with only the user space available
+	// The last page below the non canonical hole is never mapped, so the rip SYSCALL saves in rcx
+	// is always canonical and SYSRET cannot fault in ring 0 with the user stack loaded
+	task->addressSpaceList.push_back({
+		.available = false,
+		.base = nullptr,
+		.pageCount = USER_SPACE_ORIGIN / pageSize
+	});
+	task->addressSpaceList.push_back({
+		.available = true,
+		.base = (void*)USER_SPACE_ORIGIN,
+		.pageCount = (userSpaceEnd - USER_SPACE_ORIGIN) / pageSize - 1
+	});
+	task->addressSpaceList.push_back({
+		.available = false,
+		.base = (void*)(userSpaceEnd - pageSize),
+		.pageCount = 1
+	});
+	return task;
+}
+
+// Frees the task and everything mapped in its user space
+// The task must not be running
+void Kernel::Tasks::destroy(Task *task) {
+	Memory::Virtual::destroyAddressSpace(task->addressSpace);
+	delete task;
+}
+
+// Enables SYSCALL and SYSRET on the CPU executing this function
+// Must be called on every CPU before it runs a task
+void Kernel::Tasks::initializeCpu() {
+	writeMsr(MSR::efer, readMsr(MSR::efer) | syscallEnable);
+	writeMsr(MSR::star, (userSelectorBase << 48) | (kernelCodeSelector << 32));
+	writeMsr(MSR::lstar, (uint64_t)&syscallEntry);
+	writeMsr(MSR::fmask, alignmentCheckFlag | directionFlag | interruptFlag | trapFlag);
+}
+
+// Maps zeroed pages for size bytes in the user space of the task and copies contents to them if it is not nullptr
+// flags are combined with RequestType::User, pass RequestType::Writable and RequestType::Executable as needed
+// Returns the user address of the pages or INVALID_ADDRESS if the task is out of address space or memory is exhausted
+void* Kernel::Tasks::map(Task *task, const void *contents, size_t size, uint32_t flags) {
+	using namespace Memory;
+
+	const size_t count = (size + pageSize - 1) / pageSize;
+	void *base = Virtual::reserveAddressSpace(task->addressSpaceList, count);
+	if (base == INVALID_ADDRESS) {
+		return INVALID_ADDRESS;
+	}
+	// mapPages only works on the active address space
+	const bool interruptsEnabled = areInterruptsEnabled();
+	IDT::disableInterrupts();
+	void *previousAddressSpace = Virtual::switchAddressSpace(task->addressSpace);
+	bool mapped = true;
+	for (size_t i = 0; i < count && mapped; ++i) {
+		PageRequestResult requestResult = Physical::requestPages(1, 0);
+		if (requestResult.address == INVALID_ADDRESS || requestResult.allocatedCount != 1) {
+			mapped = false;
+			break;
+		}
+		// Filled through the direct map since the user mapping may be read only
+		uint8_t *page = (uint8_t*)Virtual::physToVirt(requestResult.address);
+		memset(page, 0, pageSize);
+		if (contents && i * pageSize < size) {
+			const size_t copySize = size - i * pageSize < pageSize ? size - i * pageSize : pageSize;
+			memcpy(page, (const uint8_t*)contents + i * pageSize, copySize);
+		}
+		mapped = Virtual::mapPages(
+			(void*)((uint64_t)base + i * pageSize),
+			requestResult.address,
+			1,
+			flags | RequestType::User
+		);
+		if (!mapped) {
+			Physical::markPages(requestResult.address, 1, MarkPageType::Free);
+		}
+	}
+	Virtual::switchAddressSpace(previousAddressSpace);
+	if (interruptsEnabled) {
+		IDT::enableInterrupts();
+	}
+	// Pages mapped before a failure are freed along with the task
+	return mapped ? base : INVALID_ADDRESS;
+}
+
+// Runs the task in ring 3 from entry with argument in rdi on a new kernel thread of the CPU executing this function
+// Returns false if the kernel thread could not be created
+bool Kernel::Tasks::start(Task *task, void *entry, void *stackTop, uint64_t argument) {
+	task->entry = entry;
+	task->stackTop = stackTop;
+	task->argument = argument;
+	return Threads::create(runTask, task);
+}
+
+// Starts a task that makes the given number of null syscalls
+// and prints the average round trip cost in TSC cycles once it exits
+// Returns false if the task could not be set up
+bool Kernel::Tasks::startSyscallBenchmark(uint64_t iterations) {
+	using namespace Memory;
+
+	if (iterations == 0) {
+		return false;
+	}
+	Task *task = create();
+	if (!task) {
+		return false;
+	}
+	void *code = map(
+		task,
+		userSyscallBenchmark,
+		userSyscallBenchmarkEnd - userSyscallBenchmark,
+		RequestType::Executable
+	);
+	void *stack = map(task, nullptr, userStackSize, RequestType::Writable);
+	task->onExit = printSyscallBenchmark;
+	if (
+		code == INVALID_ADDRESS ||
+		stack == INVALID_ADDRESS ||
+		!start(task, code, (void*)((uint64_t)stack + userStackSize), iterations)
+	) {
+		destroy(task);
+		return false;
+	}
+	return true;
+}
+
+static bool areInterruptsEnabled() {
+	return __builtin_ia32_readeflags_u64() & interruptFlag;
+}
+
+// Leaves ring 3 for good, the task is destroyed and its kernel thread finishes
+static int64_t exitSyscall(uint64_t exitCode, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t) {
+	using namespace Kernel;
+
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	Threads::Thread *thread = cpu->currentThread;
+	Tasks::Task *task = (Tasks::Task*)thread->argument;
+	task->exitCode = (int64_t)exitCode;
+	// The thread carries on as a regular kernel thread until it finishes
+	Memory::Virtual::switchAddressSpace(Memory::Virtual::getKernelAddressSpace());
+	thread->addressSpace = nullptr;
+	cpu->syscallStack = nullptr;
+	IDT::enableInterrupts();
+	if (task->onExit) {
+		task->onExit(task);
+	}
+	Tasks::destroy(task);
+	Threads::exit();
+}
+
+static int64_t nullSyscall(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t) {
+	return 0;
+}
+
+static void printSyscallBenchmark(Kernel::Tasks::Task *task) {
+	terminalPrintString(syscallBenchmarkStr, strlen(syscallBenchmarkStr));
+	terminalPrintDecimal(task->exitCode);
+	terminalPrintString(cyclesStr, strlen(cyclesStr));
+}
+
+// Entry of the kernel thread that runs a task
+static void runTask(void *argument) {
+	using namespace Kernel;
+
+	Tasks::Task *task = (Tasks::Task*)argument;
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	Threads::Thread *thread = cpu->currentThread;
+	IDT::disableInterrupts();
+	// From now on Threads::runNext switches to the task's address space whenever it runs this thread
+	thread->addressSpace = task->addressSpace;
+	cpu->syscallStack = (void*)((uint64_t)thread->stack + THREAD_STACK_SIZE);
+	Memory::Virtual::switchAddressSpace(task->addressSpace);
+	Tasks::enterUserMode(task->entry, task->stackTop, task->argument);
+}
+
+static int64_t yieldSyscall(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t) {
+	Kernel::Threads::yield();
+	return 0;
+}
@@ -0,0 +1,139 @@
+[bits 64]
+
+; Offsets in APIC::CPU
+CPU_SYSCALL_STACK equ 8
+CPU_USER_STACK_POINTER equ 16
+
+RFLAGS_RESERVED equ 1 << 1
+RFLAGS_INTERRUPT equ 1 << 9
+
+SYSCALL_NULL equ 0
+SYSCALL_EXIT equ 1
+
+section .text
+	extern preemptThread
+	extern syscallCount
+	extern syscallTable
+	global enterUserMode
+	global syscallEntry
+	global userPreemptionTrampoline
+	global userSyscallBenchmark
+	global userSyscallBenchmarkEnd
+
+; rdi has the user entry point, rsi has the user stack pointer, rdx has the argument passed to the entry in rdi
+; Drops to ring 3 through SYSRET and never returns, the kernel stack is free for syscalls from then on
+enterUserMode:
+	cli
+	mov rcx, rdi
+	mov rsp, rsi
+	mov rdi, rdx
+	mov r11, RFLAGS_RESERVED | RFLAGS_INTERRUPT
+	xor eax, eax
+	xor ebx, ebx
+	xor edx, edx
+	xor esi, esi
+	xor ebp, ebp
+	xor r8d, r8d
+	xor r9d, r9d
+	xor r10d, r10d
+	xor r12d, r12d
+	xor r13d, r13d
+	xor r14d, r14d
+	xor r15d, r15d
+	swapgs	; Ring 3 gets its own GS base, see APIC::setCurrentCpu
+	o64 sysret
+
+; SYSCALL lands here with the user rip in rcx, the user rflags in r11, and interrupts disabled by FMASK
+; rax has the syscall number, rdi, rsi, rdx, r10, r8, r9 have the arguments and rax gets the result
+; A syscall behaves like a function call to user code, so only rsp, rcx, and r11 are saved here
+; The handlers keep rbx, rbp, and r12 to r15 intact and the other registers are not expected to survive
+syscallEntry:
+	swapgs	; The kernel GS base stays loaded until the return to ring 3
+	mov [gs:CPU_USER_STACK_POINTER], rsp
+	mov rsp, [gs:CPU_SYSCALL_STACK]
+	push qword [gs:CPU_USER_STACK_POINTER]
+	push rcx
+	push r11
+	sub rsp, 8
+	cmp rax, [syscallCount]
+	jae .invalid
+	mov rcx, r10
+	call [syscallTable + rax * 8]
+	jmp .return
+.invalid:
+	mov rax, -1
+.return:
+	; Do not leak kernel values in the scratch registers
+	xor edi, edi
+	xor esi, esi
+	xor edx, edx
+	xor r8d, r8d
+	xor r9d, r9d
+	xor r10d, r10d
+	add rsp, 8
+	pop r11
+	pop rcx
+	pop rsp
+	swapgs
+	o64 sysret
+
+; Entered through the return frame of a timer interrupt that preempted a user task
+; The interrupt return frame to user mode is on the task thread's kernel stack and interrupts are disabled
+; Saves everything the interrupted code did not expect to lose, including SSE state, and yields the CPU
+userPreemptionTrampoline:
+	push rax
+	push rcx
+	push rdx
+	push rsi
+	push rdi
+	push r8
+	push r9
+	push r10
+	push r11
+	push rbp
+	mov rbp, rsp
+	and rsp, -16
+	sub rsp, 512
+	fxsave64 [rsp]
+	cld
+	call preemptThread
+	fxrstor64 [rsp]
+	mov rsp, rbp
+	pop rbp
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdi
+	pop rsi
+	pop rdx
+	pop rcx
+	pop rax
+	cli
+	swapgs	; The frame returns to ring 3, see APIC::setCurrentCpu
+	iretq
+
+; Ring 3 program copied into the syscall benchmark task, must stay position independent
+; rdi has the iteration count, exits with the average null syscall round trip in TSC cycles
+userSyscallBenchmark:
+	mov rbx, rdi
+	mov r13, rdi
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov r12, rax
+.loop:
+	mov eax, SYSCALL_NULL
+	syscall
+	dec r13
+	jnz .loop
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	sub rax, r12
+	xor edx, edx
+	div rbx
+	mov rdi, rax
+	mov eax, SYSCALL_EXIT
+	syscall
+userSyscallBenchmarkEnd:
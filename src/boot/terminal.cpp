@@ -30,43 +30,11 @@ static uint16_t cursorPort = 0x3d4;
 static uint16_t cursorPortIndex = 0x3d5;
 static const char* const spaces4 = "    ";
 
-static Async::Spinlock consoleLock;
+// Interrupt handlers such as the keyboard and mouse drivers print too, so the lock keeps interrupts disabled while held
+// The static helpers below expect the lock to be held by their caller
+static Async::InterruptSafeSpinlock consoleLock;
 
-extern "C" {
-
-// Check if video mode is 80x25 VGA
-bool isTerminalMode() {
-	// FIXME: Add functionality to actually check if the mode is the assumed one
-	return vgaMode80x25;
-}
-
-void terminalSetBgColour(uint8_t colour) {
-	currentBgColour = colour;
-	currentTerminalColour = currentBgColour << 4 | currentTextColour;
-}
-
-void terminalSetTextColour(uint8_t colour) {
-	currentTextColour = colour;
-	currentTerminalColour = currentBgColour << 4 | currentTextColour;
-}
-
-void terminalGetCursorPosition(size_t *x, size_t *y) {
-	*x = cursorX;
-	*y = cursorY;
-}
-
-void terminalClearScreen() {
-	if (!isTerminalMode()) {
-		return;
-	}
-	for (size_t i = 0; i < vgaHeight; ++i) {
-		terminalClearLine(i);
-	}
-	cursorX = cursorY = 0;
-	terminalSetCursorPosition(0, 0);
-}
-
-void terminalClearLine(size_t lineNumber) {
+static void clearLine(size_t lineNumber) {
 	uint64_t data = 0;
 	for (size_t i = 0; i < 4; ++i) {
 		data <<= 8;
@@ -81,7 +49,7 @@ void terminalClearLine(size_t lineNumber) {
 }
 
 // Set the cursor to a given (x, y) where 0<=x<=79 and 0<=y<=24
-void terminalSetCursorPosition(size_t x, size_t y) {
+static void setCursorPosition(size_t x, size_t y) {
 	if (!isTerminalMode() || x >= vgaWidth || y >= vgaHeight) {
 		return;
 	}
@@ -94,16 +62,16 @@ void terminalSetCursorPosition(size_t x, size_t y) {
 	IO::outputByte(cursorPortIndex, (uint8_t)((position >> 8) & 0xff));
 }
 
-void terminalScroll(size_t lineCount) {
+static void scroll(size_t lineCount) {
 	// TODO: hide scrolled data somewhere for pgUp and pgDown
 	size_t count = lineCount * vgaWidth * 2;
 	memcpy(videoMemory, videoMemory + count, videoMemSize - count);
 	for (size_t i = 0; i < lineCount; ++i) {
-		terminalClearLine(vgaHeight - i - 1);
+		clearLine(vgaHeight - i - 1);
 	}
 }
 
-void terminalPrintChar(char c) {
+static void printChar(char c) {
 	if (!isTerminalMode() || cursorX >= vgaWidth || cursorY >= vgaHeight) {
 		cursorX = cursorY = 0;
 		return;
@@ -119,26 +87,94 @@ void terminalPrintChar(char c) {
 		++cursorY;
 	}
 	if (cursorY >= vgaHeight) {
-		terminalScroll(1);
+		scroll(1);
 		cursorX = 0;
 		cursorY = vgaHeight - 1;
 	}
-	terminalSetCursorPosition(cursorX, cursorY);
+	setCursorPosition(cursorX, cursorY);
 }
 
-// Prints a string of given length to the terminal
-void terminalPrintString(const char *str, const size_t length) {
+static void printString(const char *str, const size_t length) {
+	for (size_t i = 0; i < length; ++i, ++str) {
+		printChar(*str);
+	}
+}
+
+extern "C" {
+
+// Check if video mode is 80x25 VGA
+bool isTerminalMode() {
+	// FIXME: Add functionality to actually check if the mode is the assumed one
+	return vgaMode80x25;
+}
+
+void terminalSetBgColour(uint8_t colour) {
 	consoleLock.lock();
+	currentBgColour = colour;
+	currentTerminalColour = currentBgColour << 4 | currentTextColour;
+	consoleLock.unlock();
+}
 
-	// Print only length number of characters to the terminal to avoid a potential buffer overrun
-	// that can be caused by no null char at end of string
+void terminalSetTextColour(uint8_t colour) {
+	consoleLock.lock();
+	currentTextColour = colour;
+	currentTerminalColour = currentBgColour << 4 | currentTextColour;
+	consoleLock.unlock();
+}
+
+void terminalGetCursorPosition(size_t *x, size_t *y) {
+	consoleLock.lock();
+	*x = cursorX;
+	*y = cursorY;
+	consoleLock.unlock();
+}
+
+void terminalClearScreen() {
 	if (!isTerminalMode()) {
 		return;
 	}
-	for (size_t i = 0; i < length; ++i, ++str) {
-		terminalPrintChar(*str);
+	consoleLock.lock();
+	for (size_t i = 0; i < vgaHeight; ++i) {
+		clearLine(i);
 	}
+	cursorX = cursorY = 0;
+	setCursorPosition(0, 0);
+	consoleLock.unlock();
+}
+
+void terminalClearLine(size_t lineNumber) {
+	consoleLock.lock();
+	clearLine(lineNumber);
+	consoleLock.unlock();
+}
+
+void terminalSetCursorPosition(size_t x, size_t y) {
+	consoleLock.lock();
+	setCursorPosition(x, y);
+	consoleLock.unlock();
+}
+
+void terminalScroll(size_t lineCount) {
+	consoleLock.lock();
+	scroll(lineCount);
+	consoleLock.unlock();
+}
 
+void terminalPrintChar(char c) {
+	consoleLock.lock();
+	printChar(c);
+	consoleLock.unlock();
+}
+
+// Prints a string of given length to the terminal
+void terminalPrintString(const char *str, const size_t length) {
+	// Print only length number of characters to the terminal to avoid a potential buffer overrun
+	// that can be caused by no null char at end of string
+	if (!isTerminalMode()) {
+		return;
+	}
+	consoleLock.lock();
+	printString(str, length);
 	consoleLock.unlock();
 }
 
@@ -147,13 +183,6 @@ void terminalPrintSpaces4() {
 }
 
 void terminalPrintDecimal(int64_t value) {
-	if (value == 0) {
-		terminalPrintChar('0');
-		return;
-	}
-	if (value < 0) {
-		terminalPrintChar('-');
-	}
 	uint8_t digits[24] = { 0 };
 	uint64_t v = value < 0 ? -value : value;
 	size_t digitCount = 0;
@@ -162,21 +191,30 @@ void terminalPrintDecimal(int64_t value) {
 		v /= 10;
 		++digitCount;
 	}
+	consoleLock.lock();
+	if (value == 0) {
+		printChar('0');
+	} else if (value < 0) {
+		printChar('-');
+	}
 	for (int i = digitCount - 1; i >= 0; --i) {
-		terminalPrintChar(hexPalette[digits[i]]);
+		printChar(hexPalette[digits[i]]);
 	}
+	consoleLock.unlock();
 }
 
 void terminalPrintHex(const void* const value, size_t size) {
-	terminalPrintString("[0x", 3);
 	char hexValue[size * 2];
 	for (size_t i = 0; i < size; ++i) {
 		uint8_t x = *((uint8_t*)value + i);
 		hexValue[size * 2 - 1 - i * 2] = hexPalette[x & 0xf];
 		hexValue[size * 2 - 2 - i * 2] = hexPalette[(x >> 4) & 0xf];
 	}
-	terminalPrintString(hexValue, size * 2);
-	terminalPrintChar(']');
+	consoleLock.lock();
+	printString("[0x", 3);
+	printString(hexValue, size * 2);
+	printChar(']');
+	consoleLock.unlock();
 }
 
 }
@@ -0,0 +1,241 @@
+#include <apic.h>
+#include <cstring>
+#include <kernel.h>
+#include <terminal.h>
+
+static const char* const noThreadStr = "\nAttempted to exit outside of a kernel thread\n";
+static const char* const stackFreeFailedStr = "\nFailed to free kernel thread stack\n";
+
+static const uint64_t interruptFlag = 1 << 9;
+static const uint64_t reservedFlag = 1 << 1;
+static const uint64_t kernelCodeSelector = 0x08;
+static const uint64_t kernelDataSelector = 0x10;
+static const uint64_t userCodeSelector = 0x2b;
+
+static void appendReadyThread(APIC::CPU *cpu, Kernel::Threads::Thread *thread);
+static bool areInterruptsEnabled();
+static void setTimerDeadline(APIC::CPU *cpu, uint64_t now, uint64_t deadline);
+
+extern "C" void preemptThread();
+extern "C" [[noreturn]] void runThread();
+
+// Creates a kernel thread running entry(argument) on the CPU executing this function
+// Returns false if the thread's stack could not be allocated
+bool Kernel::Threads::create(void (*entry)(void *argument), void *argument) {
+	using namespace Memory;
+
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	if (!cpu || !entry) {
+		return false;
+	}
+	const auto requestResult = Virtual::requestPages(
+		THREAD_STACK_SIZE / pageSize,
+		(
+			RequestType::AllocatePhysical |
+			RequestType::Kernel |
+			RequestType::VirtualContiguous |
+			RequestType::Writable
+		)
+	);
+	if (requestResult.address == INVALID_ADDRESS || requestResult.allocatedCount != THREAD_STACK_SIZE / pageSize) {
+		return false;
+	}
+	Thread *thread = new Thread();
+	thread->stack = requestResult.address;
+	thread->entry = entry;
+	thread->argument = argument;
+
+	// Lay out the stack as if switchContext had switched away from threadStart
+	uint64_t *stackTop = (uint64_t*)((uint64_t)thread->stack + THREAD_STACK_SIZE);
+	*--stackTop = (uint64_t)&threadStart;
+	for (size_t i = 0; i < 6; ++i) {
+		*--stackTop = 0;
+	}
+	thread->stackPointer = stackTop;
+
+	const bool interruptsEnabled = areInterruptsEnabled();
+	IDT::disableInterrupts();
+	appendReadyThread(cpu, thread);
+	if (interruptsEnabled) {
+		IDT::enableInterrupts();
+	}
+	return true;
+}
+
+// Nestable, used by Async::Spinlock
+void Kernel::Threads::disablePreemption() {
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	if (cpu) {
+		++cpu->preemptionDisabled;
+	}
+}
+
+void Kernel::Threads::enablePreemption() {
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	if (cpu) {
+		--cpu->preemptionDisabled;
+	}
+}
+
+// Finishes the kernel thread executing this function, its stack is freed by the dispatch loop
+void Kernel::Threads::exit() {
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	Thread *thread = cpu ? cpu->currentThread : nullptr;
+	if (!thread) {
+		terminalPrintString(noThreadStr, strlen(noThreadStr));
+		panic();
+	}
+	IDT::disableInterrupts();
+	thread->finished = true;
+	switchContext(&thread->stackPointer, cpu->dispatchStackPointer);
+	__builtin_unreachable();
+}
+
+// Called by the CPU timer interrupt handler
+// Makes the interrupted kernel thread return into preemptionTrampoline,
+// or userPreemptionTrampoline if it was running a user task, if its time slice is over
+// A thread is also preempted when the CPU's timer wheel is due so that the dispatch loop expires its timers
+// Otherwise rearms the timer for the end of the slice, or shortly after if preemption is disabled
+void Kernel::Threads::preemptIfDue(InterruptFrame *frame) {
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	if (!cpu || !cpu->currentThread || (frame->cs != kernelCodeSelector && frame->cs != userCodeSelector)) {
+		return;
+	}
+	// The timer may fire slightly early due to calibration rounding
+	const uint64_t now = Time::nowNs();
+	const uint64_t slack = THREAD_TIME_SLICE / 16;
+	if (cpu->preemptionDisabled) {
+		APIC::setTimerDeadline(THREAD_PREEMPTION_RETRY);
+		return;
+	}
+	const uint64_t due = (cpu->wheelDeadline && cpu->wheelDeadline < cpu->sliceEnd) ? cpu->wheelDeadline : cpu->sliceEnd;
+	if (now + slack < due) {
+		setTimerDeadline(cpu, now, cpu->sliceEnd);
+		return;
+	}
+	if (frame->cs == userCodeSelector) {
+		// The user stack cannot be trusted, the whole frame moves to the thread's kernel stack
+		// which is unused while the thread is in ring 3
+		uint64_t *stack = (uint64_t*)cpu->syscallStack;
+		*--stack = frame->ss;
+		*--stack = frame->rsp;
+		*--stack = frame->rflags;
+		*--stack = frame->cs;
+		*--stack = frame->rip;
+		frame->rip = (uint64_t)&Tasks::userPreemptionTrampoline;
+		frame->cs = kernelCodeSelector;
+		frame->rflags = reservedFlag;
+		frame->rsp = (uint64_t)stack;
+		frame->ss = kernelDataSelector;
+		return;
+	}
+	// Kernel code has no red zone so the interrupted stack can be pushed to right away
+	uint64_t *stack = (uint64_t*)frame->rsp;
+	*--stack = frame->rip;
+	*--stack = frame->rflags;
+	frame->rsp = (uint64_t)stack;
+	frame->rip = (uint64_t)&preemptionTrampoline;
+	frame->rflags &= ~interruptFlag;
+}
+
+// Runs the next ready kernel thread of the CPU executing this function for one time slice
+// Returns false if there was no thread to run
+bool Kernel::Threads::runNext() {
+	using namespace Memory;
+
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	if (!cpu || !cpu->readyThreads) {
+		return false;
+	}
+	IDT::disableInterrupts();
+	Thread *thread = cpu->readyThreads;
+	cpu->readyThreads = thread->next;
+	if (!cpu->readyThreads) {
+		cpu->readyThreadsTail = nullptr;
+	}
+	thread->next = nullptr;
+	const uint64_t now = Time::nowNs();
+	cpu->sliceEnd = now + THREAD_TIME_SLICE;
+	setTimerDeadline(cpu, now, cpu->sliceEnd);
+	cpu->currentThread = thread;
+	if (thread->addressSpace) {
+		cpu->syscallStack = (void*)((uint64_t)thread->stack + THREAD_STACK_SIZE);
+		Virtual::switchAddressSpace(thread->addressSpace);
+	}
+	switchContext(&cpu->dispatchStackPointer, thread->stackPointer);
+
+	// Back when the thread yielded, got preempted or finished, with interrupts still disabled
+	// The timer was armed for the slice, hand it back to the timer wheel
+	cpu->currentThread = nullptr;
+	setTimerDeadline(cpu, Time::nowNs(), UINT64_MAX);
+	if (thread->addressSpace) {
+		Virtual::switchAddressSpace(Virtual::getKernelAddressSpace());
+	}
+	if (!thread->finished) {
+		appendReadyThread(cpu, thread);
+		IDT::enableInterrupts();
+		return true;
+	}
+	IDT::enableInterrupts();
+	if (!Virtual::freePages(thread->stack, THREAD_STACK_SIZE / pageSize, RequestType::Kernel | RequestType::AllocatePhysical)) {
+		terminalPrintString(stackFreeFailedStr, strlen(stackFreeFailedStr));
+	}
+	delete thread;
+	return true;
+}
+
+// Gives the rest of the time slice of the kernel thread executing this function to the CPU's dispatch loop
+// Does nothing outside of kernel threads
+void Kernel::Threads::yield() {
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	Thread *thread = cpu ? cpu->currentThread : nullptr;
+	if (!thread) {
+		return;
+	}
+	const bool interruptsEnabled = areInterruptsEnabled();
+	IDT::disableInterrupts();
+	switchContext(&thread->stackPointer, cpu->dispatchStackPointer);
+	if (interruptsEnabled) {
+		IDT::enableInterrupts();
+	}
+}
+
+// Called by preemptionTrampoline
+void preemptThread() {
+	Kernel::Threads::yield();
+}
+
+// Called by threadStart
+void runThread() {
+	Kernel::Threads::Thread *thread = APIC::getCurrentCpu()->currentThread;
+	thread->entry(thread->argument);
+	Kernel::Threads::exit();
+}
+
+// Must be called with interrupts disabled
+static void appendReadyThread(APIC::CPU *cpu, Kernel::Threads::Thread *thread) {
+	thread->next = nullptr;
+	if (cpu->readyThreadsTail) {
+		cpu->readyThreadsTail->next = thread;
+	} else {
+		cpu->readyThreads = thread;
+	}
+	cpu->readyThreadsTail = thread;
+}
+
+static bool areInterruptsEnabled() {
+	return __builtin_ia32_readeflags_u64() & interruptFlag;
+}
+
+// Arms the CPU timer for a deadline in Time::nowNs() time, or for the timer wheel's deadline if that comes first
+// The timer is stopped if neither needs it, a deadline of UINT64_MAX stands for none
+static void setTimerDeadline(APIC::CPU *cpu, uint64_t now, uint64_t deadline) {
+	if (cpu->wheelDeadline && cpu->wheelDeadline < deadline) {
+		deadline = cpu->wheelDeadline;
+	}
+	if (deadline == UINT64_MAX) {
+		APIC::stopTimer();
+		return;
+	}
+	APIC::setTimerDeadline(deadline > now ? deadline - now : 0);
+}
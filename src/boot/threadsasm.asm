@@ -0,0 +1,69 @@
+[bits 64]
+
+section .text
+	extern preemptThread
+	extern runThread
+	global preemptionTrampoline
+	global switchContext
+	global threadStart
+
+; Entered through the return frame of a timer interrupt that preempted a kernel thread
+; The interrupted rip and rflags are on the thread's stack and interrupts are disabled
+; Saves everything the interrupted code did not expect to lose, including SSE state, and yields the CPU
+preemptionTrampoline:
+	push rax
+	push rcx
+	push rdx
+	push rsi
+	push rdi
+	push r8
+	push r9
+	push r10
+	push r11
+	push rbp
+	mov rbp, rsp
+	and rsp, -16
+	sub rsp, 512
+	fxsave64 [rsp]
+	cld
+	call preemptThread
+	fxrstor64 [rsp]
+	mov rsp, rbp
+	pop rbp
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdi
+	pop rsi
+	pop rdx
+	pop rcx
+	pop rax
+	popfq
+	ret
+
+; rdi has the address where the current stack pointer is saved, rsi has the stack pointer to switch to
+; Only callee saved registers are kept since both sides get here through a function call
+; Must be called with interrupts disabled
+switchContext:
+	push rbp
+	push rbx
+	push r12
+	push r13
+	push r14
+	push r15
+	mov [rdi], rsp
+	mov rsp, rsi
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbx
+	pop rbp
+	ret
+
+; switchContext returns here the first time a thread runs
+threadStart:
+	sti
+	and rsp, -16
+	call runThread
@@ -0,0 +1,215 @@
+#include <atomic>
+#include <commonstrings.h>
+#include <cstring>
+#include <drivers/timers/hpet.h>
+#include <kernel.h>
+#include <terminal.h>
+
+static const char* const initTimeStr = "Initializing clocksource";
+static const char* const invariantTscStr = "Checking invariant TSC presence";
+static const char* const calibratingTscStr = "Calibrating TSC against HPET";
+static const char* const usingHpetStr = "Using HPET main counter as clocksource\n";
+static const char* const frequencyStr = "TSC frequency [";
+static const char* const hzStr = "] Hz\n";
+static const char* const tscAdjustedStr = "TSC offset from the other CPUs corrected with IA32_TSC_ADJUST\n";
+static const char* const tscUnsyncedStr = "TSC not synchronized across CPUs, switched clocksource to HPET main counter\n";
+
+bool Kernel::Time::invariantTsc = false;
+uint64_t Kernel::Time::tscFrequency = 0;
+
+// Readings at which nowNs returns 0
+static uint64_t clockBase = 0;
+static uint64_t hpetClockBase = 0;
+// Set while nowNs reads the TSC, cleared for good if a CPU's TSC turns out to be offset from the others'
+static std::atomic<bool> tscClocksource = false;
+// Handshake between a starting CPU and the CPU that started it, see syncTsc and serveTscSync
+// Start up is serialized so a single handshake is ever in progress
+static std::atomic<uint64_t> tscSyncStage = 0;
+static std::atomic<uint64_t> tscSyncValue = 0;
+static int64_t tscSyncOffset = 0;	// TSC of the starting CPU minus that of the serving CPU, in cycles
+static uint64_t tscSyncUncertainty = 0;	// half of the shortest round trip, the offset is exact to within it
+// 32.32 fixed point conversion factors between TSC cycles and nanoseconds
+static uint64_t nanosecondsPerCycle = 0;
+static uint64_t cyclesPerNanosecond = 0;
+
+static int64_t measureTscOffset(uint64_t &stage);
+static uint64_t readTscOrdered();
+static void respondToTscMeasurement(uint64_t &stage);
+
+// Detects invariant TSC and calibrates its frequency against the HPET main counter
+// Falls back to the HPET main counter when the TSC is not invariant since its rate may then differ between CPUs
+// Must be called after HPET initialization and before any clock reading
+bool Kernel::Time::initialize() {
+	using namespace Drivers::Timers;
+
+	terminalPrintString(initTimeStr, strlen(initTimeStr));
+	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
+	terminalPrintChar('\n');
+	if (!HPET::registers) {
+		return false;
+	}
+
+	terminalPrintSpaces4();
+	terminalPrintString(invariantTscStr, strlen(invariantTscStr));
+	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
+	if (!isInvariantTscSupported()) {
+		terminalPrintString(notStr, strlen(notStr));
+		terminalPrintChar(' ');
+		terminalPrintString(presentStr, strlen(presentStr));
+		terminalPrintChar('\n');
+		terminalPrintSpaces4();
+		terminalPrintString(usingHpetStr, strlen(usingHpetStr));
+		hpetClockBase = HPET::readCounter();
+		return true;
+	}
+	terminalPrintString(presentStr, strlen(presentStr));
+	terminalPrintChar('\n');
+
+	terminalPrintSpaces4();
+	terminalPrintString(calibratingTscStr, strlen(calibratingTscStr));
+	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
+	const uint64_t hpetStart = HPET::readCounter();
+	const uint64_t hpetEnd = hpetStart + HPET::nanosecondsToTicks(TSC_CALIBRATION_TIME);
+	const uint64_t tscStart = __builtin_ia32_rdtsc();
+	uint64_t hpetNow;
+	while ((hpetNow = HPET::readCounter()) < hpetEnd) {
+		__builtin_ia32_pause();
+	}
+	const uint64_t tscElapsed = __builtin_ia32_rdtsc() - tscStart;
+	const uint64_t elapsedTime = HPET::ticksToNanoseconds(hpetNow - hpetStart);
+	if (elapsedTime == 0 || tscElapsed == 0) {
+		terminalPrintString(failedStr, strlen(failedStr));
+		terminalPrintChar('\n');
+		return false;
+	}
+	tscFrequency = tscElapsed * 1000000000 / elapsedTime;
+	if (tscFrequency == 0) {
+		terminalPrintString(failedStr, strlen(failedStr));
+		terminalPrintChar('\n');
+		return false;
+	}
+	nanosecondsPerCycle = (1000000000UL << 32) / tscFrequency;
+	cyclesPerNanosecond = ((tscFrequency / 1000000000) << 32) + ((tscFrequency % 1000000000) << 32) / 1000000000;
+	invariantTsc = true;
+	clockBase = tscStart;
+	tscClocksource.store(true, std::memory_order_release);
+	terminalPrintString(doneStr, strlen(doneStr));
+	terminalPrintChar('\n');
+	terminalPrintSpaces4();
+	terminalPrintString(frequencyStr, strlen(frequencyStr));
+	terminalPrintDecimal(tscFrequency);
+	terminalPrintString(hzStr, strlen(hzStr));
+	return true;
+}
+
+// Returns nanoseconds elapsed since clocksource initialization
+// Readings are consistent across CPUs since the invariant TSC runs at the same rate on all of them
+// and syncTsc checks every other CPU's TSC against the CPU that started it, the HPET main counter is used otherwise
+uint64_t Kernel::Time::nowNs() {
+	if (tscClocksource.load(std::memory_order_acquire)) {
+		return cyclesToNanoseconds(__builtin_ia32_rdtsc() - clockBase);
+	}
+	return Drivers::Timers::HPET::ticksToNanoseconds(Drivers::Timers::HPET::readCounter() - hpetClockBase);
+}
+
+// Run by a CPU that has just been started, right after it has resumed the CPU that started it
+// which runs serveTscSync meanwhile
+// The TSC offset is measured, corrected with IA32_TSC_ADJUST if the CPU supports it and then measured again
+void Kernel::Time::syncTsc() {
+	if (!invariantTsc) {
+		return;
+	}
+	uint64_t stage = 0;
+	respondToTscMeasurement(stage);
+	// The serving CPU has published the offset by now
+	if ((uint64_t)(tscSyncOffset < 0 ? -tscSyncOffset : tscSyncOffset) > tscSyncUncertainty && isTscAdjustSupported()) {
+		writeMsr(MSR::tscAdjust, readMsr(MSR::tscAdjust) - tscSyncOffset);
+		terminalPrintString(tscAdjustedStr, strlen(tscAdjustedStr));
+	}
+	tscSyncStage.store(++stage, std::memory_order_release);
+	respondToTscMeasurement(stage);
+}
+
+// Run by the CPU that started another one once it has been resumed by it, see syncTsc
+// Switches the clocksource to the HPET main counter for good if the other CPU's TSC is still offset after correction
+// Must be run by a CPU whose TSC has been checked, which the boot CPU's is by definition
+void Kernel::Time::serveTscSync() {
+	using namespace Drivers::Timers;
+
+	if (!invariantTsc) {
+		return;
+	}
+	uint64_t stage = 0;
+	measureTscOffset(stage);
+	// Wait for the other CPU to apply the correction
+	while (tscSyncStage.load(std::memory_order_acquire) != stage + 1) {
+		__builtin_ia32_pause();
+	}
+	++stage;
+	const int64_t offset = measureTscOffset(stage);
+	tscSyncStage.store(0, std::memory_order_relaxed);
+	if ((uint64_t)(offset < 0 ? -offset : offset) <= tscSyncUncertainty || !tscClocksource.load(std::memory_order_relaxed)) {
+		return;
+	}
+	// Continue from the current time so that readings jump by no more than the time it takes to switch
+	hpetClockBase = HPET::readCounter() - HPET::nanosecondsToTicks(nowNs());
+	tscClocksource.store(false, std::memory_order_release);
+	terminalPrintString(tscUnsyncedStr, strlen(tscUnsyncedStr));
+}
+
+// Converts TSC cycles to nanoseconds
+uint64_t Kernel::Time::cyclesToNanoseconds(uint64_t cycles) {
+	return (uint64_t)(((unsigned __int128)cycles * nanosecondsPerCycle) >> 32);
+}
+
+// Converts nanoseconds to TSC cycles
+uint64_t Kernel::Time::nanosecondsToCycles(uint64_t nanoseconds) {
+	return (uint64_t)(((unsigned __int128)nanoseconds * cyclesPerNanosecond) >> 32);
+}
+
+// Pings the CPU running respondToTscMeasurement TSC_SYNC_ROUNDS times and publishes the offset of its TSC
+// estimated from the round with the shortest round trip in tscSyncOffset and tscSyncUncertainty
+// The other CPU reads its TSC between the two readings of this CPU so the estimate is off by half the round trip at most
+static int64_t measureTscOffset(uint64_t &stage) {
+	uint64_t shortestRoundTrip = UINT64_MAX;
+	int64_t offset = 0;
+	for (size_t round = 0; round < TSC_SYNC_ROUNDS; ++round) {
+		const uint64_t start = readTscOrdered();
+		tscSyncStage.store(++stage, std::memory_order_release);
+		while (tscSyncStage.load(std::memory_order_acquire) != stage + 1) {
+			__builtin_ia32_pause();
+		}
+		++stage;
+		const uint64_t end = readTscOrdered();
+		if (end - start < shortestRoundTrip) {
+			shortestRoundTrip = end - start;
+			offset = (int64_t)(tscSyncValue.load(std::memory_order_relaxed) - (start + shortestRoundTrip / 2));
+		}
+	}
+	tscSyncOffset = offset;
+	tscSyncUncertainty = shortestRoundTrip / 2;
+	tscSyncStage.store(++stage, std::memory_order_release);
+	return offset;
+}
+
+// Keeps rdtsc from being executed ahead of earlier loads
+static uint64_t readTscOrdered() {
+	asm volatile("lfence" ::: "memory");
+	return __builtin_ia32_rdtsc();
+}
+
+// Answers every ping of measureTscOffset with this CPU's TSC and returns once the offset is published
+static void respondToTscMeasurement(uint64_t &stage) {
+	for (size_t round = 0; round < TSC_SYNC_ROUNDS; ++round) {
+		while (tscSyncStage.load(std::memory_order_acquire) != stage + 1) {
+			__builtin_ia32_pause();
+		}
+		++stage;
+		tscSyncValue.store(readTscOrdered(), std::memory_order_relaxed);
+		tscSyncStage.store(++stage, std::memory_order_release);
+	}
+	while (tscSyncStage.load(std::memory_order_acquire) != stage + 1) {
+		__builtin_ia32_pause();
+	}
+	++stage;
+}
@@ -0,0 +1,43 @@
+[bits 64]
+
+section .text
+	global isInvariantTscSupported
+	global isTscAdjustSupported
+
+isInvariantTscSupported:
+	push rbx	; Preserve rbx to stay compatible with System V ABI
+	mov eax, 0x80000000
+	cpuid
+	cmp eax, 0x80000007
+	jb invariantTscNotPresent
+	mov eax, 0x80000007
+	cpuid
+	xor rax, rax
+	bt edx, 8
+	setc al
+	pop rbx
+	ret
+invariantTscNotPresent:
+	xor rax, rax
+	pop rbx
+	ret
+
+; Returns true if the IA32_TSC_ADJUST MSR is present, CPUID leaf 7 EBX bit 1
+isTscAdjustSupported:
+	push rbx
+	xor eax, eax
+	cpuid
+	cmp eax, 7
+	jb tscAdjustNotPresent
+	mov eax, 7
+	xor ecx, ecx
+	cpuid
+	xor rax, rax
+	bt ebx, 1
+	setc al
+	pop rbx
+	ret
+tscAdjustNotPresent:
+	xor rax, rax
+	pop rbx
+	ret
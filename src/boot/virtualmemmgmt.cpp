@@ -1,3 +1,7 @@
+#include <acpi.h>
+#include <apic.h>
+#include <async.h>
+#include <atomic>
 #include <commonstrings.h>
 #include <cstring>
 #include <kernel.h>
@@ -10,12 +14,46 @@ static const uint64_t nonCanonicalStart = (uint64_t)1 << (maxVirtualAddressBits
 static const uint64_t nonCanonicalEnd = ~(nonCanonicalStart - 1);
 static size_t generalPagesAvailableCount = 0;
 static size_t kernelPagesAvailableCount = 0;
+static uint64_t directMapSize = 0;
+static uint64_t kernelImageEnd = KERNEL_ORIGIN;
 static const uint64_t ptMask = (uint64_t)UINT64_MAX - 1024 * (uint64_t)GIB_1 + 1;
 static const uint64_t pdMask = ptMask + (uint64_t)pml4tRecursiveEntry * (uint64_t)GIB_1;
 static const uint64_t pdptMask = pdMask + (uint64_t)pml4tRecursiveEntry * (uint64_t)MIB_2;
 static PML4E* const pml4t = (PML4E*)(pdptMask + (uint64_t)pml4tRecursiveEntry * (uint64_t)KIB_4);
 static const size_t virtualPageIndexShift = 9;
 static const uint64_t virtualPageIndexMask = ((uint64_t)1 << virtualPageIndexShift) - 1;
+static const size_t pml4tUserStartEntry = USER_SPACE_ORIGIN >> 39;
+static const size_t pml4tUserEndEntry = PML4_ENTRY_COUNT / 2;
+// Guards the kernel and general address space lists and their page counts, the kernel page tables,
+// and the page table pools of all CPUs
+// Lock order is virtualLock, then the heap lock, then the physical memory manager lock
+static Async::InterruptSafeSpinlock virtualLock;
+static uint8_t tlbShootdownVector = 0;
+
+// Page aligned range of RAM reachable through the direct map, [start, end)
+struct DirectMapRange {
+	uint64_t start;
+	uint64_t end;
+};
+
+// Sorted and disjoint, published by initialize once they are mapped
+static DirectMapRange directMapRanges[DIRECT_MAP_MAX_RANGES];
+static size_t directMapRangeCount = 0;
+
+// Physical pages and page tables unmapped by unmapPages that other CPUs may still reach through their TLBs
+// They are reclaimed by reclaimUnmapped once every CPU has flushed
+struct UnmapBatch {
+	void *pages[UNMAP_BATCH_SIZE];
+	size_t pageCount = 0;
+	void *tables[UNMAP_BATCH_SIZE];
+	size_t tableCount = 0;
+	bool unmapped = false;	// any entry was cleared since the last shootdown
+};
+
+// PAT entries 0-3 keep their power-on values (WB, WT, UC-, UC) so PWT/PCD alone keep their usual meaning
+// Entry 4 is write-combining and is selected by setting the PAT bit
+// Entries 5-7 mirror 1-3
+static const uint64_t patValue = 0x0007040100070406;
 
 static const char* const initVirMemStr = "Initializing virtual memory management";
 static const char* const initVirMemCompleteStr = "Virtual memory management initialized\n\n";
@@ -35,6 +73,7 @@ static const char* const addrSpaceStr = " address space list\n";
 static const char* const addrSpaceHeader = "Base                 Page count           Available\n";
 static const char* const creatingListsStr = "Creating virtual address space lists";
 static const char* const recursiveStr = "Creating PML4 recursive entry";
+static const char* const sharedPdptsStr = "Allocating page directory pointer tables shared with user tasks";
 static const char* const checkingMaxBitsStr = "Checking max virtual address bits";
 static const char* const virtualNamespaceStr = "Kernel::Memory::Virtual::";
 static const char* const freeErrorStr = "tried to free already free pages";
@@ -45,10 +84,28 @@ static const char* const requestErrorStr = "did not pass RequestType::VirtualCon
 static const char* const globalCtorStr = "Running global constructors";
 static const char* const listDefragFailStr = "defragAddressSpaceList integrity check failed for ";
 static const char* const mapFailStr = "failed to (un)map pages";
+static const char* const directMapStr = "Mapping physical memory at ";
 
+static void allocatePageTable(
+	Kernel::Memory::Virtual::CrawlResult &crawlResult,
+	size_t level,
+	uint64_t virAddr,
+	uint32_t flags
+);
 static void defragAddressSpaceList(uint32_t flags);
+static size_t findUsedBlock(const Kernel::Memory::Virtual::AddressSpaceList &list, uint64_t vBeg, uint64_t vEnd);
+static void flushRequestedTlb(APIC::CPU *cpu);
+static void freeUserPageTable(uint64_t tablePhysical, size_t level);
+static bool isDirectMapped(uint64_t physicalAddress);
+static bool isSharedEntry(size_t pml4Index);
+static void reclaimUnmapped(UnmapBatch &batch);
+static void releasePageTable(Kernel::Memory::Virtual::CrawlResult &crawlResult, size_t level, UnmapBatch &batch);
+static bool mapLargePages(void *virtualAddress, void *physicalAddress, size_t count, uint32_t flags);
+static void setMemoryType(PML4E &entry, uint32_t flags, bool largePage);
+static void shootdownTlbs();
+static void tlbShootdownHandler(void*, Kernel::Threads::InterruptFrame*);
 
-Kernel::Memory::Virtual::AddressSpaceList Kernel::Memory::Virtual::generalAddressSpaceList(8);
+Kernel::Memory::Virtual::AddressSpaceList Kernel::Memory::Virtual::generalAddressSpaceList(9);
 Kernel::Memory::Virtual::AddressSpaceList Kernel::Memory::Virtual::kernelAddressSpaceList(2);
 
 // Initializes virtual memory space for use by higher level dynamic memory manager and other kernel services
@@ -58,6 +115,7 @@ bool Kernel::Memory::Virtual::initialize(
 	GlobalConstructor (&globalCtors)[]
 ) {
 	uint64_t mib1 = 0x100000;
+	kernelImageEnd = (uint64_t)usableKernelSpaceStart;
 	terminalPrintString(initVirMemStr, strlen(initVirMemStr));
 	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
 	terminalPrintChar('\n');
@@ -83,6 +141,9 @@ bool Kernel::Memory::Virtual::initialize(
 	terminalPrintString(okStr, strlen(okStr));
 	terminalPrintChar('\n');
 
+	// Program the PAT before any page gets mapped with a memory type other than write-back
+	loadPat();
+
 	// Mark all existing identity mapped page tables as marked in physical memory
 	terminalPrintSpaces4();
 	terminalPrintString(markingPml4Str, strlen(markingPml4Str));
@@ -98,7 +159,8 @@ bool Kernel::Memory::Virtual::initialize(
 					PDE *pdtId = (PDE*)((uint64_t)pdptId[j].physicalAddress << pageSizeShift);
 					Physical::markPages(pdtId, 1, MarkPageType::Used);
 					for (size_t k = 0; k < PML4_ENTRY_COUNT; ++k) {
-						if (pdtId[k].present) {
+						// 2MiB kernel pages map the kernel image directly and have no page table
+						if (pdtId[k].present && !pdtId[k].largePage) {
 							PTE *ptId = (PTE*)((uint64_t)pdtId[k].physicalAddress << pageSizeShift);
 							Physical::markPages(ptId, 1, MarkPageType::Used);
 						}
@@ -126,6 +188,27 @@ bool Kernel::Memory::Virtual::initialize(
 	terminalPrintString(doneStr, strlen(doneStr));
 	terminalPrintChar('\n');
 
+	// Give every PML4 entry shared with user tasks a page directory pointer table now
+	// so that these entries never change and createAddressSpace only has to copy them once
+	// unmapPages never releases these tables
+	terminalPrintSpaces4();
+	terminalPrintString(sharedPdptsStr, strlen(sharedPdptsStr));
+	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
+	for (size_t i = 0; i < PML4_ENTRY_COUNT; ++i) {
+		if (!isSharedEntry(i) || root[i].present) {
+			continue;
+		}
+		// Sign extend the address into the higher half for entries from PML4_ENTRY_COUNT / 2 onwards
+		uint64_t virAddr = (uint64_t)i << 39;
+		if (i >= PML4_ENTRY_COUNT / 2) {
+			virAddr |= 0xffff000000000000;
+		}
+		CrawlResult crawlResult((void*)virAddr);
+		allocatePageTable(crawlResult, 3, virAddr, 0);
+	}
+	terminalPrintString(doneStr, strlen(doneStr));
+	terminalPrintChar('\n');
+
 	// Map physical memory buddy bitmap to kernel address space
 	terminalPrintSpaces4();
 	terminalPrintString(movingBuddiesStr, strlen(movingBuddiesStr));
@@ -154,6 +237,97 @@ bool Kernel::Memory::Virtual::initialize(
 	terminalPrintString(doneStr, strlen(doneStr));
 	terminalPrintChar('\n');
 
+	// Map the RAM of physical memory at DIRECT_MAP_ORIGIN write-back
+	// so that physical addresses can be accessed without creating new mappings
+	// 2MiB chunks entirely within RAM use large pages, the partial chunks at the edges of a range use 4KiB pages
+	// so that MMIO, reserved ranges and holes, such as the VGA memory in the first chunk, are never mapped
+	terminalPrintSpaces4();
+	terminalPrintString(directMapStr, strlen(directMapStr));
+	uint64_t directMapOrigin = DIRECT_MAP_ORIGIN;
+	terminalPrintHex(&directMapOrigin, sizeof(directMapOrigin));
+	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
+	ACPI::Entryv3 *mmap = (ACPI::Entryv3*)((uint64_t)(infoTable.mmapEntriesSegment << 4) + infoTable.mmapEntriesOffset);
+	size_t rangeCount = 0;
+	for (size_t i = 0; i < infoTable.mmapEntryCount; ++i) {
+		if (
+			mmap[i].length == 0 || (
+				mmap[i].regionType != ACPI::MemoryType::Usable &&
+				mmap[i].regionType != ACPI::MemoryType::Reclaimable &&
+				mmap[i].regionType != ACPI::MemoryType::ACPINVS
+			)
+		) {
+			continue;
+		}
+		if (rangeCount == DIRECT_MAP_MAX_RANGES) {
+			terminalPrintString(failedStr, strlen(failedStr));
+			terminalPrintChar('\n');
+			return false;
+		}
+		// Insertion sort by start since MMAP entries are not guaranteed to be sorted
+		DirectMapRange range = {
+			mmap[i].base & Physical::buddyMasks[0],
+			(mmap[i].base + mmap[i].length + pageSize - 1) & Physical::buddyMasks[0]
+		};
+		size_t j = rangeCount;
+		for (; j > 0 && directMapRanges[j - 1].start > range.start; --j) {
+			directMapRanges[j] = directMapRanges[j - 1];
+		}
+		directMapRanges[j] = range;
+		++rangeCount;
+	}
+	// Merge overlapping and adjacent ranges so that chunks spanning MMAP entries can still use large pages
+	size_t mergedCount = 0;
+	for (size_t i = 0; i < rangeCount; ++i) {
+		if (mergedCount != 0 && directMapRanges[i].start <= directMapRanges[mergedCount - 1].end) {
+			if (directMapRanges[i].end > directMapRanges[mergedCount - 1].end) {
+				directMapRanges[mergedCount - 1].end = directMapRanges[i].end;
+			}
+			continue;
+		}
+		directMapRanges[mergedCount] = directMapRanges[i];
+		++mergedCount;
+	}
+	// directMapSize stays 0 until the whole direct map is in place since mapPages refuses addresses within it
+	for (size_t i = 0; i < mergedCount; ++i) {
+		const uint64_t start = directMapRanges[i].start;
+		const uint64_t end = directMapRanges[i].end;
+		uint64_t largeStart = (start + MIB_2 - 1) & ~(MIB_2 - 1);
+		uint64_t largeEnd = end & ~(MIB_2 - 1);
+		if (largeStart >= largeEnd) {
+			largeStart = largeEnd = end;
+		}
+		if (
+			(start < largeStart && !mapPages(
+				(void*)(DIRECT_MAP_ORIGIN + start),
+				(void*)start,
+				(largeStart - start) / pageSize,
+				RequestType::Writable
+			)) ||
+			(largeStart < largeEnd && !mapLargePages(
+				(void*)(DIRECT_MAP_ORIGIN + largeStart),
+				(void*)largeStart,
+				(largeEnd - largeStart) / MIB_2,
+				RequestType::Writable
+			)) ||
+			(largeEnd < end && !mapPages(
+				(void*)(DIRECT_MAP_ORIGIN + largeEnd),
+				(void*)largeEnd,
+				(end - largeEnd) / pageSize,
+				RequestType::Writable
+			))
+		) {
+			terminalPrintString(failedStr, strlen(failedStr));
+			terminalPrintChar('\n');
+			return false;
+		}
+	}
+	if (mergedCount != 0) {
+		directMapSize = (directMapRanges[mergedCount - 1].end + MIB_2 - 1) & ~(MIB_2 - 1);
+	}
+	directMapRangeCount = mergedCount;
+	terminalPrintString(doneStr, strlen(doneStr));
+	terminalPrintChar('\n');
+
 	// Remove identity mapping for virtual addresses from 1MiB to L32_IDENTITY_MAP_SIZE MiBs,
 	// scratch memory from L32K64_SCRATCH_BASE of length L32K64_SCRATCH_LENGTH
 	terminalPrintSpaces4();
@@ -214,8 +388,11 @@ bool Kernel::Memory::Virtual::initialize(
 	// Used areas of virtual address space so far
 	// 1) 0x0 to L32K64_SCRATCH_BASE
 	// 2) (L32K64_SCRATCH_BASE + L32K64_SCRATCH_LENGTH) to 1MiB
-	// 3) PML4 recursive mapping
-	// 4) KERNEL_ORIGIN to usableKernelSpaceStart
+	// 3) Direct map of physical memory
+	// 4) PML4 recursive mapping
+	// 5) KERNEL_ORIGIN to usableKernelSpaceStart
+	// USER_SPACE_ORIGIN to the end of the lower half is also kept out of the general list
+	// since every user task maps its own pages there
 	terminalPrintSpaces4();
 	terminalPrintString(creatingListsStr, strlen(creatingListsStr));
 	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
@@ -242,29 +419,33 @@ bool Kernel::Memory::Virtual::initialize(
 	generalAddressSpaceList.at(2).available = false;
 	generalAddressSpaceList.at(2).base = (void*)(L32K64_SCRATCH_BASE + L32K64_SCRATCH_LENGTH);
 	generalAddressSpaceList.at(2).pageCount = (mib1 - L32K64_SCRATCH_BASE - L32K64_SCRATCH_LENGTH) / pageSize;
-	// General 1MiB to valid lower half canonical address available
+	// General 1MiB to USER_SPACE_ORIGIN available
 	generalAddressSpaceList.at(3).available = true;
 	generalAddressSpaceList.at(3).base = (void*) mib1;
-	generalAddressSpaceList.at(3).pageCount = (nonCanonicalStart - mib1) / pageSize;
+	generalAddressSpaceList.at(3).pageCount = (USER_SPACE_ORIGIN - mib1) / pageSize;
 	generalPagesAvailableCount += generalAddressSpaceList.at(3).pageCount;
-	// Mark non canonical address range as used
+	// User space used
 	generalAddressSpaceList.at(4).available = false;
-	generalAddressSpaceList.at(4).base = (void*) nonCanonicalStart;
-	generalAddressSpaceList.at(4).pageCount = (nonCanonicalEnd - nonCanonicalStart) / pageSize;
-	// General valid higher half canonical address to PML4 recursive map available
-	generalAddressSpaceList.at(5).available = true;
-	generalAddressSpaceList.at(5).base = (void*) nonCanonicalEnd;
-	generalAddressSpaceList.at(5).pageCount = (ptMask - nonCanonicalEnd) / pageSize;
-	generalPagesAvailableCount += generalAddressSpaceList.at(5).pageCount;
+	generalAddressSpaceList.at(4).base = (void*) USER_SPACE_ORIGIN;
+	generalAddressSpaceList.at(4).pageCount = (nonCanonicalStart - USER_SPACE_ORIGIN) / pageSize;
+	// Mark non canonical address range and the direct map right after it as used
+	generalAddressSpaceList.at(5).available = false;
+	generalAddressSpaceList.at(5).base = (void*) nonCanonicalStart;
+	generalAddressSpaceList.at(5).pageCount = (DIRECT_MAP_ORIGIN + directMapSize - nonCanonicalStart) / pageSize;
+	// General end of direct map to PML4 recursive map available
+	generalAddressSpaceList.at(6).available = true;
+	generalAddressSpaceList.at(6).base = (void*)(DIRECT_MAP_ORIGIN + directMapSize);
+	generalAddressSpaceList.at(6).pageCount = (ptMask - DIRECT_MAP_ORIGIN - directMapSize) / pageSize;
+	generalPagesAvailableCount += generalAddressSpaceList.at(6).pageCount;
 	// PML4 recursive map used
-	generalAddressSpaceList.at(6).available = false;
-	generalAddressSpaceList.at(6).base = (void*) ptMask;
-	generalAddressSpaceList.at(6).pageCount = ((uint64_t)512 * GIB_1) / pageSize;
+	generalAddressSpaceList.at(7).available = false;
+	generalAddressSpaceList.at(7).base = (void*) ptMask;
+	generalAddressSpaceList.at(7).pageCount = ((uint64_t)512 * GIB_1) / pageSize;
 	// General PML4 recursive map to KERNEL_ORIGIN available
-	generalAddressSpaceList.at(7).available = true;
-	generalAddressSpaceList.at(7).base = (void*)(ptMask + 512 * GIB_1);
-	generalAddressSpaceList.at(7).pageCount = ((uint64_t)KERNEL_ORIGIN - ptMask - 512 * GIB_1) / pageSize;
-	generalPagesAvailableCount += generalAddressSpaceList.at(7).pageCount;
+	generalAddressSpaceList.at(8).available = true;
+	generalAddressSpaceList.at(8).base = (void*)(ptMask + 512 * GIB_1);
+	generalAddressSpaceList.at(8).pageCount = ((uint64_t)KERNEL_ORIGIN - ptMask - 512 * GIB_1) / pageSize;
+	generalPagesAvailableCount += generalAddressSpaceList.at(8).pageCount;
 	terminalPrintString(doneStr, strlen(doneStr));
 	terminalPrintChar('\n');
 
@@ -276,53 +457,53 @@ bool Kernel::Memory::Virtual::initialize(
 // that is the closest fit to the number of requested pages
 // If RequestType::AllocatePhysical flag is passed,
 // the returned virtual addresses are mapped to newly allocated physical pages
+// which need not be physically contiguous unless RequestType::PhysicalContiguous is passed
+// The physical runs backing the region are appended to segments in virtual address order if it is not nullptr
 // When RequestType::CacheDisable flag is passed, the physical page is marked as cachedDisabled(1) in the PTE
 // Returns INVALID_ADDRESS and allocatedCount = 0 if request count is count == 0
 // or greater than currently available kernel pages
 // Unsafe to call this function until virtual memory manager is initialized
-Kernel::Memory::PageRequestResult Kernel::Memory::Virtual::requestPages(size_t count, uint32_t flags) {
+Kernel::Memory::PageRequestResult Kernel::Memory::Virtual::requestPages(
+	size_t count,
+	uint32_t flags,
+	PhysicalSegmentList *segments
+) {
 	PageRequestResult result;
-	if (count == 0 || count > ((flags & RequestType::Kernel) ? kernelPagesAvailableCount : generalPagesAvailableCount)) {
-		return result;
-	}
 	AddressSpaceList &list = (flags & RequestType::Kernel) ? kernelAddressSpaceList : generalAddressSpaceList;
 	if (flags & RequestType::VirtualContiguous) {
-		size_t bestFitIndex = SIZE_MAX;
-		for (size_t i = 0; const auto &block : list) {
-			if (
-				block.available &&
-				block.pageCount >= count &&
-				(bestFitIndex == SIZE_MAX || list.at(bestFitIndex).pageCount > block.pageCount)
-			) {
-				bestFitIndex = i;
-			}
-			++i;
-		}
-		list.at(bestFitIndex).available = false;
-		if (list.at(bestFitIndex).pageCount != count) {
-			list.insert(
-				list.begin() + bestFitIndex + 1,
-				{
-					.available = true,
-					.base = (void*)((uint64_t)list.at(bestFitIndex).base + count * pageSize),
-					.pageCount = list.at(bestFitIndex).pageCount - count
-				}
-			);
-			list.at(bestFitIndex).pageCount = count;
+		// The region belongs to this request once it is reserved, so it is backed and mapped without holding the lock
+		virtualLock.lock();
+		if (count == 0 || count > ((flags & RequestType::Kernel) ? kernelPagesAvailableCount : generalPagesAvailableCount)) {
+			virtualLock.unlock();
+			return result;
+		}
+		void *base = reserveAddressSpace(list, count);
+		if (base == INVALID_ADDRESS) {
+			virtualLock.unlock();
+			return result;
 		}
 		if (flags & RequestType::Kernel) {
 			kernelPagesAvailableCount -= count;
 		} else {
 			generalPagesAvailableCount -= count;
 		}
-		result.address = list.at(bestFitIndex).base;
+		result.address = base;
 		result.allocatedCount = count;
 		defragAddressSpaceList(flags);
+		virtualLock.unlock();
 
 		if (flags & RequestType::AllocatePhysical) {
 			size_t total = 0;
 			while (total != count) {
-				PageRequestResult phyResult = Physical::requestPages(count - total, flags);
+				// Physical pages that need not be contiguous are requested one buddy at a time
+				size_t phyCount = count - total;
+				if (
+					!(flags & RequestType::PhysicalContiguous) &&
+					phyCount > Physical::buddySizes[PHY_MEM_BUDDY_MAX_ORDER - 1]
+				) {
+					phyCount = Physical::buddySizes[PHY_MEM_BUDDY_MAX_ORDER - 1];
+				}
+				PageRequestResult phyResult = Physical::requestPages(phyCount, flags);
 				if (phyResult.address == INVALID_ADDRESS || phyResult.allocatedCount == 0) {
 					// Out of memory
 					// TODO: should swap out pages instead of panicking
@@ -331,6 +512,15 @@ Kernel::Memory::PageRequestResult Kernel::Memory::Virtual::requestPages(size_t c
 					terminalPrintString(outOfMemoryStr, strlen(outOfMemoryStr));
 					panic();
 				}
+				if (phyResult.allocatedCount > count - total) {
+					// A buddy bigger than the remaining count was served, give back the excess pages
+					Physical::markPages(
+						(void*)((uint64_t)phyResult.address + (count - total) * pageSize),
+						phyResult.allocatedCount - (count - total),
+						MarkPageType::Free
+					);
+					phyResult.allocatedCount = count - total;
+				}
 				if (!mapPages(
 					(void*)((uint64_t)result.address + total * pageSize),
 					phyResult.address,
@@ -342,6 +532,19 @@ Kernel::Memory::PageRequestResult Kernel::Memory::Virtual::requestPages(size_t c
 					terminalPrintString(mapFailStr, strlen(mapFailStr));
 					panic();
 				}
+				if (segments) {
+					if (
+						!segments->empty() &&
+						(uint64_t)segments->back().address + segments->back().pageCount * pageSize == (uint64_t)phyResult.address
+					) {
+						segments->back().pageCount += phyResult.allocatedCount;
+					} else {
+						segments->push_back({
+							.address = phyResult.address,
+							.pageCount = phyResult.allocatedCount
+						});
+					}
+				}
 				total += phyResult.allocatedCount;
 			}
 		}
@@ -371,59 +574,117 @@ bool Kernel::Memory::Virtual::freePages(void *virtualAddress, size_t count, uint
 		return false;
 	}
 
+	// The pages are unmapped while the region is still marked used so that nobody can reserve it meanwhile
 	AddressSpaceList &list = (flags & RequestType::Kernel) ? kernelAddressSpaceList : generalAddressSpaceList;
-	for (size_t i = 0; auto &block : list) {
-		uint64_t blockBeg = (uint64_t)block.base;
-		uint64_t blockEnd = blockBeg + block.pageCount * pageSize;
+	virtualLock.lock();
+	size_t i = findUsedBlock(list, vBeg, vEnd);
+	virtualLock.unlock();
+	if (i == SIZE_MAX) {
+		return true;
+	}
+	if (!unmapPages(virtualAddress, count, flags & RequestType::AllocatePhysical ? true : false)) {
+		terminalPrintString(virtualNamespaceStr, strlen(virtualNamespaceStr));
+		terminalPrintString(freePagesStr, strlen(freePagesStr));
+		terminalPrintString(mapFailStr, strlen(mapFailStr));
+		panic();
+	}
+
+	// Other regions may have come and gone while the lock was not held, hence the block is looked up again
+	virtualLock.lock();
+	i = findUsedBlock(list, vBeg, vEnd);
+	if (i == SIZE_MAX) {
+		virtualLock.unlock();
+		return true;
+	}
+	AddressSpaceNode &block = list.at(i);
+	const uint64_t blockBeg = (uint64_t)block.base;
+	const uint64_t blockEnd = blockBeg + block.pageCount * pageSize;
+	if (blockBeg == vBeg && blockEnd == vEnd) {
+		// Region to be freed fits exactly in current block
+		block.available = true;
+	} else {
+		block.pageCount = (vBeg - blockBeg) / pageSize;
+		list.insert(
+			list.begin() + i + 1,
+			{
+				.available = false,
+				.base = (void*)vEnd,
+				.pageCount = (blockEnd - vEnd) / pageSize
+			}
+		);
+		list.insert(
+			list.begin() + i + 1,
+			{
+				.available = true,
+				.base = (void*)vBeg,
+				.pageCount = count
+			}
+		);
+	}
+	if (flags & RequestType::Kernel) {
+		kernelPagesAvailableCount += count;
+	} else {
+		generalPagesAvailableCount += count;
+	}
+	defragAddressSpaceList(flags);
+	virtualLock.unlock();
+	return true;
+}
+
+// Returns the index of the block of list that contains [vBeg, vEnd) or SIZE_MAX if there is none
+// Panics if that block is available since the pages in it were never handed out
+// Must be called with virtualLock held
+static size_t findUsedBlock(const Kernel::Memory::Virtual::AddressSpaceList &list, uint64_t vBeg, uint64_t vEnd) {
+	for (size_t i = 0; const auto &block : list) {
+		const uint64_t blockBeg = (uint64_t)block.base;
+		const uint64_t blockEnd = blockBeg + block.pageCount * Kernel::Memory::pageSize;
 		if (blockBeg <= vBeg && blockEnd >= vEnd) {
 			if (block.available) {
 				// Tried to free an available block
 				terminalPrintString(virtualNamespaceStr, strlen(virtualNamespaceStr));
 				terminalPrintString(freePagesStr, strlen(freePagesStr));
 				terminalPrintString(freeErrorStr, strlen(freeErrorStr));
-				panic();
-				return false;
-			}
-			if (blockBeg == vBeg && blockEnd == vEnd) {
-				// Region to be freed fits exactly in current block
-				block.available = true;
-			} else {
-				list.insert(
-					list.begin() + i + 1,
-					{
-						.available = false,
-						.base = (void*)vEnd,
-						.pageCount = (blockEnd - vEnd) / pageSize
-					}
-				);
-				list.insert(
-					list.begin() + i + 1,
-					{
-						.available = true,
-						.base = (void*)vBeg,
-						.pageCount = count
-					}
-				);
-				block.pageCount = (vBeg - blockBeg) / pageSize;
+				Kernel::panic();
 			}
-			if (flags & RequestType::Kernel) {
-				kernelPagesAvailableCount += count;
-			} else {
-				generalPagesAvailableCount += count;
-			}
-			defragAddressSpaceList(flags);
+			return i;
+		}
+		++i;
+	}
+	return SIZE_MAX;
+}
 
-			if (!unmapPages(virtualAddress, count, flags & RequestType::AllocatePhysical ? true : false)) {
-				terminalPrintString(virtualNamespaceStr, strlen(virtualNamespaceStr));
-				terminalPrintString(freePagesStr, strlen(freePagesStr));
-				terminalPrintString(mapFailStr, strlen(mapFailStr));
-				panic();
-			}
-			return true;
+// Marks the available region of list that is the closest fit to count pages as used
+// Returns the base of the region or INVALID_ADDRESS if no available region is large enough
+// Does not update the page counts of the kernel and general lists, requestPages does that
+// The caller serializes access to list, requestPages holds virtualLock for the kernel and general lists
+void* Kernel::Memory::Virtual::reserveAddressSpace(AddressSpaceList &list, size_t count) {
+	size_t bestFitIndex = SIZE_MAX;
+	for (size_t i = 0; const auto &block : list) {
+		if (
+			block.available &&
+			block.pageCount >= count &&
+			(bestFitIndex == SIZE_MAX || list.at(bestFitIndex).pageCount > block.pageCount)
+		) {
+			bestFitIndex = i;
 		}
 		++i;
 	}
-	return true;
+	if (count == 0 || bestFitIndex == SIZE_MAX) {
+		return INVALID_ADDRESS;
+	}
+	list.at(bestFitIndex).available = false;
+	if (list.at(bestFitIndex).pageCount != count) {
+		list.insert(
+			list.begin() + bestFitIndex + 1,
+			{
+				.available = true,
+				.base = (void*)((uint64_t)list.at(bestFitIndex).base + count * pageSize),
+				.pageCount = list.at(bestFitIndex).pageCount - count
+			}
+		);
+		list.at(bestFitIndex).pageCount = count;
+	}
+	return list.at(bestFitIndex).base;
 }
 
 static void defragAddressSpaceList(uint32_t flags) {
@@ -484,80 +745,208 @@ static void defragAddressSpaceList(uint32_t flags) {
 // Maps virtual pages to physical pages
 // It is assumed that all virtual pages and physical pages are contiguous, reserved, pageSize boundary aligned
 // and within bounds of physical memory and canonical virtual address space before calling this function
-// When MEMORY_REQUEST_CACHE_DISABLE flag is passed, the physical page is marked as cachedDisabled(1) in the PTE
+// The memory type is write-back unless one of RequestType::CacheDisable (uncached),
+// RequestType::UncachedMinus, RequestType::WriteThrough, or RequestType::WriteCombining is passed
 // Returns true only on successful mapping
 bool Kernel::Memory::Virtual::mapPages(void* virtualAddress, void* physicalAddress, size_t count, uint32_t flags) {
 	uint64_t phyAddr = (uint64_t)physicalAddress;
 	uint64_t virAddr = (uint64_t)virtualAddress;
 
 	// Ensure both physical and virtual address are pageSize boundary aligned
-	if (count == 0 || phyAddr & ~Physical::buddyMasks[0] || virAddr & ~Physical::buddyMasks[0]) {
+	// and the virtual addresses do not fall in the direct map
+	if (
+		count == 0 ||
+		phyAddr & ~Physical::buddyMasks[0] ||
+		virAddr & ~Physical::buddyMasks[0] ||
+		(virAddr + count * pageSize > DIRECT_MAP_ORIGIN && virAddr < DIRECT_MAP_ORIGIN + directMapSize)
+	) {
 		return false;
 	}
 
-	PageRequestResult requestResult;
+	bool mapped = true;
+	virtualLock.lock();
 	for (size_t i = 0; i < count; ++i, phyAddr += pageSize, virAddr += pageSize) {
 		CrawlResult crawlResult((void*)virAddr);
-		if (!crawlResult.isCanonical) {
-			return false;
+		// A 2MiB page of the kernel image has no page table to map the address in
+		if (!crawlResult.isCanonical || crawlResult.tables[1] == INVALID_ADDRESS) {
+			mapped = false;
+			break;
 		}
 		for (size_t j = 3; j >= 1; --j) {
 			if (crawlResult.physicalTables[j] == INVALID_ADDRESS) {
-				// Create a new page table if entry is not present
-				requestResult = Physical::requestPages(1, RequestType::PhysicalContiguous);
-				if (requestResult.address == INVALID_ADDRESS || requestResult.allocatedCount != 1) {
-					// TODO: should swap out a physical page instead of panicking
-					terminalPrintString(entryCreationFailed, strlen(entryCreationFailed));
-					terminalPrintDecimal(j);
-					terminalPrintString(forAddress, strlen(forAddress));
-					terminalPrintHex(&virAddr, sizeof(virAddr));
-					terminalPrintChar('\n');
-					terminalPrintString(virtualNamespaceStr, strlen(virtualNamespaceStr));
-					terminalPrintString(mapPagesStr, strlen(mapPagesStr));
-					terminalPrintString(outOfMemoryStr, strlen(outOfMemoryStr));
-					panic();
-				}
-				crawlResult.tables[j + 1][crawlResult.indexes[j + 1]].present = 1;
-				crawlResult.tables[j + 1][crawlResult.indexes[j + 1]].writable = 1;
-				crawlResult.tables[j + 1][crawlResult.indexes[j + 1]].physicalAddress = (uint64_t)requestResult.address >> pageSizeShift;
-				memset(crawlResult.tables[j], 0, pageSize);
+				allocatePageTable(crawlResult, j, virAddr, flags);
 			}
 		}
 		if (crawlResult.physicalTables[0] == INVALID_ADDRESS) {
 			crawlResult.tables[1][crawlResult.indexes[1]].present = 1;
 			crawlResult.tables[1][crawlResult.indexes[1]].physicalAddress = phyAddr >> pageSizeShift;
-			crawlResult.tables[1][crawlResult.indexes[1]].cacheDisable = (flags & RequestType::CacheDisable) ? 1 : 0;
+			setMemoryType(crawlResult.tables[1][crawlResult.indexes[1]], flags, false);
 			crawlResult.tables[1][crawlResult.indexes[1]].writable = (flags & RequestType::Writable) ? 1 : 0;
+			crawlResult.tables[1][crawlResult.indexes[1]].userAccess = (flags & RequestType::User) ? 1 : 0;
 			crawlResult.tables[1][crawlResult.indexes[1]].executeDisable = (flags & RequestType::Executable) ? 0 : 1;
 		}
 	}
+	virtualLock.unlock();
+	return mapped;
+}
+
+// Programs the page attribute table of the current CPU
+// Every CPU must call this before using mappings with RequestType::WriteCombining
+void Kernel::Memory::Virtual::loadPat() {
+	writeMsr(MSR::pageAttributeTable, patValue);
+}
+
+// Maps 2MiB virtual pages to 2MiB physical pages using page directory entries with the large page bit set
+// It is assumed that the virtual pages are not already mapped
+// Returns true only on successful mapping
+static bool mapLargePages(void *virtualAddress, void *physicalAddress, size_t count, uint32_t flags) {
+	using namespace Kernel::Memory;
+
+	uint64_t phyAddr = (uint64_t)physicalAddress;
+	uint64_t virAddr = (uint64_t)virtualAddress;
+
+	// Ensure both physical and virtual address are 2MiB boundary aligned
+	if (count == 0 || phyAddr & (MIB_2 - 1) || virAddr & (MIB_2 - 1)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < count; ++i, phyAddr += MIB_2, virAddr += MIB_2) {
+		Virtual::CrawlResult crawlResult((void*)virAddr);
+		if (!crawlResult.isCanonical || crawlResult.physicalTables[1] != INVALID_ADDRESS) {
+			return false;
+		}
+		for (size_t j = 3; j >= 2; --j) {
+			if (crawlResult.physicalTables[j] == INVALID_ADDRESS) {
+				allocatePageTable(crawlResult, j, virAddr, flags);
+			}
+		}
+		PDE &entry = crawlResult.tables[2][crawlResult.indexes[2]];
+		entry.present = 1;
+		entry.largePage = 1;
+		entry.physicalAddress = phyAddr >> pageSizeShift;
+		setMemoryType(entry, flags, true);
+		entry.writable = (flags & RequestType::Writable) ? 1 : 0;
+		entry.executeDisable = (flags & RequestType::Executable) ? 0 : 1;
+	}
 	return true;
 }
 
+// Selects the PAT entry for the memory type requested in flags, see patValue for the entries
+// The PAT bit is bit 7 of a PTE but bit 12 of a PDE mapping a 2MiB page
+static void setMemoryType(PML4E &entry, uint32_t flags, bool largePage) {
+	using namespace Kernel::Memory;
+
+	bool pat = false;
+	entry.pageWriteThrough = entry.cacheDisable = 0;
+	if (flags & RequestType::CacheDisable) {
+		entry.pageWriteThrough = entry.cacheDisable = 1;
+	} else if (flags & RequestType::UncachedMinus) {
+		entry.cacheDisable = 1;
+	} else if (flags & RequestType::WriteThrough) {
+		entry.pageWriteThrough = 1;
+	} else if (flags & RequestType::WriteCombining) {
+		pat = true;
+	}
+	if (largePage) {
+		entry.physicalAddress = (entry.physicalAddress & ~(uint64_t)1) | (pat ? 1 : 0);
+	} else {
+		entry.largePage = pat ? 1 : 0;
+	}
+}
+
+// Creates a new zeroed page table at given level for a crawled virtual address
+// and links it in the upper level page table
+// The link is accessible from ring 3 if RequestType::User is passed
+// The recursive mapping of the new table is flushed since this CPU may still cache a table released from the same slot
+// Must be called with virtualLock held
+static void allocatePageTable(
+	Kernel::Memory::Virtual::CrawlResult &crawlResult,
+	size_t level,
+	uint64_t virAddr,
+	uint32_t flags
+) {
+	using namespace Kernel::Memory;
+	using namespace Kernel::Memory::Virtual;
+
+	// Take an already zeroed page from this CPU's pool
+	// Fall back to the physical memory manager if the pool is empty or CPUs are not set up yet
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	if (cpu && cpu->pageTablePool.count) {
+		PageTablePool &pool = cpu->pageTablePool;
+		--pool.count;
+		crawlResult.tables[level + 1][crawlResult.indexes[level + 1]].present = 1;
+		crawlResult.tables[level + 1][crawlResult.indexes[level + 1]].writable = 1;
+		crawlResult.tables[level + 1][crawlResult.indexes[level + 1]].userAccess = (flags & RequestType::User) ? 1 : 0;
+		crawlResult.tables[level + 1][crawlResult.indexes[level + 1]].physicalAddress = (uint64_t)pool.pages[pool.count] >> pageSizeShift;
+		Kernel::flushTLBEntry(crawlResult.tables[level]);
+		return;
+	}
+	PageRequestResult requestResult = Physical::requestPages(1, 0);
+	if (requestResult.address == INVALID_ADDRESS || requestResult.allocatedCount != 1) {
+		// TODO: should swap out a physical page instead of panicking
+		terminalPrintString(entryCreationFailed, strlen(entryCreationFailed));
+		terminalPrintDecimal(level);
+		terminalPrintString(forAddress, strlen(forAddress));
+		terminalPrintHex(&virAddr, sizeof(virAddr));
+		terminalPrintChar('\n');
+		terminalPrintString(virtualNamespaceStr, strlen(virtualNamespaceStr));
+		terminalPrintString(mapPagesStr, strlen(mapPagesStr));
+		terminalPrintString(outOfMemoryStr, strlen(outOfMemoryStr));
+		Kernel::panic();
+	}
+	crawlResult.tables[level + 1][crawlResult.indexes[level + 1]].present = 1;
+	crawlResult.tables[level + 1][crawlResult.indexes[level + 1]].writable = 1;
+	crawlResult.tables[level + 1][crawlResult.indexes[level + 1]].userAccess = (flags & RequestType::User) ? 1 : 0;
+	crawlResult.tables[level + 1][crawlResult.indexes[level + 1]].physicalAddress = (uint64_t)requestResult.address >> pageSizeShift;
+	Kernel::flushTLBEntry(crawlResult.tables[level]);
+	memset(crawlResult.tables[level], 0, pageSize);
+}
+
 // Unmaps the page table entries for given count starting from virtualAddress
 // It is assumed all the virtual addresses are canonical, freed, and pageSize boundary aligned
 // If a virtual address is fully resolved,
 // the corresponding physical page is also freed if freePhysicalPage == true
 // If all the entries in a page table are absent,
-// the page table is also freed and marked absent in upper level page table
+// the page table is marked absent in upper level page table and returned to the page table pool
+// Freed physical pages and page tables are only reused after every CPU has flushed its TLB, see reclaimUnmapped
+// Must be called without virtualLock held
 bool Kernel::Memory::Virtual::unmapPages(void* virtualAddress, size_t count, bool freePhysicalPage) {
 	uint64_t addr = (uint64_t) virtualAddress;
 
 	// Ensure the virtual addresses are pageSize boundary aligned
-	if (count == 0 || addr & ~Physical::buddyMasks[0]) {
+	// and do not fall in the direct map
+	if (
+		count == 0 ||
+		addr & ~Physical::buddyMasks[0] ||
+		(addr + count * pageSize > DIRECT_MAP_ORIGIN && addr < DIRECT_MAP_ORIGIN + directMapSize)
+	) {
 		return false;
 	}
 
+	bool unmapped = true;
+	UnmapBatch batch;
+	virtualLock.lock();
 	for (size_t i = 0; i < count; ++i, addr += pageSize) {
+		// An address releases at most its physical page and three page tables
+		if (batch.pageCount == UNMAP_BATCH_SIZE || batch.tableCount + 3 > UNMAP_BATCH_SIZE) {
+			virtualLock.unlock();
+			reclaimUnmapped(batch);
+			virtualLock.lock();
+		}
 		CrawlResult crawlResult((void*) addr);
-		if (!crawlResult.isCanonical) {
-			return false;
+		// A 2MiB page of the kernel image has no page table to unmap the address from
+		if (!crawlResult.isCanonical || crawlResult.tables[1] == INVALID_ADDRESS) {
+			unmapped = false;
+			break;
 		}
 		if (crawlResult.physicalTables[0] != INVALID_ADDRESS) {
 			// Virtual address is fully resolved
 			crawlResult.tables[1][crawlResult.indexes[1]].present = 0;
+			flushTLBEntry((void*)addr);
+			batch.unmapped = true;
 			if (freePhysicalPage) {
-				Physical::markPages(crawlResult.physicalTables[0], 1, MarkPageType::Free);
+				batch.pages[batch.pageCount] = crawlResult.physicalTables[0];
+				++batch.pageCount;
 			}
 		}
 		for (size_t j = 1; j <= 3; ++j) {
@@ -574,13 +963,196 @@ bool Kernel::Memory::Virtual::unmapPages(void* virtualAddress, size_t count, boo
 					break;
 				}
 			}
-			if (freePageTable) {
-				crawlResult.tables[j + 1][crawlResult.indexes[j + 1]].present = 0;
-				Physical::markPages((void*)crawlResult.physicalTables[j], 1, MarkPageType::Free);
+			// Page directory pointer tables shared with user tasks stay linked, read createAddressSpace comments
+			if (freePageTable && !(j == 3 && isSharedEntry(crawlResult.indexes[4]))) {
+				releasePageTable(crawlResult, j, batch);
 			}
 		}
 	}
-	return true;
+	virtualLock.unlock();
+	reclaimUnmapped(batch);
+	return unmapped;
+}
+
+// Unlinks an empty page table at given level of a crawled virtual address from the upper level page table
+// The page table is zeroed and added to the batch, this CPU's cached translations through it are flushed
+// Must be called with virtualLock held
+static void releasePageTable(Kernel::Memory::Virtual::CrawlResult &crawlResult, size_t level, UnmapBatch &batch) {
+	using namespace Kernel::Memory;
+
+	// Zero the table through the recursive mapping before it gets unlinked
+	memset(crawlResult.tables[level], 0, pageSize);
+	crawlResult.tables[level + 1][crawlResult.indexes[level + 1]].present = 0;
+	// Also flushes the paging-structure caches that still point at the table
+	Kernel::flushTLBEntry(crawlResult.tables[level]);
+	batch.tables[batch.tableCount] = crawlResult.physicalTables[level];
+	++batch.tableCount;
+	batch.unmapped = true;
+}
+
+// Makes every other CPU flush its TLB once all of them can no longer reach what the batch holds
+// then puts the page tables in this CPU's pool while there is room and frees everything else
+// Must be called without virtualLock held, see shootdownTlbs
+static void reclaimUnmapped(UnmapBatch &batch) {
+	using namespace Kernel::Memory;
+
+	if (!batch.unmapped) {
+		return;
+	}
+	shootdownTlbs();
+	virtualLock.lock();
+	APIC::CPU *cpu = APIC::getCurrentCpu();
+	for (size_t i = 0; i < batch.tableCount; ++i) {
+		if (cpu && cpu->pageTablePool.count < PAGE_TABLE_POOL_SIZE) {
+			cpu->pageTablePool.pages[cpu->pageTablePool.count] = batch.tables[i];
+			++cpu->pageTablePool.count;
+		} else {
+			Physical::markPages(batch.tables[i], 1, MarkPageType::Free);
+		}
+	}
+	virtualLock.unlock();
+	for (size_t i = 0; i < batch.pageCount; ++i) {
+		Physical::markPages(batch.pages[i], 1, MarkPageType::Free);
+	}
+	batch.pageCount = batch.tableCount = 0;
+	batch.unmapped = false;
+}
+
+// Fills this CPU's page table pool with zeroed physical pages
+// Meant to be called when the CPU is otherwise idle so that mapPages rarely has to request pages itself
+// Must only be called from thread context, never from an interrupt handler
+// Pages are requested under the physical memory manager's lock and zeroed without holding any lock,
+// only adding them to the pool, which mapPages and unmapPages also use, is done with virtualLock held
+void Kernel::Memory::Virtual::refillPageTablePool() {
+	if (!APIC::getCurrentCpu()) {
+		return;
+	}
+	while (true) {
+		virtualLock.lock();
+		const bool full = APIC::getCurrentCpu()->pageTablePool.count >= PAGE_TABLE_POOL_SIZE;
+		virtualLock.unlock();
+		if (full) {
+			return;
+		}
+		PageRequestResult requestResult = Physical::requestPages(1, 0);
+		if (requestResult.address == INVALID_ADDRESS || requestResult.allocatedCount != 1) {
+			return;
+		}
+		void *page = physToVirt(requestResult.address);
+		if (page == INVALID_ADDRESS) {
+			Physical::markPages(requestResult.address, 1, MarkPageType::Free);
+			return;
+		}
+		memset(page, 0, pageSize);
+		virtualLock.lock();
+		// unmapPages may have released page tables into the pool meanwhile
+		PageTablePool &pool = APIC::getCurrentCpu()->pageTablePool;
+		const bool added = pool.count < PAGE_TABLE_POOL_SIZE;
+		if (added) {
+			pool.pages[pool.count] = requestResult.address;
+			++pool.count;
+		}
+		virtualLock.unlock();
+		if (!added) {
+			Physical::markPages(requestResult.address, 1, MarkPageType::Free);
+			return;
+		}
+	}
+}
+
+// Installs the handler of the IPI that makes a CPU flush its TLB, see shootdownTlbs
+// Must be called after IDT::setup and before other CPUs are started
+bool Kernel::Memory::Virtual::initializeTlbShootdown() {
+	tlbShootdownVector = IDT::allocateVector(tlbShootdownHandler, nullptr);
+	return tlbShootdownVector != 0;
+}
+
+// Creates a PML4 for a user task and returns its physical address
+// The kernel's entries are shared, the entries from USER_SPACE_ORIGIN to the end of the lower half start empty
+// The shared entries point to page directory pointer tables allocated by initialize that are never released,
+// so copying them once keeps the task's view of kernel space in step with the kernel's
+// Returns INVALID_ADDRESS if no physical page is available
+void* Kernel::Memory::Virtual::createAddressSpace() {
+	PageRequestResult requestResult = Physical::requestPages(1, 0);
+	if (requestResult.address == INVALID_ADDRESS || requestResult.allocatedCount != 1) {
+		return INVALID_ADDRESS;
+	}
+	PML4E *root = (PML4E*)physToVirt(requestResult.address);
+	if (root == INVALID_ADDRESS) {
+		Physical::markPages(requestResult.address, 1, MarkPageType::Free);
+		return INVALID_ADDRESS;
+	}
+	memset(root, 0, pageSize);
+	const PML4E *kernelRoot = (PML4E*)physToVirt(getKernelAddressSpace());
+	for (size_t i = 0; i < PML4_ENTRY_COUNT; ++i) {
+		if (isSharedEntry(i)) {
+			root[i] = kernelRoot[i];
+		}
+	}
+	root[pml4tRecursiveEntry].present = root[pml4tRecursiveEntry].writable = root[pml4tRecursiveEntry].executeDisable = 1;
+	root[pml4tRecursiveEntry].physicalAddress = (uint64_t)requestResult.address >> pageSizeShift;
+	return requestResult.address;
+}
+
+// Frees all user pages, their page tables, and the PML4 of an address space made by createAddressSpace
+// The address space must not be active on any CPU
+void Kernel::Memory::Virtual::destroyAddressSpace(void *pml4Physical) {
+	PML4E *root = (PML4E*)physToVirt(pml4Physical);
+	for (size_t i = pml4tUserStartEntry; i < pml4tUserEndEntry; ++i) {
+		if (root[i].present) {
+			freeUserPageTable((uint64_t)root[i].physicalAddress << pageSizeShift, 3);
+		}
+	}
+	Physical::markPages(pml4Physical, 1, MarkPageType::Free);
+}
+
+// Returns the physical address of the kernel's PML4
+void* Kernel::Memory::Virtual::getKernelAddressSpace() {
+	return (void*)infoTable.pml4tPhysicalAddress;
+}
+
+// Makes the address space with given PML4 active on the CPU executing this function
+// Must be called with interrupts disabled
+// Returns the physical address of the previously active PML4
+void* Kernel::Memory::Virtual::switchAddressSpace(void *pml4Physical) {
+	void *previous = (void*)((uint64_t)pml4t[pml4tRecursiveEntry].physicalAddress << pageSizeShift);
+	if (previous != pml4Physical) {
+		flushTLB(pml4Physical);
+	}
+	return previous;
+}
+
+// Returns true only if the physical address lies in RAM mapped by the direct map
+static bool isDirectMapped(uint64_t physicalAddress) {
+	for (size_t i = 0; i < directMapRangeCount && physicalAddress >= directMapRanges[i].start; ++i) {
+		if (physicalAddress < directMapRanges[i].end) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns the direct map alias of a physical address
+// Returns INVALID_ADDRESS if the physical address does not lie in RAM, which is all the direct map covers
+void* Kernel::Memory::Virtual::physToVirt(void *physicalAddress) {
+	uint64_t addr = (uint64_t)physicalAddress;
+	if (!isDirectMapped(addr)) {
+		return INVALID_ADDRESS;
+	}
+	return (void*)(DIRECT_MAP_ORIGIN + addr);
+}
+
+// Returns the physical address of a direct map or kernel image virtual address without crawling the page tables
+// Returns INVALID_ADDRESS for any other virtual address, use CrawlResult for those
+void* Kernel::Memory::Virtual::virtToPhys(void *virtualAddress) {
+	uint64_t addr = (uint64_t)virtualAddress;
+	if (addr >= DIRECT_MAP_ORIGIN && addr < DIRECT_MAP_ORIGIN + directMapSize) {
+		return isDirectMapped(addr - DIRECT_MAP_ORIGIN) ? (void*)(addr - DIRECT_MAP_ORIGIN) : INVALID_ADDRESS;
+	}
+	if (addr >= KERNEL_ORIGIN && addr < kernelImageEnd) {
+		return (void*)(addr - KERNEL_ORIGIN + infoTable.kernelPhyMemBase);
+	}
+	return INVALID_ADDRESS;
 }
 
 // Returns true only if virtual address is canonical i.e. lies in the range
@@ -602,6 +1174,8 @@ bool Kernel::Memory::Virtual::isCanonical(void* address) {
 // Address of a level and subsequent lower levels are set to INVALID_ADDRESS in physicalTables
 // if mapping while crawling the PML4 structure is not present for that level
 // If an address is not canonical all levels in physicalTables are set to INVALID_ADDRESS
+// If an address is mapped by a 2MiB page, physicalTables[0] is resolved from the page directory entry
+// and tables[1] is set to INVALID_ADDRESS
 Kernel::Memory::Virtual::CrawlResult::CrawlResult(void *virtualAddress) {
 	this->isCanonical = false;
 	uint64_t addr = (uint64_t)virtualAddress & Physical::buddyMasks[0];
@@ -655,6 +1229,18 @@ Kernel::Memory::Virtual::CrawlResult::CrawlResult(void *virtualAddress) {
 				this->cached[i - 1] = (this->tables[i][this->indexes[i]].cacheDisable & 1) ? false : true;
 				this->writable[i - 1] = (this->tables[i][this->indexes[i]].writable & 1) ? true : false;
 				this->executable[i - 1] = (this->tables[i][this->indexes[i]].executeDisable & 1) ? false : true;
+				if (i == 2 && this->tables[i][this->indexes[i]].largePage) {
+					// 2MiB page, the physical page is resolved directly from the page directory entry
+					// and there is no page table to point to
+					// Bit 12 of such an entry is the PAT bit and not part of the address, read setMemoryType comments
+					this->physicalTables[1] = (PML4E*)((uint64_t)this->physicalTables[1] & ~((uint64_t)1 << pageSizeShift));
+					this->physicalTables[0] = (PML4E*)((uint64_t)this->physicalTables[1] + this->indexes[1] * KIB_4);
+					this->tables[1] = (PML4E*)INVALID_ADDRESS;
+					this->cached[0] = this->cached[1];
+					this->writable[0] = this->writable[1];
+					this->executable[0] = this->executable[1];
+					break;
+				}
 			} else {
 				break;
 			}
@@ -717,3 +1303,86 @@ void Kernel::Memory::Virtual::showAddressSpaceList(bool kernelList) {
 		terminalPrintChar('\n');
 	}
 }
+
+// Frees the pages a user page table at given level maps, then the table itself
+static void freeUserPageTable(uint64_t tablePhysical, size_t level) {
+	using namespace Kernel::Memory;
+
+	PML4E *table = (PML4E*)Virtual::physToVirt((void*)tablePhysical);
+	for (size_t i = 0; i < PML4_ENTRY_COUNT; ++i) {
+		if (!table[i].present) {
+			continue;
+		}
+		const uint64_t entryPhysical = (uint64_t)table[i].physicalAddress << pageSizeShift;
+		if (level == 1) {
+			Physical::markPages((void*)entryPhysical, 1, MarkPageType::Free);
+		} else {
+			freeUserPageTable(entryPhysical, level - 1);
+		}
+	}
+	Physical::markPages((void*)tablePhysical, 1, MarkPageType::Free);
+}
+
+// Returns true for the PML4 entries user tasks share with the kernel, which are all but the user space ones
+// and the recursive entry
+static bool isSharedEntry(size_t pml4Index) {
+	return (
+		(pml4Index < pml4tUserStartEntry || pml4Index >= pml4tUserEndEntry) &&
+		pml4Index != pml4tRecursiveEntry
+	);
+}
+
+// Flushes the TLB of the CPU executing this function if other CPUs requested it since its latest flush
+static void flushRequestedTlb(APIC::CPU *cpu) {
+	const uint64_t requests = std::atomic_ref(cpu->tlbFlushRequests).load(std::memory_order_acquire);
+	std::atomic_ref done(cpu->tlbFlushesDone);
+	uint64_t flushed = done.load(std::memory_order_relaxed);
+	if (flushed >= requests) {
+		return;
+	}
+	Kernel::flushCurrentTLB();
+	// The interrupt handler may have recorded a later flush meanwhile, never move backwards
+	while (flushed < requests && !done.compare_exchange_weak(flushed, requests, std::memory_order_release)) {}
+}
+
+// Makes every other online CPU flush its TLB and paging-structure caches and waits until all of them have
+// Must be called without virtualLock held, a CPU spinning on it with interrupts disabled could never take the IPI
+// Requests of other CPUs are served while waiting so that CPUs shooting down at the same time do not wait on each other
+static void shootdownTlbs() {
+	APIC::CPU *self = APIC::getCurrentCpu();
+	if (!self || !tlbShootdownVector) {
+		// No other CPU is started before the shootdown vector is installed
+		return;
+	}
+	bool requested = false;
+	for (auto &cpu : APIC::cpus) {
+		if (&cpu == self || !std::atomic_ref(cpu.online).load()) {
+			continue;
+		}
+		// The locked increment also orders the cleared entries before the IPI
+		std::atomic_ref(cpu.tlbFlushRequests).fetch_add(1);
+		APIC::sendIpi(cpu, tlbShootdownVector);
+		requested = true;
+	}
+	if (!requested) {
+		return;
+	}
+	for (auto &cpu : APIC::cpus) {
+		if (&cpu == self || !std::atomic_ref(cpu.online).load()) {
+			continue;
+		}
+		// Requests other CPUs make meanwhile are waited for as well, which only takes a little longer
+		while (
+			std::atomic_ref(cpu.tlbFlushesDone).load(std::memory_order_acquire) <
+			std::atomic_ref(cpu.tlbFlushRequests).load(std::memory_order_relaxed)
+		) {
+			flushRequestedTlb(self);
+			__builtin_ia32_pause();
+		}
+	}
+}
+
+static void tlbShootdownHandler(void*, Kernel::Threads::InterruptFrame*) {
+	APIC::acknowledgeLocalInterrupt();
+	flushRequestedTlb(APIC::getCurrentCpu());
+}
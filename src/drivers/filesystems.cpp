@@ -34,19 +34,30 @@ Async::Thenable<Drivers::FS::Status> Drivers::FS::readFile(
 		co_return Status::OutOfBounds;
 	}
 
-	// // FIXME: should lock FD/node/buffers
-	// std::vector<std::reference_wrapper<FileBuffer>> affectedBuffers;
-	// auto lambda = [](){};
+	const std::shared_ptr<Node> &node = file->node;
+	co_await node->lock.lockShared();
+	if (!node->fileBuffers.empty()) {
+		memcpy(readBuffer, (char*)node->fileBuffers.at(0).buffer.getData() + offset, count);
+		node->lock.unlockShared();
+		co_return Status::Ok;
+	}
+	node->lock.unlockShared();
 
-	// TODO: Read the entire file for now
-	// Once device locking is implemented and mutexes are added to scheduler
-	// and other crucial places, change this to read only required sectors
-	file->node->fileBuffers.push_back({
-		.base = 0,
-		.isBusy = false,
-		.buffer = std::move(co_await file->node->fs->readFile(file->node, 0, file->node->size))
-	});
-	memcpy(readBuffer, (char*)file->node->fileBuffers.at(0).buffer.getData() + offset, count);
+	// TODO: Read the entire file for now, change this to read only required sectors
+	co_await node->lock.lock();
+	if (node->fileBuffers.empty()) {
+		Storage::Buffer buffer = std::move(co_await node->fs->readFile(node, 0, node->size));
+		if (!buffer) {
+			node->lock.unlock();
+			co_return Status::IOError;
+		}
+		node->fileBuffers.push_back({
+			.base = 0,
+			.buffer = std::move(buffer)
+		});
+	}
+	memcpy(readBuffer, (char*)node->fileBuffers.at(0).buffer.getData() + offset, count);
+	node->lock.unlock();
 	co_return Status::Ok;
 }
 
@@ -71,7 +71,10 @@ Async::Thenable<Drivers::FS::Status> Drivers::FS::JolietISO::readDirectory(const
 	if (!node || !(node->type & NodeType::Directory)) {
 		co_return Status::NotDirectory;
 	}
+	co_await node->lock.lock();
 	if (node->childrenCreated) {
+		// Another coroutine read the directory while this one waited for the lock
+		node->lock.unlock();
 		co_return Status::Ok;
 	}
 	size_t blockCount = node->size / this->deviceBlockSize;
@@ -109,8 +112,10 @@ Async::Thenable<Drivers::FS::Status> Drivers::FS::JolietISO::readDirectory(const
 			delete[] fileName;
 		}
 		node->childrenCreated = true;
+		node->lock.unlock();
 		co_return Status::Ok;
 	} else {
+		node->lock.unlock();
 		co_return Status::IOError;
 	}
 }
@@ -27,6 +27,7 @@ static bool scrollToggleDone = false;
 static bool shiftLeft = false;
 static bool shiftRight = false;
 static bool irqInstalled = false;
+static APIC::InterruptRoute irqRoute;
 static uint64_t scanCodeBuffer = 0;
 
 static void updateLedState();
@@ -91,18 +92,14 @@ bool Drivers::PS2::Keyboard::initialize(uint32_t apicId) {
 		return false;
 	}
 
-	// Install the IRQ handler
-	APIC::IORedirectionEntry keyEntry = APIC::readIoRedirectionEntry(Kernel::IRQ::Keyboard);
-	Kernel::IDT::installEntry(Kernel::IDT::availableInterrupt, &ps2KeyboardHandlerWrapper, 2);
-	keyEntry.vector = Kernel::IDT::availableInterrupt;
-	keyEntry.deliveryMode = 0;
-	keyEntry.destinationMode = 0;
-	keyEntry.pinPolarity = 0;
-	keyEntry.triggerMode = 0;
-	keyEntry.mask = 0;
-	keyEntry.destination = apicId;
-	writeIoRedirectionEntry(Kernel::IRQ::Keyboard, keyEntry);
-	++Kernel::IDT::availableInterrupt;
+	// Install the IRQ handler, it prints so it needs the SSE registers saved
+	const uint8_t vector = Kernel::IDT::allocateVector(ps2KeyboardHandler, nullptr, true);
+	if (!APIC::routeIrq(irqRoute, Kernel::IRQ::Keyboard, vector, APIC::findCpu(apicId))) {
+		Kernel::IDT::freeVector(vector);
+		terminalPrintString(failedStr, strlen(failedStr));
+		terminalPrintChar('\n');
+		return false;
+	}
 	irqInstalled = true;
 	Kernel::IDT::enableInterrupts();
 
@@ -151,7 +148,7 @@ static void updateLedState() {
 	}
 }
 
-void ps2KeyboardHandler() {
+void ps2KeyboardHandler(void*, Kernel::Threads::InterruptFrame*) {
 	using namespace Drivers::PS2::Keyboard;
 
 	const auto byte = IO::inputByte(Drivers::PS2::Controller::dataPort);
@@ -11,6 +11,8 @@ static const char* const initStr = "Initializing PS2 mouse on CPU [";
 static const char* const namespaceStr = "Drivers::PS2::Mouse::";
 static const char* const enableScanFailStr = "initialize failed to enable scanning";
 
+static APIC::InterruptRoute irqRoute;
+
 bool Drivers::PS2::Mouse::initialize(uint32_t apicId) {
 	// Assumes the PS/2 controller has been properly initialized
 	// using Drivers::PS2::Controller::initialize()
@@ -58,18 +60,14 @@ bool Drivers::PS2::Mouse::initialize(uint32_t apicId) {
 		return false;
 	}
 
-	// Install the IRQ handler
-	APIC::IORedirectionEntry mouseEntry = APIC::readIoRedirectionEntry(Kernel::IRQ::Mouse);
-	Kernel::IDT::installEntry(Kernel::IDT::availableInterrupt, &ps2MouseHandlerWrapper, 2);
-	mouseEntry.vector = Kernel::IDT::availableInterrupt;
-	mouseEntry.deliveryMode = 0;
-	mouseEntry.destinationMode = 0;
-	mouseEntry.pinPolarity = 0;
-	mouseEntry.triggerMode = 0;
-	mouseEntry.mask = 0;
-	mouseEntry.destination = apicId;
-	writeIoRedirectionEntry(Kernel::IRQ::Mouse, mouseEntry);
-	++Kernel::IDT::availableInterrupt;
+	// Install the IRQ handler, it prints so it needs the SSE registers saved
+	const uint8_t vector = Kernel::IDT::allocateVector(ps2MouseHandler, nullptr, true);
+	if (!APIC::routeIrq(irqRoute, Kernel::IRQ::Mouse, vector, APIC::findCpu(apicId))) {
+		Kernel::IDT::freeVector(vector);
+		terminalPrintString(failedStr, strlen(failedStr));
+		terminalPrintChar('\n');
+		return false;
+	}
 	Kernel::IDT::enableInterrupts();
 
 	terminalPrintString(doneStr, strlen(doneStr));
@@ -79,7 +77,7 @@ bool Drivers::PS2::Mouse::initialize(uint32_t apicId) {
 
 size_t i = 0;
 
-void ps2MouseHandler() {
+void ps2MouseHandler(void*, Kernel::Threads::InterruptFrame*) {
 	using namespace Drivers::PS2::Mouse;
 
 	const auto byte = IO::inputByte(Drivers::PS2::Controller::dataPort);
@@ -13,6 +13,9 @@ DRIVERS_STORAGE_OBJFILES := $(DRIVERS_STORAGE_CPPOBJFILES) $(DRIVERS_STORAGE_AHC
 $(BUILD_DIR)/drivers/storage/%.o: $(SRC_DIR)/drivers/storage/%.cpp $(HEADER_FILES)
 	$(CC64) -o $@ -c $< $(C_WARNINGS) $(CC64_FLAGS)
 
+# Runs behind the interrupt entry in idt64.asm that does not save the SSE registers
+$(BUILD_DIR)/drivers/storage/ahci.o: CC64_FLAGS += $(INTERRUPT_CONTEXT_FLAGS)
+
 # Remove elements from directory stack
 d := $(dirstack_$(sp))
 sp := $(basename $(sp))
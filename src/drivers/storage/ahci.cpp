@@ -8,27 +8,26 @@
 static const char* const initAhciStr = "Initializing AHCI controller ";
 static const char* const initAhciCompleteStr = "AHCI controller initialized\n\n";
 static const char* const checkMsiStr = "Checking MSI capability";
+static const char* const checkMsixStr = "Checking MSI-X capability";
 static const char* const msiInstallingStr = "Installing AHCI MSI handler";
 
-static size_t msiInterrupt = SIZE_MAX;
+static uint8_t msiVector = 0;
 
 std::vector<Drivers::Storage::AHCI::Controller> Drivers::Storage::AHCI::controllers;
 
-void ahciMsiHandler() {
+// Only acknowledges the interrupting ports, their commands are completed later by Device::completeCommands
+void ahciMsiHandler(void*, Kernel::Threads::InterruptFrame*) {
 	for (const auto &controller : Drivers::Storage::AHCI::controllers) {
 		uint32_t interruptStatus = controller.hba->interruptStatus;
 		if (interruptStatus) {
-			// If any port needs servicing write its value back to hba->interruptStatus
-			// to acknowledge the interrupt
-			controller.hba->interruptStatus = interruptStatus;
-			for (size_t i = 0; i < AHCI_PORT_COUNT; ++i) {
-				if (
-					interruptStatus & ((uint32_t)1 << i) &&
-					controller.devices[i]
-				) {
-					controller.devices[i]->msiHandler();
+			// Port interrupt statuses are cleared before hba->interruptStatus
+			// by writing back the bits that are set to acknowledge the interrupt
+			for (const auto &device : controller.devices) {
+				if (interruptStatus & ((uint32_t)1 << device->getPortNumber())) {
+					device->acknowledgeInterrupt();
 				}
 			}
+			controller.hba->interruptStatus = interruptStatus;
 		}
 	}
 	APIC::acknowledgeLocalInterrupt();
@@ -41,43 +40,55 @@ Async::Thenable<bool> Drivers::Storage::AHCI::initialize(const PCIe::Function &p
 	terminalPrintChar('\n');
 
 	// Install AHCI MSI handler if not already installed
-	if (msiInterrupt == SIZE_MAX) {
+	if (!msiVector) {
 		terminalPrintSpaces4();
 		terminalPrintString(msiInstallingStr, strlen(msiInstallingStr));
 		terminalPrintString(ellipsisStr, strlen(ellipsisStr));
-		msiInterrupt = Kernel::IDT::availableInterrupt;
-		Kernel::IDT::installEntry(msiInterrupt, &ahciMsiHandlerWrapper, 2);
-		++Kernel::IDT::availableInterrupt;
+		msiVector = Kernel::IDT::allocateVector(ahciMsiHandler, nullptr);
+		if (!msiVector) {
+			terminalPrintString(failedStr, strlen(failedStr));
+			terminalPrintChar('\n');
+			co_return false;
+		}
 		terminalPrintString(doneStr, strlen(doneStr));
 		terminalPrintChar('\n');
 	}
 
-	// Verify the MSI capability and install msiInterrupt
+	// Create new controller and add it to the list
+	// Every controller shares msiVector, so ahciMsiHandler checks all of them wherever the interrupt lands
+	AHCI::controllers.push_back(Controller());
+	Controller &controller = controllers.back();
+	controller.msiRoute = new APIC::InterruptRoute();
+
+	// Prefer MSI-X, its entry 0 starts out on msiVector and Controller::initialize gives every port
+	// its own entry and vector if there are enough entries
 	terminalPrintSpaces4();
-	terminalPrintString(checkMsiStr, strlen(checkMsiStr));
+	terminalPrintString(pcieFunction.msix ? checkMsixStr : checkMsiStr, strlen(pcieFunction.msix ? checkMsixStr : checkMsiStr));
 	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
-	if (!pcieFunction.msi) {
+	bool routed = false;
+	controller.msixTable = PCIe::mapMsixTable(pcieFunction);
+	if (controller.msixTable) {
+		controller.msixEntryCount = pcieFunction.msix->tableSize + 1;
+		pcieFunction.msix->functionMask = 1;
+		pcieFunction.msix->enable = 1;
+		routed = APIC::routeMsix(*controller.msiRoute, &controller.msixTable[0], msiVector);
+		pcieFunction.msix->functionMask = 0;
+	} else if (pcieFunction.msi) {
+		routed = APIC::routeMsi(*controller.msiRoute, pcieFunction.msi, msiVector);
+	}
+	if (!routed) {
+		delete controller.msiRoute;
+		controllers.pop_back();
 		terminalPrintString(notStr, strlen(notStr));
 		terminalPrintChar(' ');
 		terminalPrintString(okStr, strlen(okStr));
 		terminalPrintChar('\n');
 		co_return false;
 	}
-	if (pcieFunction.msi->bit64Capable) {
-		PCIe::MSI64Capability *msi64 = (PCIe::MSI64Capability*)pcieFunction.msi;
-		msi64->messageAddress = APIC::bootCpu->apicPhyAddr;
-		msi64->data = msiInterrupt;
-		msi64->enable = 1;
-	} else {
-		pcieFunction.msi->messageAddress = APIC::bootCpu->apicPhyAddr;
-		pcieFunction.msi->data = msiInterrupt;
-		pcieFunction.msi->enable = 1;
-	}
 	terminalPrintString(okStr, strlen(okStr));
 	terminalPrintChar('\n');
 
-	// Create new controller, add it to the list, and initialize it
-	AHCI::controllers.push_back(Controller());
+	// Initialize the controller
 	bool result = co_await controllers.back().initialize(pcieFunction);
 	if (result) {
 		terminalPrintString(initAhciCompleteStr, strlen(initAhciCompleteStr));
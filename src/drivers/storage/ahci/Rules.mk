@@ -6,3 +6,6 @@ $(BUILD_DIR)/drivers/storage/ahci/%.o: $(SRC_DIR)/drivers/storage/ahci/%.asm
 
 $(BUILD_DIR)/drivers/storage/ahci/%.o: $(SRC_DIR)/drivers/storage/ahci/%.cpp $(HEADER_FILES)
 	$(CC64) -o $@ -c $< $(C_WARNINGS) $(CC64_FLAGS)
+
+# Runs behind the interrupt entry in idt64.asm that does not save the SSE registers
+$(BUILD_DIR)/drivers/storage/ahci/device.o: CC64_FLAGS += $(INTERRUPT_CONTEXT_FLAGS)
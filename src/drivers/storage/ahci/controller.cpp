@@ -12,38 +12,20 @@ static const char* const ahciSwitchStr = "Switching to AHCI mode";
 static const char* const probingPortsStr = "Enumerating and configuring ports";
 static const char* const configuredStr = "Ports configured";
 static const char* const portStr = "Port ";
+static const char* const identStr = "Identifying";
+static const char* const routingStr = "Routing MSI-X entry";
 
 Async::Thenable<bool> Drivers::Storage::AHCI::Controller::initialize(const PCIe::Function &pcieFunction) {
-	using namespace Kernel::Memory;
-
 	// Map the HBA control registers to kernel address space
 	terminalPrintSpaces4();
 	terminalPrintString(mappingHbaStr, strlen(mappingHbaStr));
 	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
-	PCIe::Type0Header *ahciHeader = (PCIe::Type0Header*)(pcieFunction.configurationSpace);
-	PageRequestResult requestResult = Virtual::requestPages(
-		2,
-		(
-			RequestType::Kernel |
-			RequestType::PhysicalContiguous |
-			RequestType::VirtualContiguous |
-			RequestType::CacheDisable
-		)
-	);
-	if (
-		requestResult.address == INVALID_ADDRESS ||
-		requestResult.allocatedCount != 2 ||
-		!Virtual::mapPages(
-			requestResult.address,
-			(void*)(uint64_t)ahciHeader->bar5,
-			2,
-			RequestType::CacheDisable | RequestType::Writable
-		)
-	) {
+	void *abar = PCIe::mapBar(pcieFunction, 5, 2);
+	if (!abar) {
 		terminalPrintString(failedStr, strlen(failedStr));
 		co_return false;
 	}
-	this->hba = (HostBusAdapter*)requestResult.address;
+	this->hba = (HostBusAdapter*)abar;
 	terminalPrintString(doneStr, strlen(doneStr));
 	terminalPrintChar('\n');
 
@@ -58,12 +40,27 @@ Async::Thenable<bool> Drivers::Storage::AHCI::Controller::initialize(const PCIe:
 	terminalPrintString(doneStr, strlen(doneStr));
 	terminalPrintChar('\n');
 
+	// Ports use MSI-X entries like multiple message MSI, port n signals entry n if the table has one
+	// Such ports get their own vector, the others keep sharing entry 0 routed by AHCI::initialize
+	// Entry 0 then stays shared, so port 0 keeps using it as well
+	// Ports are numbered by their bit in portsImplemented, which may have gaps, so every implemented port is checked
+	bool sharedEntryUsed = !this->msixTable;
+	for (size_t portNumber = 0; portNumber < AHCI_PORT_COUNT && !sharedEntryUsed; ++portNumber) {
+		if ((this->hba->portsImplemented & ((uint32_t)1 << portNumber)) && portNumber >= this->msixEntryCount) {
+			sharedEntryUsed = true;
+		}
+	}
+	if (!sharedEntryUsed) {
+		APIC::unroute(*this->msiRoute);
+	}
+
 	// Enumerate and configure all the implemented ports
 	terminalPrintSpaces4();
 	terminalPrintString(probingPortsStr, strlen(probingPortsStr));
 	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
 	terminalPrintChar('\n');
 	uint32_t portsImplemented = this->hba->portsImplemented;
+	std::vector<Async::Thenable<bool>> identifications;
 	for (size_t portNumber = 0; portNumber < AHCI_PORT_COUNT; ++portNumber) {
 		if (
 			(portsImplemented & 1) &&
@@ -89,15 +86,49 @@ Async::Thenable<bool> Drivers::Storage::AHCI::Controller::initialize(const PCIe:
 				terminalPrintDecimal(ahciDevice->portNumber);
 				terminalPrintChar(':');
 				terminalPrintChar('\n');
-				if (!ahciDevice->initialize() || !(co_await ahciDevice->identify())) {
+				if (this->msixTable && portNumber < this->msixEntryCount && !(portNumber == 0 && sharedEntryUsed)) {
+					terminalPrintSpaces4();
+					terminalPrintSpaces4();
+					terminalPrintSpaces4();
+					terminalPrintString(routingStr, strlen(routingStr));
+					terminalPrintString(ellipsisStr, strlen(ellipsisStr));
+					if (!ahciDevice->routeInterrupt(&this->msixTable[portNumber])) {
+						terminalPrintString(failedStr, strlen(failedStr));
+						terminalPrintChar('\n');
+						co_return false;
+					}
+					terminalPrintString(doneStr, strlen(doneStr));
+					terminalPrintChar('\n');
+				}
+				if (!ahciDevice->initialize()) {
 					terminalPrintString(failedStr, strlen(failedStr));
 					terminalPrintChar('\n');
 					co_return false;
 				}
+				identifications.push_back(ahciDevice->identify());
 			}
 		}
 		portsImplemented >>= 1;
 	}
+
+	// Identify commands were issued to every port above and complete in parallel
+	const auto identified = std::move(co_await Async::whenAll(std::move(identifications)));
+	for (size_t i = 0; i < identified.size(); ++i) {
+		terminalPrintSpaces4();
+		terminalPrintSpaces4();
+		terminalPrintString(portStr, strlen(portStr));
+		terminalPrintDecimal(this->devices.at(i)->portNumber);
+		terminalPrintChar(' ');
+		terminalPrintString(identStr, strlen(identStr));
+		terminalPrintString(ellipsisStr, strlen(ellipsisStr));
+		if (!identified.at(i)) {
+			terminalPrintString(failedStr, strlen(failedStr));
+			terminalPrintChar('\n');
+			co_return false;
+		}
+		terminalPrintString(doneStr, strlen(doneStr));
+		terminalPrintChar('\n');
+	}
 	terminalPrintSpaces4();
 	terminalPrintString(configuredStr, strlen(configuredStr));
 	terminalPrintChar('\n');
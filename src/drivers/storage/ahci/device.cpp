@@ -9,140 +9,290 @@ static const char* const commandNamespaceStr = "AHCI::Device::Command";
 static const char* const multiSetStr = " tried setting result multiple times\n";
 static const char* const noResultStr = " result not available\n";
 static const char* const initStr = "Initializing";
-static const char* const identStr = "Identifying";
 static const char* const tfeStr = "AHCI task file error caused by commands ";
 static const char* const tfeUnsolicitedStr = "AHCI unsolicited task file error ";
 static const char* const d2hUnsolicitedStr = "AHCI unsolicited register D2H FIS ";
 static const char* const atDeviceStr = "at device";
-
-Drivers::Storage::Buffer Drivers::Storage::AHCI::Device::setupRead(size_t blockCount, size_t &freeSlot) {
+static const char* const timeoutStr = "AHCI commands timed out ";
+static const char* const recoveryFailedStr = "AHCI port recovery failed ";
+static const size_t commandSlotCount = AHCI_COMMAND_LIST_SIZE / sizeof(Drivers::Storage::AHCI::CommandHeader);
+static const uint32_t comresetDetection = 1;	// PxSCTL.DET value that issues a COMRESET
+static const uint32_t sataErrorClearAll = 0xffffffff;
+
+static size_t describeSegments(
+	const Kernel::Memory::PhysicalSegmentList &segments,
+	size_t skipBytes,
+	size_t byteCount,
+	Drivers::Storage::AHCI::PRDTEntry *entries,
+	bool bit64Addressing,
+	size_t &prdCount
+);
+static void printDevice(const Drivers::Storage::AHCI::Device *device);
+static bool waitFor(volatile Drivers::Storage::AHCI::Port *port, bool (*done)(volatile Drivers::Storage::AHCI::Port *port));
+
+// Claims a command slot and describes as many blocks of buffer from firstBlock onwards in its PRDT as fit, at most blockCount
+// A buffer is backed by physical segments that need not be contiguous and each segment takes one or more PRDT entries,
+// so a large or scattered buffer has to be read with several commands (read AHCI::Device::initialize comments to know why AHCI_PRDT_COUNT PRDTs)
+// Returns the number of blocks described, 0 if no slot is free
+size_t Drivers::Storage::AHCI::Device::setupRead(
+	const Storage::Buffer &buffer,
+	size_t firstBlock,
+	size_t blockCount,
+	size_t &freeSlot
+) {
 	if (blockCount == 0) {
-		return nullptr;
-	}
-
-	// Each command has 8 PRDTs (read AHCI::Device::initialize comments to know why 8 PRDTs)
-	// and each PRDT can handle 4MiB i.e. maximum of 32MiB
-	const size_t mib4 = 2UL * MIB_2;
-	const size_t totalBytes = blockCount * this->blockSize;
-	if (totalBytes > 8 * mib4) {
-		return nullptr;
+		return 0;
 	}
 
 	freeSlot = this->findFreeCommandSlot();
 	if (freeSlot == SIZE_MAX) {
-		return nullptr;
+		return 0;
 	}
 
-	size_t prdsRequired = totalBytes / mib4;
-	if (totalBytes > prdsRequired * mib4) {
-		++prdsRequired;
+	// Only whole blocks can be read, so the part ends at the last block boundary the PRDT entries reach
+	// Every segment is at least a page and a page holds whole blocks, hence the entries always reach at least one block
+	const bool bit64Addressing = this->controller->hba->hostCapabilities.bit64Addressing;
+	const size_t skipBytes = firstBlock * this->blockSize;
+	size_t prdCount = 0;
+	size_t partBytes = describeSegments(buffer.getSegments(), skipBytes, blockCount * this->blockSize, nullptr, bit64Addressing, prdCount);
+	partBytes -= partBytes % this->blockSize;
+	if (partBytes == 0) {
+		this->releaseCommandSlot(freeSlot);
+		return 0;
 	}
 
+	// Clear out the command table and setup PRDT entries
+	// Only the last PRDT entry must interrupt to signal command completion
+	memset(this->commandTables[freeSlot], 0, sizeof(CommandTable) + prdCount * sizeof(PRDTEntry));
+	describeSegments(buffer.getSegments(), skipBytes, partBytes, this->commandTables[freeSlot]->prdtEntries, bit64Addressing, prdCount);
+	this->commandTables[freeSlot]->prdtEntries[prdCount - 1].interruptOnCompletion = 1;
+
 	// Refer section 5.5.1 and 5.6.2.4 of AHCI specification https://www.intel.com.au/content/dam/www/public/us/en/documents/technical-specifications/serial-ata-ahci-spec-rev1-3-1.pdf
-	this->commandHeaders[freeSlot].prdtLength = prdsRequired;
+	this->commandHeaders[freeSlot].prdtLength = prdCount;
 	this->commandHeaders[freeSlot].commandFisLength = sizeof(FIS::RegisterH2D) / sizeof(uint32_t);
 	this->commandHeaders[freeSlot].write = 0;
 
-	// Clear out the command table
-	memset(this->commandTables[freeSlot], 0, sizeof(CommandTable) + prdsRequired * sizeof(PRDTEntry));
-
-	// Setup PRDT entries
-	// First (prdsRequired - 1) will all have byteCount set to (mib4 - 1) and will not interrupt.
-	// The last PRDT entry will have remaining byteCount and must interrupt to signal command completion.
-	Storage::Buffer buffer = Storage::Buffer(totalBytes, AHCI_BUFFER_ALIGN_AT);
-	uint64_t bufferSegmentPhyAddr;
-	for (size_t i = 0; i < prdsRequired - 1; ++i) {
-		bufferSegmentPhyAddr = buffer.getPhysicalAddress() + i * mib4;
-		this->commandTables[freeSlot]->prdtEntries[i].dataBase = (uint32_t)(bufferSegmentPhyAddr);
-		if (controller->hba->hostCapabilities.bit64Addressing) {
-			this->commandTables[freeSlot]->prdtEntries[i].dataBaseUpper = (uint32_t)(bufferSegmentPhyAddr >> 32);
-		}
-		this->commandTables[freeSlot]->prdtEntries[i].byteCount = mib4 - 1;
-		this->commandTables[freeSlot]->prdtEntries[i].interruptOnCompletion = 0;
-	}
-	bufferSegmentPhyAddr = buffer.getPhysicalAddress() + (prdsRequired - 1) * mib4;
-	this->commandTables[freeSlot]->prdtEntries[prdsRequired - 1].dataBase = (uint32_t)bufferSegmentPhyAddr;
-	if (controller->hba->hostCapabilities.bit64Addressing) {
-		this->commandTables[freeSlot]->prdtEntries[prdsRequired - 1].dataBaseUpper = (uint32_t)(bufferSegmentPhyAddr >> 32);
-	}
-	this->commandTables[freeSlot]->prdtEntries[prdsRequired - 1].byteCount = totalBytes - (prdsRequired - 1) * mib4;
-	this->commandTables[freeSlot]->prdtEntries[prdsRequired - 1].interruptOnCompletion = 1;
-
 	// Setup the command FIS
 	FIS::RegisterH2D *commandFis = (FIS::RegisterH2D*)&this->commandTables[freeSlot]->commandFIS;
 	memset(commandFis, 0, sizeof(FIS::RegisterH2D));
 	commandFis->fisType = AHCI_FIS_TYPE_REG_H2D;
 	commandFis->commandControl = 1;
-	return buffer;
+	return partBytes / this->blockSize;
 }
 
-void Drivers::Storage::AHCI::Device::msiHandler() {
-	// FIXME: should lock the block device
-	auto *thisDevice = this;
-	uint32_t interruptStatus = this->port->interruptStatus;
+// Top half of the MSI handler, runs in interrupt context
+// Acknowledges the port's interrupt and leaves its status bits for completeCommands
+void Drivers::Storage::AHCI::Device::acknowledgeInterrupt() {
+	const uint32_t interruptStatus = this->port->interruptStatus;
 	this->port->interruptStatus = interruptStatus;
-	uint32_t completedCommands = ~this->port->commandIssue & this->runningCommandsBitmap;
+	this->pendingInterruptStatus.fetch_or(interruptStatus);
+	Kernel::Scheduler::queueDeferredWork(this->completionWork);
+}
+
+// Handler of the port's own vector set up by routeInterrupt, runs in interrupt context
+void Drivers::Storage::AHCI::Device::handleInterrupt() {
+	this->acknowledgeInterrupt();
+	this->controller->hba->interruptStatus = (uint32_t)1 << this->portNumber;
+	APIC::acknowledgeLocalInterrupt();
+}
+
+// Bottom half of the MSI handler, runs from the dispatch loop with interrupts enabled
+// Handles all the interrupts acknowledged and commands cancelled since it last ran in one pass
+void Drivers::Storage::AHCI::Device::completeCommands() {
+	const uint32_t interruptStatus = this->pendingInterruptStatus.exchange(0);
+	this->commandLock.lock();
+	const uint32_t issuedCommands = this->runningCommandsBitmap & ~this->claimedCommandsBitmap;
+	uint32_t failedCommands = 0;
 
 	if (interruptStatus & AHCI_TASK_FILE_ERROR) {
-		// Find which command caused the error
-		if (completedCommands) {
+		// The port stops at the command that caused the error and leaves its bit set in PxCI
+		// Commands that completed before it are handled with the D2H FISes below
+		failedCommands = ((uint32_t)1 << this->port->commandStatus.currentCommandSlot) & issuedCommands;
+		if (failedCommands) {
 			terminalPrintString(tfeStr, strlen(tfeStr));
-			terminalPrintHex(&completedCommands, sizeof(completedCommands));
-			for (size_t i = 0; i < AHCI_COMMAND_LIST_SIZE / sizeof(CommandHeader); ++i) {
-				uint32_t commandBit = (uint32_t)1 << i;
-				if (completedCommands & commandBit) {
-					this->runningCommandsBitmap &= ~commandBit;
-					if (this->commands[i]) {
-						this->commands[i]->setResult(false);
-						this->commands[i] = nullptr;
-					}
-				}
-			}
+			terminalPrintHex(&failedCommands, sizeof(failedCommands));
 		} else {
 			terminalPrintString(tfeUnsolicitedStr, strlen(tfeUnsolicitedStr));
 		}
-		terminalPrintString(atDeviceStr, strlen(atDeviceStr));
-		terminalPrintChar(' ');
-		terminalPrintHex(&thisDevice, sizeof(thisDevice));
-		terminalPrintChar('\n');
+		printDevice(this);
 	}
 
+	const uint32_t completedCommands = ~this->port->commandIssue & issuedCommands & ~failedCommands;
 	if (interruptStatus & AHCI_REGISTER_D2H) {
+		// TODO: maybe check for received FIS status
 		if (completedCommands) {
-			for (size_t i = 0; i < AHCI_COMMAND_LIST_SIZE / sizeof(CommandHeader); ++i) {
-				// TODO: maybe check for received FIS status
-				uint32_t commandBit = (uint32_t)1 << i;
-				if (completedCommands & commandBit) {
-					this->runningCommandsBitmap &= ~commandBit;
-					if (this->commands[i]) {
-						this->commands[i]->setResult(true);
-						this->commands[i] = nullptr;
-					}
-				}
-			}
+			this->finishCommands(completedCommands, true);
 		} else {
 			terminalPrintString(d2hUnsolicitedStr, strlen(d2hUnsolicitedStr));
-			terminalPrintString(atDeviceStr, strlen(atDeviceStr));
-			terminalPrintChar(' ');
-			terminalPrintHex(&thisDevice, sizeof(thisDevice));
-			terminalPrintChar('\n');
+			printDevice(this);
 		}
 	}
+
+	// Bits of slots that are not issued yet stay pending, Command::await_suspend requeues this work once they are
+	uint32_t cancelledCommands = this->cancelledCommands.load() & issuedCommands;
+	this->cancelledCommands.fetch_and(~cancelledCommands);
+	if (interruptStatus & AHCI_TASK_FILE_ERROR) {
+		// The port does not process PxCI again until it is restarted, even if no command is to blame
+		this->abortCommands(failedCommands | cancelledCommands);
+	} else if (cancelledCommands) {
+		this->abortCommands(cancelledCommands);
+	}
+	this->commandLock.unlock();
 }
 
-Async::Thenable<bool> Drivers::Storage::AHCI::Device::identify() {
-	terminalPrintSpaces4();
-	terminalPrintSpaces4();
-	terminalPrintSpaces4();
-	terminalPrintString(identStr, strlen(identStr));
-	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
+// Fails the given running commands after stopping the port, which is the only way to take a command back from the HBA
+// Commands the HBA completed meanwhile succeed, the others are issued again once the port is restarted
+// Must be called with commandLock held
+void Drivers::Storage::AHCI::Device::abortCommands(uint32_t abortedCommands) {
+	uint32_t issuedCommands = this->runningCommandsBitmap & ~this->claimedCommandsBitmap;
+	abortedCommands &= issuedCommands;
+	this->finishCommands(issuedCommands & ~this->port->commandIssue & ~abortedCommands, true);
+	const bool recovered = this->recoverPort();
+	if (!recovered) {
+		terminalPrintString(recoveryFailedStr, strlen(recoveryFailedStr));
+		printDevice(this);
+	}
+	// Stopping the port cleared PxCI, so whatever is still running is either aborted or reissued
+	this->finishCommands(abortedCommands, false);
+	issuedCommands = this->runningCommandsBitmap & ~this->claimedCommandsBitmap;
+	if (!recovered) {
+		this->finishCommands(issuedCommands, false);
+		return;
+	}
+	if (issuedCommands) {
+		const uint64_t deadline = Kernel::Time::nowNs() + AHCI_COMMAND_TIMEOUT;
+		for (size_t i = 0; i < commandSlotCount; ++i) {
+			if (issuedCommands & ((uint32_t)1 << i)) {
+				this->deadlines[i] = deadline;
+			}
+		}
+		this->armWatchdog(deadline);
+		this->port->commandIssue = issuedCommands;
+	}
+}
+
+// Must be called with commandLock held
+void Drivers::Storage::AHCI::Device::armWatchdog(uint64_t deadline) {
+	if (this->watchdogArmed) {
+		// The watchdog rearms itself for the earliest deadline when it expires
+		return;
+	}
+	const uint64_t now = Kernel::Time::nowNs();
+	this->watchdogArmed = true;
+	Kernel::Scheduler::addTimer(this->watchdog, deadline > now ? deadline - now : 0);
+}
 
-	this->info = new IdentifyDeviceData();
-	Kernel::Memory::Virtual::CrawlResult crawl(this->info);
-	if (crawl.physicalTables[0] == INVALID_ADDRESS || crawl.indexes[0] % 2 != 0) {
+// Runs from the watchdog timer, aborts the commands whose deadline passed
+void Drivers::Storage::AHCI::Device::expireCommands() {
+	this->commandLock.lock();
+	this->watchdogArmed = false;
+	const uint64_t now = Kernel::Time::nowNs();
+	uint32_t issuedCommands = this->runningCommandsBitmap & ~this->claimedCommandsBitmap;
+	uint32_t expiredCommands = 0;
+	for (size_t i = 0; i < commandSlotCount; ++i) {
+		if ((issuedCommands & ((uint32_t)1 << i)) && this->deadlines[i] <= now) {
+			expiredCommands |= (uint32_t)1 << i;
+		}
+	}
+	if (expiredCommands) {
+		terminalPrintString(timeoutStr, strlen(timeoutStr));
+		terminalPrintHex(&expiredCommands, sizeof(expiredCommands));
+		printDevice(this);
+		this->abortCommands(expiredCommands);
+	}
+	issuedCommands = this->runningCommandsBitmap & ~this->claimedCommandsBitmap;
+	uint64_t earliestDeadline = UINT64_MAX;
+	for (size_t i = 0; i < commandSlotCount; ++i) {
+		if ((issuedCommands & ((uint32_t)1 << i)) && this->deadlines[i] < earliestDeadline) {
+			earliestDeadline = this->deadlines[i];
+		}
+	}
+	if (earliestDeadline != UINT64_MAX) {
+		this->armWatchdog(earliestDeadline);
+	}
+	this->commandLock.unlock();
+}
+
+// Resumes the given issued commands with result and frees their slots
+// Must be called with commandLock held
+void Drivers::Storage::AHCI::Device::finishCommands(uint32_t finishedCommands, bool result) {
+	finishedCommands &= this->runningCommandsBitmap & ~this->claimedCommandsBitmap;
+	for (size_t i = 0; i < commandSlotCount && finishedCommands; ++i) {
+		const uint32_t commandBit = (uint32_t)1 << i;
+		if (!(finishedCommands & commandBit)) {
+			continue;
+		}
+		finishedCommands &= ~commandBit;
+		this->runningCommandsBitmap &= ~commandBit;
+		Command *command = this->commands[i];
+		this->commands[i] = nullptr;
+		if (!command) {
+			continue;
+		}
+		if (command->cancellation) {
+			// Once unsubscribed the token cannot set the slot's cancelled bit anymore, so a stale bit can be dropped
+			command->cancellation->unsubscribe(command->cancellationNode);
+			this->cancelledCommands.fetch_and(~commandBit);
+		}
+		command->setResult(result);
+	}
+}
+
+// Stops the port and brings the device back to a state where it accepts commands, then restarts the port
+// Refer section 6.2.2.2 of the AHCI specification for the non-queued error recovery sequence
+// Busy waits at most a few AHCI_PORT_RECOVERY_TIMEOUTs, which is tolerable since it only runs when commands fail
+// Returns false if the port did not stop or the device did not come back, the port is left stopped in that case
+// Must be called with commandLock held
+bool Drivers::Storage::AHCI::Device::recoverPort() {
+	this->port->commandStatus.start = 0;
+	if (!waitFor(this->port, [](volatile Port *port) { return !port->commandStatus.commandListRunning; })) {
+		return false;
+	}
+	this->port->sataError = sataErrorClearAll;
+	this->port->interruptStatus = this->port->interruptStatus;
+	if (this->port->taskFileData & (AHCI_DEVICE_BUSY | AHCI_DEVICE_DRQ)) {
+		if (this->controller->hba->hostCapabilities.commandListOverride) {
+			this->port->commandStatus.commandListOverride = 1;
+			if (!waitFor(this->port, [](volatile Port *port) { return !port->commandStatus.commandListOverride; })) {
+				return false;
+			}
+		} else {
+			// COMRESET, DET must be held at 1 for at least 1ms
+			this->port->sataControl = (this->port->sataControl & ~(uint32_t)0xf) | comresetDetection;
+			const uint64_t holdEnd = Kernel::Time::nowNs() + AHCI_COMRESET_HOLD_TIME;
+			while (Kernel::Time::nowNs() < holdEnd) {
+				__builtin_ia32_pause();
+			}
+			this->port->sataControl = this->port->sataControl & ~(uint32_t)0xf;
+			if (!waitFor(this->port, [](volatile Port *port) {
+				return port->sataStatus.deviceDetection == AHCI_PORT_DEVICE_PRESENT;
+			})) {
+				return false;
+			}
+			this->port->sataError = sataErrorClearAll;
+		}
+		if (!waitFor(this->port, [](volatile Port *port) {
+			return !(port->taskFileData & (AHCI_DEVICE_BUSY | AHCI_DEVICE_DRQ));
+		})) {
+			return false;
+		}
+	}
+	this->port->commandStatus.start = 1;
+	return true;
+}
+
+Async::Thenable<bool> Drivers::Storage::AHCI::Device::identify() {
+	// Place the identify data in its own physical page and access it through the direct map
+	Kernel::Memory::PageRequestResult requestResult = Kernel::Memory::Physical::requestPages(
+		1,
+		Kernel::Memory::RequestType::PhysicalContiguous
+	);
+	if (requestResult.address == INVALID_ADDRESS || requestResult.allocatedCount != 1) {
 		co_return false;
 	}
-	uint64_t bufferPhyAddr = (uint64_t)crawl.physicalTables[0] + crawl.indexes[0];
+	this->info = (IdentifyDeviceData*)Kernel::Memory::Virtual::physToVirt(requestResult.address);
+	memset(this->info, 0, sizeof(IdentifyDeviceData));
+	uint64_t bufferPhyAddr = (uint64_t)requestResult.address;
 
 	size_t freeSlot = this->findFreeCommandSlot();
 	if (freeSlot == SIZE_MAX) {
@@ -176,8 +326,6 @@ Async::Thenable<bool> Drivers::Storage::AHCI::Device::identify() {
 			// Assume sector size of 512 bytes for SATA and 2048 bytes for SATAPI
 			this->blockSize = this->type == Type::Sata ? 512 : 2048;
 		}
-		terminalPrintString(doneStr, strlen(doneStr));
-		terminalPrintChar('\n');
 		co_return true;
 	}
 
@@ -207,24 +355,14 @@ bool Drivers::Storage::AHCI::Device::initialize() {
 
 	// Request a page where the command list (1024 bytes) and received FISes (256 bytes) can be placed
 	// Get the physical address of this page and put it in the commandListBase and fisBase
-	PageRequestResult requestResult = Virtual::requestPages(
-		1,
-		(
-			RequestType::Kernel |
-			RequestType::PhysicalContiguous |
-			RequestType::VirtualContiguous |
-			RequestType::AllocatePhysical |
-			RequestType::CacheDisable |
-			RequestType::Writable
-		)
-	);
+	// The page is accessed through the direct map so its physical address is known upfront
+	PageRequestResult requestResult = Physical::requestPages(1, RequestType::PhysicalContiguous);
 	if (requestResult.address == INVALID_ADDRESS || requestResult.allocatedCount != 1) {
 		return false;
 	}
-	Virtual::CrawlResult crawlResult(requestResult.address);
-	uint64_t phyAddr = (uint64_t)crawlResult.physicalTables[0];
-	uint64_t virAddr = (uint64_t)requestResult.address;
-	memset(requestResult.address, 0, pageSize);
+	uint64_t phyAddr = (uint64_t)requestResult.address;
+	uint64_t virAddr = (uint64_t)Virtual::physToVirt(requestResult.address);
+	memset((void*)virAddr, 0, pageSize);
 	this->commandHeaders = (CommandHeader*)virAddr;
 	this->port->commandListBase = (uint32_t)phyAddr;
 	if (this->controller->hba->hostCapabilities.bit64Addressing) {
@@ -241,33 +379,24 @@ bool Drivers::Storage::AHCI::Device::initialize() {
 	// There are AHCI_COMMAND_LIST_SIZE / sizeof(CommandHeader) i.e. 32 command tables
 	// PRDT entry size is 16 bytes
 	// Each command table's size is CommandFIS(64 bytes) + ACMD(16 bytes) + reserved(48 bytes) + prdtLength * PRDT entry size(16 bytes)
-	// To make all the 32 command tables fit nicely in 2 pages, solve the equation for prdtLength
-	// 2 * 4096 = 32 * (64 + 16 + 48 + prdtLength * 16)
-	// Hence, prdtLength works out to 8
-	requestResult = Virtual::requestPages(
-		2,
-		(
-			RequestType::Kernel |
-			RequestType::PhysicalContiguous |
-			RequestType::VirtualContiguous |
-			RequestType::AllocatePhysical |
-			RequestType::CacheDisable |
-			RequestType::Writable
-		)
-	);
+	// Buffers are scattered across physical memory so each command needs more PRDTs than a contiguous buffer would
+	// To make all the 32 command tables fit nicely in 4 pages, solve the equation for prdtLength
+	// 4 * 4096 = 32 * (64 + 16 + 48 + prdtLength * 16)
+	// Hence, prdtLength works out to AHCI_PRDT_COUNT i.e. 24
+	const size_t commandTableSize = 64 + 16 + 48 + 16 * AHCI_PRDT_COUNT;
+	const size_t commandTablesPageCount = AHCI_COMMAND_LIST_SIZE / sizeof(CommandHeader) * commandTableSize / pageSize;
+	requestResult = Physical::requestPages(commandTablesPageCount, RequestType::PhysicalContiguous);
 	if (
 		requestResult.address == INVALID_ADDRESS ||
-		requestResult.allocatedCount != 2
+		requestResult.allocatedCount != commandTablesPageCount
 	) {
 		return false;
 	}
-	crawlResult = Kernel::Memory::Virtual::CrawlResult(requestResult.address);
-	phyAddr = (uint64_t)crawlResult.physicalTables[0];
-	virAddr = (uint64_t)requestResult.address;
-	memset(requestResult.address, 0, 2 * Kernel::Memory::pageSize);
-	const size_t commandTableSize = 64 + 16 + 48 + 16 * 8;
+	phyAddr = (uint64_t)requestResult.address;
+	virAddr = (uint64_t)Virtual::physToVirt(requestResult.address);
+	memset((void*)virAddr, 0, commandTablesPageCount * pageSize);
 	for (size_t i = 0; i < AHCI_COMMAND_LIST_SIZE / sizeof(CommandHeader); ++i) {
-		this->commandHeaders[i].prdtLength = 8;
+		this->commandHeaders[i].prdtLength = AHCI_PRDT_COUNT;
 		this->commandTables[i] = (CommandTable*)virAddr;
 		this->commandHeaders[i].commandTableBase = (uint32_t)phyAddr;
 		if (this->controller->hba->hostCapabilities.bit64Addressing) {
@@ -292,15 +421,54 @@ bool Drivers::Storage::AHCI::Device::initialize() {
 	return true;
 }
 
-size_t Drivers::Storage::AHCI::Device::findFreeCommandSlot() const {
-	uint32_t slots = this->port->commandIssue | this->port->sataActive | this->runningCommandsBitmap;
-	for (size_t i = 0; i < AHCI_COMMAND_LIST_SIZE / sizeof(CommandHeader); ++i) {
-		if ((slots & 1) == 0) {
-			return i;
+// Gives the port its own vector delivered through entry to the CPU with the fewest routes
+// Must be called before initialize enables the port's interrupts
+// Returns false if no vector is left or the entry could not be routed
+bool Drivers::Storage::AHCI::Device::routeInterrupt(volatile PCIe::MSIXTableEntry *entry) {
+	this->interruptVector = Kernel::IDT::allocateVector(
+		[](void *context, Kernel::Threads::InterruptFrame*) {
+			((Device*)context)->handleInterrupt();
+		},
+		this
+	);
+	if (!this->interruptVector) {
+		return false;
+	}
+	if (!APIC::routeMsix(this->interruptRoute, entry, this->interruptVector)) {
+		Kernel::IDT::freeVector(this->interruptVector);
+		this->interruptVector = 0;
+		return false;
+	}
+	return true;
+}
+
+// Claims a slot that is neither issued nor claimed by anyone else
+// The slot stays claimed until a Command issues it or releaseCommandSlot gives it back
+size_t Drivers::Storage::AHCI::Device::findFreeCommandSlot() {
+	this->commandLock.lock();
+	const uint32_t slots = this->port->commandIssue | this->port->sataActive | this->runningCommandsBitmap;
+	size_t freeSlot = SIZE_MAX;
+	for (size_t i = 0; i < commandSlotCount; ++i) {
+		if ((slots & ((uint32_t)1 << i)) == 0) {
+			freeSlot = i;
+			this->runningCommandsBitmap |= (uint32_t)1 << i;
+			this->claimedCommandsBitmap |= (uint32_t)1 << i;
+			break;
 		}
-		slots >>= 1;
 	}
-	return SIZE_MAX;
+	this->commandLock.unlock();
+	return freeSlot;
+}
+
+// Gives back a slot claimed by findFreeCommandSlot that will not be issued
+void Drivers::Storage::AHCI::Device::releaseCommandSlot(size_t slot) {
+	const uint32_t commandBit = (uint32_t)1 << slot;
+	this->commandLock.lock();
+	if (this->claimedCommandsBitmap & commandBit) {
+		this->claimedCommandsBitmap &= ~commandBit;
+		this->runningCommandsBitmap &= ~commandBit;
+	}
+	this->commandLock.unlock();
 }
 
 Drivers::Storage::AHCI::Device::Type Drivers::Storage::AHCI::Device::getType() const {
@@ -321,52 +489,158 @@ Drivers::Storage::AHCI::Device::Device(Controller *controller, size_t portNumber
 		this->commandTables[i] = nullptr;
 	}
 	this->runningCommandsBitmap = 0;
+	this->claimedCommandsBitmap = 0;
+	for (size_t i = 0; i < commandSlotCount; ++i) {
+		this->commands[i] = nullptr;
+		this->deadlines[i] = 0;
+	}
+	this->watchdog.callback = [](Kernel::Scheduler::Timer &timer) {
+		((Device*)timer.context)->expireCommands();
+	};
+	this->watchdog.context = this;
+	this->watchdogArmed = false;
+	this->pendingInterruptStatus = 0;
+	this->cancelledCommands = 0;
+	this->interruptVector = 0;
+	this->completionWork.callback = [](Kernel::Scheduler::DeferredWork &work) {
+		((Device*)work.context)->completeCommands();
+	};
+	this->completionWork.context = this;
 	this->info = nullptr;
 	this->controller = controller;
 }
 
-Drivers::Storage::AHCI::Device::Command::Command(Device *device, size_t freeSlot)
+Drivers::Storage::AHCI::Device::Command::Command(Device *device, size_t freeSlot, Async::CancellationToken *cancellation)
 	:	device(device),
 		freeSlot(freeSlot),
+		cancellation(cancellation),
 		awaitingCoroutine(nullptr),
-		result(nullptr) {}
+		result(false),
+		hasResult(false) {
+	this->cancellationNode.callback = [](Async::AwaitingNode &node) {
+		Command *command = (Command*)node.context;
+		command->device->cancelledCommands.fetch_or((uint32_t)1 << command->freeSlot);
+		Kernel::Scheduler::queueDeferredWork(command->device->completionWork);
+	};
+	this->cancellationNode.context = this;
+}
 
-Drivers::Storage::AHCI::Device::Command::~Command() {
-	if (this->awaitingCoroutine) {
-		delete this->awaitingCoroutine;
-		this->awaitingCoroutine = nullptr;
+// Does not suspend if cancellation is already cancelled, the command then fails without being issued
+bool Drivers::Storage::AHCI::Device::Command::await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+	// Subscribe before issuing so that completion, which unsubscribes, cannot race with subscribing
+	if (this->cancellation && !this->cancellation->subscribe(this->cancellationNode)) {
+		this->device->releaseCommandSlot(this->freeSlot);
+		this->result = false;
+		this->hasResult = true;
+		return false;
 	}
-	if (this->result) {
-		delete result;
-		this->result = nullptr;
+	// Once the lock is released the command may complete, and the awaiting coroutine destroy it and its token
+	Device *const device = this->device;
+	Async::CancellationToken *const cancellation = this->cancellation;
+	const uint32_t commandBit = (uint32_t)1 << this->freeSlot;
+	const uint64_t deadline = Kernel::Time::nowNs() + AHCI_COMMAND_TIMEOUT;
+	this->awaitingCoroutine = awaitingCoroutine;
+	device->commandLock.lock();
+	device->commands[this->freeSlot] = this;
+	device->claimedCommandsBitmap &= ~commandBit;
+	device->deadlines[this->freeSlot] = deadline;
+	device->armWatchdog(deadline);
+	device->port->commandIssue = commandBit;
+	// The token may have been cancelled before the slot was issued, in which case completeCommands skipped its bit
+	const bool cancelled = cancellation && cancellation->isCancelled();
+	device->commandLock.unlock();
+	if (cancelled) {
+		Kernel::Scheduler::queueDeferredWork(device->completionWork);
 	}
-}
-
-void Drivers::Storage::AHCI::Device::Command::await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
-	// FIXME: should lock the block device
-	this->awaitingCoroutine = new std::coroutine_handle<>(awaitingCoroutine);
-	this->device->commands[freeSlot] = this;
-	this->device->runningCommandsBitmap |= 1 << freeSlot;
-	this->device->port->commandIssue = 1 << this->freeSlot;
+	return true;
 }
 
 bool Drivers::Storage::AHCI::Device::Command::await_resume() const noexcept {
-	if (!this->result) {
+	if (!this->hasResult) {
 		terminalPrintString(commandNamespaceStr, strlen(commandNamespaceStr));
 		terminalPrintString(noResultStr, strlen(noResultStr));
 		Kernel::panic();
 	}
-	return *this->result;
+	return this->result;
 }
 
 void Drivers::Storage::AHCI::Device::Command::setResult(bool result) noexcept {
-	if (this->result) {
+	if (this->hasResult) {
 		terminalPrintString(commandNamespaceStr, strlen(commandNamespaceStr));
 		terminalPrintString(multiSetStr, strlen(multiSetStr));
 		Kernel::panic();
 	}
-	this->result = new bool(result);
+	this->result = result;
+	this->hasResult = true;
 	if (this->awaitingCoroutine) {
-		Kernel::Scheduler::queueEvent(*this->awaitingCoroutine);
+		// Storage completions are resumed ahead of queued background work
+		Kernel::Scheduler::queueEvent(this->awaitingCoroutine, Kernel::Scheduler::InterruptCompletion);
+	}
+}
+
+// Describes byteCount bytes of segments, starting skipBytes into them, with at most AHCI_PRDT_COUNT PRDT entries
+// of at most AHCI_PRDT_BYTE_LIMIT bytes each, the entries are only written if entries is not nullptr
+// Returns the number of bytes described, which is less than byteCount if the entries ran out
+static size_t describeSegments(
+	const Kernel::Memory::PhysicalSegmentList &segments,
+	size_t skipBytes,
+	size_t byteCount,
+	Drivers::Storage::AHCI::PRDTEntry *entries,
+	bool bit64Addressing,
+	size_t &prdCount
+) {
+	size_t bytesDescribed = 0;
+	prdCount = 0;
+	for (const auto &segment : segments) {
+		if (bytesDescribed == byteCount || prdCount == AHCI_PRDT_COUNT) {
+			break;
+		}
+		size_t segmentBytes = segment.pageCount * Kernel::Memory::pageSize;
+		if (skipBytes >= segmentBytes) {
+			skipBytes -= segmentBytes;
+			continue;
+		}
+		uint64_t segmentPhyAddr = (uint64_t)segment.address + skipBytes;
+		segmentBytes -= skipBytes;
+		skipBytes = 0;
+		while (segmentBytes != 0 && bytesDescribed != byteCount && prdCount != AHCI_PRDT_COUNT) {
+			size_t prdBytes = segmentBytes > AHCI_PRDT_BYTE_LIMIT ? AHCI_PRDT_BYTE_LIMIT : segmentBytes;
+			if (prdBytes > byteCount - bytesDescribed) {
+				prdBytes = byteCount - bytesDescribed;
+			}
+			if (entries) {
+				Drivers::Storage::AHCI::PRDTEntry &entry = entries[prdCount];
+				entry.dataBase = (uint32_t)segmentPhyAddr;
+				if (bit64Addressing) {
+					entry.dataBaseUpper = (uint32_t)(segmentPhyAddr >> 32);
+				}
+				entry.byteCount = prdBytes - 1;
+			}
+			segmentPhyAddr += prdBytes;
+			segmentBytes -= prdBytes;
+			bytesDescribed += prdBytes;
+			++prdCount;
+		}
 	}
+	return bytesDescribed;
+}
+
+static void printDevice(const Drivers::Storage::AHCI::Device *device) {
+	terminalPrintString(atDeviceStr, strlen(atDeviceStr));
+	terminalPrintChar(' ');
+	terminalPrintHex(&device, sizeof(device));
+	terminalPrintChar('\n');
+}
+
+// Busy waits until done returns true or AHCI_PORT_RECOVERY_TIMEOUT passes
+// Returns false on timeout
+static bool waitFor(volatile Drivers::Storage::AHCI::Port *port, bool (*done)(volatile Drivers::Storage::AHCI::Port *port)) {
+	const uint64_t deadline = Kernel::Time::nowNs() + AHCI_PORT_RECOVERY_TIMEOUT;
+	while (!done(port)) {
+		if (Kernel::Time::nowNs() >= deadline) {
+			return false;
+		}
+		__builtin_ia32_pause();
+	}
+	return true;
 }
@@ -8,30 +8,47 @@ Drivers::Storage::AHCI::SataDevice::SataDevice(
 	this->type = Type::Sata;
 }
 
-Async::Thenable<Drivers::Storage::Buffer> Drivers::Storage::AHCI::SataDevice::read(size_t startBlock, size_t blockCount) {
-	Storage::Buffer buffer;
-	size_t freeSlot = SIZE_MAX;
-	if (!(buffer = this->setupRead(blockCount, freeSlot))) {
+Async::Thenable<Drivers::Storage::Buffer> Drivers::Storage::AHCI::SataDevice::read(
+	size_t startBlock,
+	size_t blockCount,
+	Async::CancellationToken *cancellation
+) {
+	if (blockCount == 0) {
 		co_return nullptr;
 	}
+	Storage::Buffer buffer = Storage::Buffer(blockCount * this->blockSize, AHCI_BUFFER_ALIGN_AT);
 
-	this->commandHeaders[freeSlot].atapi = 0;
+	// The buffer is read with as many commands as its PRDT entries need, one after another
+	for (size_t blocksRead = 0; blocksRead < blockCount;) {
+		size_t freeSlot = SIZE_MAX;
+		size_t partBlockCount = blockCount - blocksRead;
+		if (partBlockCount > AHCI_COMMAND_READ_DMA_EX_MAX_BLOCKS) {
+			partBlockCount = AHCI_COMMAND_READ_DMA_EX_MAX_BLOCKS;
+		}
+		if (!(partBlockCount = this->setupRead(buffer, blocksRead, partBlockCount, freeSlot))) {
+			co_return nullptr;
+		}
 
-	// Setup the command FIS
-	FIS::RegisterH2D *commandFis = (FIS::RegisterH2D*)&this->commandTables[freeSlot]->commandFIS;
-	commandFis->command = AHCI_COMMAND_READ_DMA_EX;
-	commandFis->lba0 = (uint8_t)startBlock;
-	commandFis->lba1 = (uint8_t)(startBlock >> 8);
-	commandFis->lba2 = (uint8_t)(startBlock >> 16);
-	commandFis->lba3 = (uint8_t)(startBlock >> 24);
-	commandFis->lba4 = (uint8_t)(startBlock >> 32);
-	commandFis->lba5 = (uint8_t)(startBlock >> 40);
-	commandFis->device = 1 << 6;	// 48-bit LBA mode
-	commandFis->countLow = (uint8_t)(blockCount & 0xff);
-	commandFis->countHigh = (uint8_t)((blockCount & 0xff00) >> 8);
+		this->commandHeaders[freeSlot].atapi = 0;
 
-	if (!co_await Command(this, freeSlot)) {
-		co_return nullptr;
+		// Setup the command FIS
+		const size_t partStartBlock = startBlock + blocksRead;
+		FIS::RegisterH2D *commandFis = (FIS::RegisterH2D*)&this->commandTables[freeSlot]->commandFIS;
+		commandFis->command = AHCI_COMMAND_READ_DMA_EX;
+		commandFis->lba0 = (uint8_t)partStartBlock;
+		commandFis->lba1 = (uint8_t)(partStartBlock >> 8);
+		commandFis->lba2 = (uint8_t)(partStartBlock >> 16);
+		commandFis->lba3 = (uint8_t)(partStartBlock >> 24);
+		commandFis->lba4 = (uint8_t)(partStartBlock >> 32);
+		commandFis->lba5 = (uint8_t)(partStartBlock >> 40);
+		commandFis->device = 1 << 6;	// 48-bit LBA mode
+		commandFis->countLow = (uint8_t)(partBlockCount & 0xff);
+		commandFis->countHigh = (uint8_t)((partBlockCount & 0xff00) >> 8);
+
+		if (!co_await Command(this, freeSlot, cancellation)) {
+			co_return nullptr;
+		}
+		blocksRead += partBlockCount;
 	}
 	co_return std::move(buffer);
 }
@@ -9,8 +9,11 @@ static const char* const bufAllocErrorStr = "could not allocate buffer";
 static const char* const wrongAlignStr = "wrong alignment";
 static const char* const freeFailStr = "operator=(nullptr) failed to free buffer pages";
 
-Drivers::Storage::Buffer::Buffer(std::nullptr_t) : data(nullptr), pageCount(0), physicalAddress(UINT64_MAX), size(0) {}
+Drivers::Storage::Buffer::Buffer(std::nullptr_t) : data(nullptr), pageCount(0), size(0) {}
 
+// Allocates a virtually contiguous buffer backed by physical pages that need not be contiguous
+// so that large buffers can be served regardless of physical memory fragmentation
+// DMA clients must describe the buffer to the device using its physical segments
 Drivers::Storage::Buffer::Buffer(size_t size, size_t alignAt) {
 	using namespace Kernel::Memory;
 
@@ -22,11 +25,12 @@ Drivers::Storage::Buffer::Buffer(size_t size, size_t alignAt) {
 	PageRequestResult requestResult = Virtual::requestPages(
 		this->pageCount,
 		(
-			RequestType::PhysicalContiguous |
+			RequestType::Kernel |
 			RequestType::VirtualContiguous |
 			RequestType::AllocatePhysical |
-			RequestType::CacheDisable
-		)
+			RequestType::Writable
+		),
+		&this->segments
 	);
 	if (requestResult.address == INVALID_ADDRESS || requestResult.allocatedCount != this->pageCount) {
 		terminalPrintString(bufferNamespaceStr, strlen(bufferNamespaceStr));
@@ -36,29 +40,25 @@ Drivers::Storage::Buffer::Buffer(size_t size, size_t alignAt) {
 	}
 	this->data = requestResult.address;
 
-	// Make sure buffer's physical address is aligned at correct boundary
-	Kernel::Memory::Virtual::CrawlResult crawlResult(this->data);
-	uint64_t physicalAddress = (uint64_t)crawlResult.physicalTables[0] + crawlResult.indexes[0];
-	if (
-		crawlResult.physicalTables[0] == INVALID_ADDRESS ||
-		physicalAddress % alignAt != 0
-	) {
-		terminalPrintString(bufferNamespaceStr, strlen(bufferNamespaceStr));
-		terminalPrintString(bufStr, strlen(bufStr));
-		terminalPrintString(wrongAlignStr, strlen(wrongAlignStr));
-		Kernel::panic();
+	// Make sure every physical segment is aligned at correct boundary
+	for (const auto &segment : this->segments) {
+		if ((uint64_t)segment.address % alignAt != 0) {
+			terminalPrintString(bufferNamespaceStr, strlen(bufferNamespaceStr));
+			terminalPrintString(bufStr, strlen(bufStr));
+			terminalPrintString(wrongAlignStr, strlen(wrongAlignStr));
+			Kernel::panic();
+		}
 	}
-	this->physicalAddress = physicalAddress;
 }
 
 Drivers::Storage::Buffer::Buffer(Buffer &&other)
 	:	data(other.data),
 		pageCount(other.pageCount),
-		physicalAddress(other.physicalAddress),
+		segments(std::move(other.segments)),
 		size(other.size) {
 	other.data = nullptr;
 	other.pageCount = other.size = 0;
-	other.physicalAddress = UINT64_MAX;
+	other.segments.clear();
 }
 
 Drivers::Storage::Buffer::~Buffer() {
@@ -79,7 +79,7 @@ Drivers::Storage::Buffer& Drivers::Storage::Buffer::operator=(std::nullptr_t) {
 	}
 	this->data = nullptr;
 	this->pageCount = this->size = 0;
-	this->physicalAddress = UINT64_MAX;
+	this->segments.clear();
 	return *this;
 }
 
@@ -87,11 +87,11 @@ Drivers::Storage::Buffer& Drivers::Storage::Buffer::operator=(Buffer &&other) {
 	*this = nullptr;
 	this->data = other.data;
 	this->pageCount = other.pageCount;
-	this->physicalAddress = other.physicalAddress;
+	this->segments = std::move(other.segments);
 	this->size = other.size;
 	other.data = nullptr;
 	other.pageCount = other.size = 0;
-	other.physicalAddress = UINT64_MAX;
+	other.segments.clear();
 	return *this;
 }
 
@@ -107,6 +107,6 @@ Drivers::Storage::Buffer::operator bool() const {
 	return this->data != nullptr;
 }
 
-uint64_t Drivers::Storage::Buffer::getPhysicalAddress() const {
-	return this->physicalAddress;
+const Kernel::Memory::PhysicalSegmentList& Drivers::Storage::Buffer::getSegments() const {
+	return this->segments;
 }
@@ -8,3 +8,6 @@ $(BUILD_DIR)/drivers/timers/%.o: $(SRC_DIR)/drivers/timers/%.asm
 
 $(BUILD_DIR)/drivers/timers/%.o: $(SRC_DIR)/drivers/timers/%.cpp $(HEADER_FILES)
 	$(CC64) -o $@ -c $< $(C_WARNINGS) $(CC64_FLAGS)
+
+# Runs behind the interrupt entry in idt64.asm that does not save the SSE registers
+$(BUILD_DIR)/drivers/timers/hpet.o: CC64_FLAGS += $(INTERRUPT_CONTEXT_FLAGS)
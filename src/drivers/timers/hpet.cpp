@@ -1,21 +1,21 @@
-#include <apic.h>
 #include <commonstrings.h>
 #include <cstring>
 #include <drivers/timers/hpet.h>
+#include <kernel.h>
 #include <terminal.h>
 
 static const char* const initHpetStr = "Initializing HPET";
 static const char* const initHpetCompleteStr = "HPET initialized\n";
 static const char* const mappingStr = "Mapping HPET registers to kernel address space";
 static const char* const check64Str = "Checking clock period and 64-bit capability";
-static const char* const periodicTimerStr = "Checking for 64-bit capable edge-triggered periodic timer";
 static const char* const minTickStr = "Minimum tick ";
 static const char* const timerCountStr = ", Timers [";
-static const char* const hpetStr = "hpet";
 
 Drivers::Timers::HPET::Registers *Drivers::Timers::HPET::registers = nullptr;
-Drivers::Timers::HPET::Timer *Drivers::Timers::HPET::periodicTimer = nullptr;
-void (*Drivers::Timers::HPET::timerInterruptCallback)() = nullptr;
+
+// 32.32 fixed point conversion factors between main counter ticks and nanoseconds
+static uint64_t nanosecondsPerTick = 0;
+static uint64_t ticksPerNanosecond = 0;
 
 bool Drivers::Timers::HPET::initialize() {
 	using namespace Kernel::Memory;
@@ -81,42 +81,36 @@ bool Drivers::Timers::HPET::initialize() {
 	terminalPrintChar(']');
 	terminalPrintChar('\n');
 
-	// Find at least one timer with 64-bit and periodic interrupt capability
-	terminalPrintSpaces4();
-	terminalPrintSpaces4();
-	terminalPrintString(periodicTimerStr, strlen(periodicTimerStr));
-	terminalPrintString(ellipsisStr, strlen(ellipsisStr));
-	for (size_t i = 0; i < (size_t)registers->timerCount + 1; ++i) {
-		if (
-			registers->timers[i].bit64Capable &&
-			!registers->timers[i].interruptType &&
-			registers->timers[i].periodicCapable
-		) {
-			periodicTimer = &registers->timers[i];
-			break;
-		}
-	}
-	if (!periodicTimer) {
-		terminalPrintString(notStr, strlen(notStr));
-		terminalPrintChar(' ');
-		terminalPrintString(presentStr, strlen(presentStr));
-		terminalPrintChar('\n');
-		return false;
-	}
-	terminalPrintString(presentStr, strlen(presentStr));
-	terminalPrintChar('\n');
+	// period is in femtoseconds
+	nanosecondsPerTick = ((uint64_t)registers->period << 32) / 1000000;
+	ticksPerNanosecond = (1000000UL << 32) / registers->period;
+
+	// Only the main counter is used, its comparators are left disabled
+	// HPET registers must be written at 8-byte boundaries hence setting the bit fields directly is not possible
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+	uint64_t *configure = (uint64_t*)(void*)registers;
+	configure[2] |= 1;
+	#pragma GCC diagnostic pop
 
 	terminalPrintSpaces4();
 	terminalPrintString(initHpetCompleteStr, strlen(initHpetCompleteStr));
 	return true;
 }
 
-void hpetHandler() {
-	if (Drivers::Timers::HPET::timerInterruptCallback) {
-		Drivers::Timers::HPET::timerInterruptCallback();
-	} else {
-		// TODO: remove this unused HPET interrupt
-		terminalPrintString(hpetStr, strlen(hpetStr));
-	}
-	APIC::acknowledgeLocalInterrupt();
+// Converts a duration in nanoseconds to HPET main counter ticks
+uint64_t Drivers::Timers::HPET::nanosecondsToTicks(uint64_t nanoseconds) {
+	return (uint64_t)(((unsigned __int128)nanoseconds * ticksPerNanosecond) >> 32);
+}
+
+// Converts HPET main counter ticks to a duration in nanoseconds
+uint64_t Drivers::Timers::HPET::ticksToNanoseconds(uint64_t ticks) {
+	return (uint64_t)(((unsigned __int128)ticks * nanosecondsPerTick) >> 32);
+}
+
+uint64_t Drivers::Timers::HPET::readCounter() {
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+	return *(volatile uint64_t*)&registers->mainCounterValue;
+	#pragma GCC diagnostic pop
 }
@@ -1,9 +1,13 @@
 #pragma once
 
 #include <kernel.h>
+#include <pcie.h>
 
 #define IOAPIC_READTBL_LOW(n) (0x10 + 2 * n)
 #define IOAPIC_READTBL_HIGH(n) (0x10 + 2 * n + 1)
+#define APIC_MSI_ADDRESS_BASE 0xfee00000
+#define APIC_MSI_DESTINATION_SHIFT 12
+#define APIC_TIMER_CALIBRATION_TIME 10000000
 
 namespace APIC {
 	enum EntryType : uint8_t {
@@ -77,6 +81,10 @@ namespace APIC {
 	};
 
 	struct CPU {
+		// Used by getCurrentCpu and the assembly in tasksasm.asm, keep them first
+		CPU *self = nullptr;	// read through the GS base, see setCurrentCpu
+		void *syscallStack = nullptr;	// top of the kernel stack of the running user task
+		void *userStackPointer = nullptr;	// scratch space for syscallEntry
 		uint32_t apicId = UINT32_MAX;
 		uint32_t flags = UINT32_MAX;
 		uint64_t apicPhyAddr = UINT64_MAX;
@@ -84,6 +92,43 @@ namespace APIC {
 		InterruptDataZone *intZone1 = nullptr;
 		InterruptDataZone *intZone2 = nullptr;
 		void *rsp = nullptr;
+		Kernel::Memory::Virtual::PageTablePool pageTablePool;
+		Kernel::Scheduler::RunQueue *runQueue = nullptr;
+		Kernel::Scheduler::TimerWheel *timerWheel = nullptr;
+		Kernel::Scheduler::DeferredWork *deferredWork = nullptr;	// pushed by interrupt handlers of this CPU
+		bool tscDeadline = false;
+		uint64_t timerFrequency = 0;	// in Hz, of the TSC when tscDeadline is true else of the local APIC timer
+		uint64_t timerTicksPerNanosecond = 0;	// 32.32 fixed point
+		Kernel::Threads::Thread *currentThread = nullptr;
+		Kernel::Threads::Thread *readyThreads = nullptr;
+		Kernel::Threads::Thread *readyThreadsTail = nullptr;
+		void *dispatchStackPointer = nullptr;	// of the dispatch loop while a thread runs
+		uint64_t sliceEnd = 0;	// Time::nowNs() at which the running thread is preempted
+		uint64_t wheelDeadline = 0;	// Time::nowNs() at which the timer wheel needs the CPU timer, 0 if it does not
+		uint32_t preemptionDisabled = 0;
+		size_t routedInterrupts = 0;	// InterruptRoutes targeting this CPU
+		bool online = false;	// set by setCurrentCpu, the CPU can take IPIs from then on
+		uint64_t tlbFlushRequests = 0;	// incremented by CPUs that need this CPU's TLB flushed
+		uint64_t tlbFlushesDone = 0;	// tlbFlushRequests as seen by this CPU's latest flush
+	};
+
+	// Steers an IOAPIC pin, an MSI capability, or an MSI-X table entry at a vector from IDT::allocateVector on one CPU
+	// Set up by routeIrq, routeMsi, or routeMsix and must stay in place until unroute
+	struct InterruptRoute {
+		enum Type : uint8_t {
+			None = 0,
+			Irq,
+			Msi,
+			Msix
+		};
+
+		InterruptRoute *next = nullptr;
+		Type type = Type::None;
+		uint8_t vector = 0;
+		Kernel::IRQ irq = (Kernel::IRQ)0;
+		PCIe::MSICapability *msi = nullptr;
+		volatile PCIe::MSIXTableEntry *msixEntry = nullptr;
+		CPU *cpu = nullptr;
 	};
 
 	extern CPU *bootCpu;
@@ -92,13 +137,35 @@ namespace APIC {
 	extern std::vector<IOEntry> ioEntries;
 
 	extern void acknowledgeLocalInterrupt();
+	extern CPU* findCpu(uint32_t apicId);
+	extern CPU* getCurrentCpu();
+	extern bool initializeTimer();
 	extern bool parse();
+	extern void rebalanceInterrupts();
+	extern void sendIpi(const CPU &cpu, uint8_t vector);
+	extern bool routeIrq(InterruptRoute &route, Kernel::IRQ irq, uint8_t vector, CPU *cpu = nullptr);
+	extern bool routeMsi(InterruptRoute &route, PCIe::MSICapability *msi, uint8_t vector, CPU *cpu = nullptr);
+	extern bool routeMsix(
+		InterruptRoute &route,
+		volatile PCIe::MSIXTableEntry *entry,
+		uint8_t vector,
+		CPU *cpu = nullptr
+	);
+	extern bool setAffinity(InterruptRoute &route, CPU *cpu);
+	extern void unroute(InterruptRoute &route);
 	extern uint32_t readIo(const uint8_t offset);
 	extern IORedirectionEntry readIoRedirectionEntry(const Kernel::IRQ irq);
+	extern void setCurrentCpu(CPU *cpu);
+	extern void setTimerDeadline(uint64_t nanoseconds);
+	extern void stopTimer();
 	extern void writeIo(const uint8_t offset, const uint32_t value);
 	extern void writeIoRedirectionEntry(const Kernel::IRQ irq, const IORedirectionEntry entry);
 
 	// apicasm.asm
 	extern "C" void disableLegacyPic();
 	extern "C" bool enableX2Apic();
+	extern "C" bool isTscDeadlineSupported();
 }
+
+// apic.cpp
+void apicTimerHandler(void*, Kernel::Threads::InterruptFrame *frame);
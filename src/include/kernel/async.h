@@ -3,6 +3,8 @@
 #include <atomic>
 #include <kernel.h>
 #include <terminal.h>
+#include <tuple>
+#include <vector>
 
 namespace Async {
 	class Spinlock {
@@ -14,41 +16,205 @@ namespace Async {
 			void unlock();
 	};
 
+	// Also keeps interrupts disabled on the holding CPU, so neither an interrupt handler nor preemption
+	// can run code on that CPU that spins on the lock or sees the state it guards half updated
+	// The interrupt flag of the holder is restored by unlock
+	class InterruptSafeSpinlock {
+		private:
+			Spinlock spinlock;
+			bool interruptsEnabled = false;
+
+		public:
+			void lock();
+			void unlock();
+	};
+
+	// Bounded multi-producer multi-consumer queue with preallocated slots
+	// Every slot carries a sequence number that tells producers and consumers whose turn it is
+	// so push and pop never lock or allocate and can be called from interrupt context on any CPU
+	template<typename T, size_t Capacity>
+	class BoundedQueue {
+		static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "BoundedQueue capacity must be a power of 2");
+
+		private:
+			struct Slot {
+				std::atomic<size_t> sequence;
+				T value;
+			};
+
+			Slot slots[Capacity];
+			alignas(64) std::atomic<size_t> pushPosition;
+			alignas(64) std::atomic<size_t> popPosition;
+
+		public:
+			BoundedQueue() noexcept : pushPosition(0), popPosition(0) {
+				for (size_t i = 0; i < Capacity; ++i) {
+					this->slots[i].sequence.store(i, std::memory_order_relaxed);
+				}
+			}
+
+			BoundedQueue(const BoundedQueue&) = delete;
+			BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+			// Returns false if the queue is full
+			[[nodiscard]] bool push(const T &value) noexcept {
+				size_t position = this->pushPosition.load(std::memory_order_relaxed);
+				Slot *slot;
+				while (true) {
+					slot = &this->slots[position & (Capacity - 1)];
+					const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+					const intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+					if (difference == 0) {
+						if (this->pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+							break;
+						}
+					} else if (difference < 0) {
+						return false;
+					} else {
+						position = this->pushPosition.load(std::memory_order_relaxed);
+					}
+				}
+				slot->value = value;
+				slot->sequence.store(position + 1, std::memory_order_release);
+				return true;
+			}
+
+			// Only a snapshot since other CPUs may push or pop right after
+			// A stale pop position is reported as not empty so callers recheck instead of sleeping
+			bool isEmpty() const noexcept {
+				const size_t position = this->popPosition.load(std::memory_order_relaxed);
+				const size_t sequence = this->slots[position & (Capacity - 1)].sequence.load(std::memory_order_acquire);
+				return (intptr_t)sequence - (intptr_t)(position + 1) < 0;
+			}
+
+			// Number of values in the queue, only a snapshot like isEmpty
+			size_t getSize() const noexcept {
+				const size_t popPosition = this->popPosition.load(std::memory_order_relaxed);
+				const size_t pushPosition = this->pushPosition.load(std::memory_order_relaxed);
+				return pushPosition > popPosition ? pushPosition - popPosition : 0;
+			}
+
+			// Returns false if the queue is empty
+			[[nodiscard]] bool pop(T &value) noexcept {
+				size_t position = this->popPosition.load(std::memory_order_relaxed);
+				Slot *slot;
+				while (true) {
+					slot = &this->slots[position & (Capacity - 1)];
+					const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+					const intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+					if (difference == 0) {
+						if (this->popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+							break;
+						}
+					} else if (difference < 0) {
+						return false;
+					} else {
+						position = this->popPosition.load(std::memory_order_relaxed);
+					}
+				}
+				value = slot->value;
+				slot->sequence.store(position + Capacity, std::memory_order_release);
+				return true;
+			}
+	};
+
 	template<typename T>
 	class ThenablePromise;
 
 	template<typename T>
 	class Thenable;
 
-	template<typename T>
-	class ThenablePromise {
+	// Links a coroutine awaiting a thenable into the thenable's promise
+	// Lives in the awaiter inside the awaiting coroutine's frame so awaiting never allocates
+	// Nodes with a callback are notified from the finishing coroutine instead of resuming anything
+	struct AwaitingNode {
+		std::coroutine_handle<> coroutine = nullptr;
+		AwaitingNode *next = nullptr;
+		void (*callback)(AwaitingNode &node) = nullptr;
+		void *context = nullptr;
+	};
+
+	// Interrupt gates clear IF so a CPU running with interrupts disabled is treated as being in an interrupt handler
+	inline bool inInterruptContext() noexcept {
+		return !(__builtin_ia32_readeflags_u64() & (1 << 9));
+	}
+
+	class ThenablePromiseBase {
 		private:
-			std::vector<std::coroutine_handle<>> awaitingCoroutines;
+			// Usually a single node, more than one only when several coroutines await the same thenable
+			// Swapped for finishedMarker when the coroutine finishes so late awaiters on other CPUs see it
+			std::atomic<AwaitingNode*> awaitingNodes = nullptr;
+			static inline AwaitingNode finishedMarker;
+			// Held by the running coroutine and by its Thenable, the frame is destroyed when both let go
+			std::atomic<uint8_t> references = 2;
+
+			// Suspends the finished coroutine and transfers control straight to an awaiting coroutine
+			// instead of resuming it on top of the current stack so that long chains run in constant stack
+			// Remaining awaiting coroutines, or all of them in interrupt context, are handed to the scheduler
+			class FinalAwaiter {
+				public:
+					bool await_ready() const noexcept {
+						return false;
+					}
+
+					template<typename Promise>
+					std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept {
+						ThenablePromiseBase &promise = finished.promise();
+						const bool deferAll = inInterruptContext();
+						std::coroutine_handle<> next = std::noop_coroutine();
+						bool transferring = false;
+						AwaitingNode *node = promise.awaitingNodes.exchange(&finishedMarker, std::memory_order_acq_rel);
+						while (node) {
+							// The node goes away with its coroutine's frame once resumed
+							AwaitingNode *nextNode = node->next;
+							if (node->callback) {
+								node->callback(*node);
+								node = nextNode;
+								continue;
+							}
+							std::coroutine_handle<> awaitingCoroutine = node->coroutine;
+							if (!awaitingCoroutine || awaitingCoroutine.done()) {
+								terminalPrintString("\nAttempted to resume an invalid coroutine handle\n", 49);
+								Kernel::panic();
+							}
+							if (!deferAll && !transferring) {
+								next = awaitingCoroutine;
+								transferring = true;
+							} else {
+								Kernel::Scheduler::queueEvent(awaitingCoroutine);
+							}
+							node = nextNode;
+						}
+						if (promise.release()) {
+							finished.destroy();
+						}
+						return next;
+					}
+
+					void await_resume() const noexcept {}
+			};
+
+		protected:
 			bool done = false;
-			T result;
 
 		public:
-			void addAwaitingCoroutine(std::coroutine_handle<> awaitingCoroutine) noexcept {
-				this->awaitingCoroutines.push_back(awaitingCoroutine);
-			}
-
-			Thenable<T> get_return_object() noexcept {
-				return Thenable<T>(std::coroutine_handle<ThenablePromise<T>>::from_promise(*this));
+			// Returns false if the coroutine has already finished and the node will never be notified
+			bool addAwaitingCoroutine(AwaitingNode &node) noexcept {
+				AwaitingNode *head = this->awaitingNodes.load(std::memory_order_acquire);
+				do {
+					if (head == &finishedMarker) {
+						return false;
+					}
+					node.next = head;
+				} while (!this->awaitingNodes.compare_exchange_weak(head, &node, std::memory_order_release, std::memory_order_acquire));
+				return true;
 			}
 
 			std::suspend_never initial_suspend() noexcept {
 				return {};
 			}
 
-			std::suspend_never final_suspend() noexcept {
-				for (const auto &awaitingCoroutine : this->awaitingCoroutines) {
-					if (awaitingCoroutine && !awaitingCoroutine.done()) {
-						awaitingCoroutine.resume();
-					} else {
-						terminalPrintString("\nAttempted to resume an invalid coroutine handle\n", 49);
-						Kernel::panic();
-					}
-				}
+			FinalAwaiter final_suspend() noexcept {
 				return {};
 			}
 
@@ -60,6 +226,22 @@ namespace Async {
 				return this->done;
 			}
 
+			// Returns true if the caller held the last reference and must destroy the frame
+			bool release() noexcept {
+				return this->references.fetch_sub(1, std::memory_order_acq_rel) == 1;
+			}
+	};
+
+	template<typename T>
+	class ThenablePromise : public ThenablePromiseBase {
+		private:
+			T result;
+
+		public:
+			Thenable<T> get_return_object() noexcept {
+				return Thenable<T>(std::coroutine_handle<ThenablePromise<T>>::from_promise(*this));
+			}
+
 			void return_value(T &&value) noexcept {
 				this->result = std::move(value);
 				this->done = true;
@@ -75,42 +257,10 @@ namespace Async {
 	};
 
 	template<>
-	class ThenablePromise<void> {
-		private:
-			std::vector<std::coroutine_handle<>> awaitingCoroutines;
-			bool done = false;
-
+	class ThenablePromise<void> : public ThenablePromiseBase {
 		public:
-			void addAwaitingCoroutine(std::coroutine_handle<> awaitingCoroutine) noexcept {
-				this->awaitingCoroutines.push_back(awaitingCoroutine);
-			}
-
 			Thenable<void> get_return_object() noexcept;
 
-			std::suspend_never initial_suspend() noexcept {
-				return {};
-			}
-
-			std::suspend_never final_suspend() noexcept {
-				for (const auto &awaitingCoroutine : this->awaitingCoroutines) {
-					if (awaitingCoroutine && !awaitingCoroutine.done()) {
-						awaitingCoroutine.resume();
-					} else {
-						terminalPrintString("\nAttempted to resume an invalid coroutine handle\n", 49);
-						Kernel::panic();
-					}
-				}
-				return {};
-			}
-
-			[[noreturn]] void unhandled_exception() noexcept {
-				Kernel::panic();
-			}
-
-			bool isDone() noexcept {
-				return this->done;
-			}
-
 			void return_void() noexcept {
 				this->done = true;
 			}
@@ -121,6 +271,43 @@ namespace Async {
 		private:
 			std::coroutine_handle<ThenablePromise<T>> coroutineHandle;
 
+			// The coroutine frame outlives the Thenable if the coroutine is still running
+			void release() noexcept {
+				if (this->coroutineHandle && this->coroutineHandle.promise().release()) {
+					this->coroutineHandle.destroy();
+				}
+				this->coroutineHandle = nullptr;
+			}
+
+			// Every co_await gets its own awaiter and hence its own node in the promise's awaiting list
+			// Awaiting an rvalue thenable moves the result out
+			template<bool moveResult>
+			class [[nodiscard]] Awaiter {
+				private:
+					std::coroutine_handle<ThenablePromise<T>> coroutineHandle;
+					AwaitingNode node;
+
+				public:
+					explicit Awaiter(std::coroutine_handle<ThenablePromise<T>> coroutineHandle) noexcept : coroutineHandle(coroutineHandle) {}
+
+					bool await_ready() const noexcept {
+						return this->coroutineHandle.promise().isDone();
+					}
+
+					bool await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+						this->node.coroutine = awaitingCoroutine;
+						return this->coroutineHandle.promise().addAwaitingCoroutine(this->node);
+					}
+
+					std::conditional_t<moveResult, T&&, T&> await_resume() const noexcept {
+						if constexpr (moveResult) {
+							return std::move(this->coroutineHandle.promise().getResult());
+						} else {
+							return this->coroutineHandle.promise().getResult();
+						}
+					}
+			};
+
 		public:
 			using promise_type = ThenablePromise<T>;
 
@@ -133,28 +320,36 @@ namespace Async {
 			}
 
 			Thenable& operator=(Thenable &&other) noexcept {
-				this->coroutineHandle = other.coroutineHandle;
-				other.coroutineHandle = nullptr;
+				if (this != &other) {
+					this->release();
+					this->coroutineHandle = other.coroutineHandle;
+					other.coroutineHandle = nullptr;
+				}
 				return *this;
 			}
 
 			Thenable(const Thenable&) = delete;
 			Thenable& operator=(const Thenable&) = delete;
 
+			~Thenable() {
+				this->release();
+			}
+
 			bool await_ready() const noexcept {
 				return this->coroutineHandle.promise().isDone();
 			}
 
-			void await_suspend(std::coroutine_handle<> awaitingCoroutine) {
-				this->coroutineHandle.promise().addAwaitingCoroutine(awaitingCoroutine);
+			// Registers a node to be notified when the thenable finishes, false if it already has
+			bool addAwaitingNode(AwaitingNode &node) const noexcept {
+				return this->coroutineHandle.promise().addAwaitingCoroutine(node);
 			}
 
-			T& await_resume() const & noexcept {
-				return this->coroutineHandle.promise().getResult();
+			Awaiter<false> operator co_await() const & noexcept {
+				return Awaiter<false>(this->coroutineHandle);
 			}
 
-			T&& await_resume() const && noexcept {
-				return std::move(this->coroutineHandle.promise().getResult());
+			Awaiter<true> operator co_await() const && noexcept {
+				return Awaiter<true>(this->coroutineHandle);
 			}
 
 			template<typename ThenT>
@@ -189,6 +384,35 @@ namespace Async {
 		private:
 			std::coroutine_handle<ThenablePromise<void>> coroutineHandle;
 
+			// The coroutine frame outlives the Thenable if the coroutine is still running
+			void release() noexcept {
+				if (this->coroutineHandle && this->coroutineHandle.promise().release()) {
+					this->coroutineHandle.destroy();
+				}
+				this->coroutineHandle = nullptr;
+			}
+
+			// Every co_await gets its own awaiter and hence its own node in the promise's awaiting list
+			class [[nodiscard]] Awaiter {
+				private:
+					std::coroutine_handle<ThenablePromise<void>> coroutineHandle;
+					AwaitingNode node;
+
+				public:
+					explicit Awaiter(std::coroutine_handle<ThenablePromise<void>> coroutineHandle) noexcept : coroutineHandle(coroutineHandle) {}
+
+					bool await_ready() const noexcept {
+						return this->coroutineHandle.promise().isDone();
+					}
+
+					bool await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+						this->node.coroutine = awaitingCoroutine;
+						return this->coroutineHandle.promise().addAwaitingCoroutine(this->node);
+					}
+
+					void await_resume() const noexcept {}
+			};
+
 		public:
 			using promise_type = ThenablePromise<void>;
 
@@ -201,23 +425,33 @@ namespace Async {
 			}
 
 			Thenable& operator=(Thenable &&other) noexcept {
-				this->coroutineHandle = other.coroutineHandle;
-				other.coroutineHandle = nullptr;
+				if (this != &other) {
+					this->release();
+					this->coroutineHandle = other.coroutineHandle;
+					other.coroutineHandle = nullptr;
+				}
 				return *this;
 			}
 
 			Thenable(const Thenable&) = delete;
 			Thenable& operator=(const Thenable&) = delete;
 
+			~Thenable() {
+				this->release();
+			}
+
 			bool await_ready() const noexcept {
 				return this->coroutineHandle.promise().isDone();
 			}
 
-			void await_suspend(std::coroutine_handle<> awaitingCoroutine) {
-				this->coroutineHandle.promise().addAwaitingCoroutine(awaitingCoroutine);
+			// Registers a node to be notified when the thenable finishes, false if it already has
+			bool addAwaitingNode(AwaitingNode &node) const noexcept {
+				return this->coroutineHandle.promise().addAwaitingCoroutine(node);
 			}
 
-			void await_resume() const noexcept {}
+			Awaiter operator co_await() const noexcept {
+				return Awaiter(this->coroutineHandle);
+			}
 
 			template<typename ThenT>
 			Thenable<ThenT> then(Thenable<ThenT> (*func)()) & noexcept {
@@ -236,4 +470,511 @@ namespace Async {
 	inline Thenable<void> ThenablePromise<void>::get_return_object() noexcept {
 		return Thenable<void>(std::coroutine_handle<ThenablePromise<void>>::from_promise(*this));
 	}
+
+	// Awaitable that resumes the awaiting coroutine after given nanoseconds
+	// The timer lives in the awaiting coroutine's frame so sleeping does not allocate
+	class [[nodiscard]] SleepAwaiter {
+		private:
+			Kernel::Scheduler::Timer timer;
+			uint64_t nanoseconds;
+
+		public:
+			explicit SleepAwaiter(uint64_t nanoseconds) noexcept : nanoseconds(nanoseconds) {}
+
+			bool await_ready() const noexcept {
+				return this->nanoseconds == 0;
+			}
+
+			void await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+				this->timer.event = awaitingCoroutine;
+				Kernel::Scheduler::addTimer(this->timer, this->nanoseconds);
+			}
+
+			void await_resume() const noexcept {}
+	};
+
+	inline SleepAwaiter sleepFor(uint64_t nanoseconds) noexcept {
+		return SleepAwaiter(nanoseconds);
+	}
+
+	// FIFO of suspended coroutines, callers guard it with the owning primitive's spinlock
+	struct WaitList {
+		AwaitingNode *head = nullptr;
+		AwaitingNode *tail = nullptr;
+
+		bool empty() const noexcept {
+			return this->head == nullptr;
+		}
+
+		void push(AwaitingNode &node) noexcept {
+			node.next = nullptr;
+			if (this->tail) {
+				this->tail->next = &node;
+			} else {
+				this->head = &node;
+			}
+			this->tail = &node;
+		}
+
+		AwaitingNode* pop() noexcept {
+			AwaitingNode *node = this->head;
+			if (node) {
+				this->head = node->next;
+				if (!this->head) {
+					this->tail = nullptr;
+				}
+			}
+			return node;
+		}
+
+		AwaitingNode* takeAll() noexcept {
+			AwaitingNode *node = this->head;
+			this->head = this->tail = nullptr;
+			return node;
+		}
+	};
+
+	// Counting semaphore whose waiters suspend instead of spinning
+	// count is permits left minus coroutines waiting so uncontended acquire and release are one atomic op each
+	// A release that races a waiter which has not queued itself yet is parked in pendingWakeups
+	class Semaphore {
+		private:
+			std::atomic<int64_t> count;
+			Spinlock waitLock;
+			WaitList waiters;
+			size_t pendingWakeups = 0;
+
+		public:
+			class [[nodiscard]] Awaiter {
+				private:
+					Semaphore &semaphore;
+					AwaitingNode node;
+
+				public:
+					explicit Awaiter(Semaphore &semaphore) noexcept : semaphore(semaphore) {}
+					bool await_ready() noexcept;
+					bool await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept;
+					void await_resume() const noexcept {}
+			};
+
+			explicit Semaphore(int64_t permits) noexcept : count(permits) {}
+			Semaphore(const Semaphore&) = delete;
+			Semaphore& operator=(const Semaphore&) = delete;
+
+			Awaiter acquire() noexcept {
+				return Awaiter(*this);
+			}
+			bool tryAcquire() noexcept;
+			void release() noexcept;
+	};
+
+	// Coroutine mutex, unlock hands ownership straight to the longest waiting coroutine
+	class Mutex {
+		private:
+			Semaphore semaphore{1};
+
+		public:
+			Semaphore::Awaiter lock() noexcept {
+				return this->semaphore.acquire();
+			}
+
+			bool tryLock() noexcept {
+				return this->semaphore.tryAcquire();
+			}
+
+			void unlock() noexcept {
+				this->semaphore.release();
+			}
+	};
+
+	// Manual reset event, every waiter is resumed when it is set and stays resumed until it is reset
+	class Event {
+		private:
+			std::atomic<bool> signalled = false;
+			Spinlock waitLock;
+			WaitList waiters;
+
+		public:
+			class [[nodiscard]] Awaiter {
+				private:
+					Event &event;
+					AwaitingNode node;
+
+				public:
+					explicit Awaiter(Event &event) noexcept : event(event) {}
+
+					bool await_ready() const noexcept {
+						return this->event.isSet();
+					}
+
+					bool await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept;
+					void await_resume() const noexcept {}
+			};
+
+			Event() = default;
+			Event(const Event&) = delete;
+			Event& operator=(const Event&) = delete;
+
+			bool isSet() const noexcept {
+				return this->signalled.load(std::memory_order_acquire);
+			}
+
+			Awaiter wait() noexcept {
+				return Awaiter(*this);
+			}
+			void set() noexcept;
+			void reset() noexcept;
+	};
+
+	// Readers-writer lock for coroutines, any number of readers or a single writer
+	// state holds the reader count, the writer bit and a bit telling unlockers to take the slow path
+	// Waiting writers stop new readers from entering so writers are not starved
+	class RWLock {
+		private:
+			static constexpr uint64_t writerBit = 1ull << 63;
+			static constexpr uint64_t waitersBit = 1ull << 62;
+			static constexpr uint64_t readersMask = waitersBit - 1;
+
+			std::atomic<uint64_t> state = 0;
+			Spinlock waitLock;
+			WaitList waitingReaders;
+			WaitList waitingWriters;
+
+			bool enqueue(AwaitingNode &node, bool exclusive) noexcept;
+			void wakeWaiters() noexcept;
+
+		public:
+			template<bool exclusive>
+			class [[nodiscard]] Awaiter {
+				private:
+					RWLock &rwLock;
+					AwaitingNode node;
+
+				public:
+					explicit Awaiter(RWLock &rwLock) noexcept : rwLock(rwLock) {}
+
+					bool await_ready() noexcept {
+						return exclusive ? this->rwLock.tryLock() : this->rwLock.tryLockShared();
+					}
+
+					bool await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+						this->node.coroutine = awaitingCoroutine;
+						return this->rwLock.enqueue(this->node, exclusive);
+					}
+
+					void await_resume() const noexcept {}
+			};
+
+			RWLock() = default;
+			RWLock(const RWLock&) = delete;
+			RWLock& operator=(const RWLock&) = delete;
+
+			Awaiter<true> lock() noexcept {
+				return Awaiter<true>(*this);
+			}
+
+			Awaiter<false> lockShared() noexcept {
+				return Awaiter<false>(*this);
+			}
+
+			bool tryLock() noexcept;
+			bool tryLockShared() noexcept;
+			void unlock() noexcept;
+			void unlockShared() noexcept;
+	};
+
+	// Passed to an operation so that the code that started it can call it off
+	// The operation subscribes a node whose callback runs on the CPU calling cancel while the token is locked,
+	// so the callback must be short and must not use the token, and once unsubscribe returns it is not running
+	// Not meant for interrupt context
+	class CancellationToken {
+		private:
+			std::atomic<bool> cancelled = false;
+			Spinlock lock;
+			AwaitingNode *subscribers = nullptr;
+
+		public:
+			CancellationToken() = default;
+			CancellationToken(const CancellationToken&) = delete;
+			CancellationToken& operator=(const CancellationToken&) = delete;
+
+			bool isCancelled() const noexcept {
+				return this->cancelled.load(std::memory_order_acquire);
+			}
+
+			void cancel() noexcept;
+			[[nodiscard]] bool subscribe(AwaitingNode &node) noexcept;
+			void unsubscribe(AwaitingNode &node) noexcept;
+	};
+
+	// Requeues the awaiting coroutine at given priority which the events it queues from then on inherit
+	// Lets a coroutine raise its priority or step aside for more urgent events
+	class [[nodiscard]] RescheduleAwaiter {
+		private:
+			Kernel::Scheduler::Priority priority;
+
+		public:
+			explicit RescheduleAwaiter(Kernel::Scheduler::Priority priority) noexcept : priority(priority) {}
+
+			bool await_ready() const noexcept {
+				return false;
+			}
+
+			void await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+				Kernel::Scheduler::queueEvent(awaitingCoroutine, this->priority);
+			}
+
+			void await_resume() const noexcept {}
+	};
+
+	inline RescheduleAwaiter reschedule(Kernel::Scheduler::Priority priority) noexcept {
+		return RescheduleAwaiter(priority);
+	}
+
+	// Shared by withTimeout, the node it leaves in the thenable's awaiting list and the timeout timer
+	// Whoever settles first resumes the waiter, the last one of the three to let go deletes it
+	struct TimeoutState {
+		std::atomic<uint8_t> references = 3;
+		std::atomic<bool> settled = false;
+		bool completed = false;
+		std::coroutine_handle<> waiter = nullptr;
+		Kernel::Scheduler::Timer timer;
+		AwaitingNode node;
+
+		void release() noexcept {
+			if (this->references.fetch_sub(1) == 1) {
+				delete this;
+			}
+		}
+
+		void settle(bool completed) noexcept {
+			if (!this->settled.exchange(true)) {
+				this->completed = completed;
+				Kernel::Scheduler::queueEvent(this->waiter);
+			}
+		}
+
+		// Called by the thenable's FinalAwaiter, the thenable may already be dropped by the caller
+		// so nothing here touches its result
+		static void finished(AwaitingNode &node) noexcept {
+			TimeoutState *state = (TimeoutState*)node.context;
+			state->settle(true);
+			// Timer wheels are not locked in interrupt context, the timer then fires as usual and finds the state settled
+			if (!inInterruptContext() && Kernel::Scheduler::cancelTimer(state->timer)) {
+				state->release();
+			}
+			state->release();
+		}
+
+		static void timedOut(Kernel::Scheduler::Timer &timer) noexcept {
+			TimeoutState *state = (TimeoutState*)timer.context;
+			state->settle(false);
+			state->release();
+		}
+	};
+
+	template<typename T>
+	class [[nodiscard]] TimeoutAwaiter {
+		private:
+			TimeoutState *state;
+			const Thenable<T> &thenable;
+			uint64_t nanoseconds;
+
+		public:
+			TimeoutAwaiter(TimeoutState *state, const Thenable<T> &thenable, uint64_t nanoseconds) noexcept
+				: state(state), thenable(thenable), nanoseconds(nanoseconds) {}
+
+			bool await_ready() const noexcept {
+				return false;
+			}
+
+			void await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+				// The waiter must be known before either the timer or the thenable can settle
+				this->state->waiter = awaitingCoroutine;
+				this->state->timer.callback = TimeoutState::timedOut;
+				this->state->timer.context = this->state;
+				Kernel::Scheduler::addTimer(this->state->timer, this->nanoseconds);
+				this->state->node.callback = TimeoutState::finished;
+				this->state->node.context = this->state;
+				if (!this->thenable.addAwaitingNode(this->state->node)) {
+					TimeoutState::finished(this->state->node);
+				}
+			}
+
+			void await_resume() const noexcept {}
+	};
+
+	// Resolves to true if the thenable finishes within given nanoseconds and false if it times out first
+	// A thenable that timed out keeps running and can still be awaited for its result, or be dropped
+	template<typename T>
+	Thenable<bool> withTimeout(const Thenable<T> &thenable, uint64_t nanoseconds) {
+		if (thenable.await_ready()) {
+			co_return true;
+		}
+		TimeoutState *state = new TimeoutState();
+		co_await TimeoutAwaiter<T>(state, thenable, nanoseconds);
+		bool completed = state->completed;
+		state->release();
+		co_return completed;
+	}
+
+	// Stands in for the result of a void thenable inside whenAll's tuple
+	struct Empty {};
+
+	template<typename T>
+	using ResultOf = std::conditional_t<std::is_void_v<T>, Empty, T>;
+
+	// Awaits a thenable and moves its result out, void thenables yield Empty
+	template<typename T>
+	class [[nodiscard]] ResultAwaiter {
+		private:
+			decltype(std::declval<Thenable<T>&&>().operator co_await()) awaiter;
+
+		public:
+			explicit ResultAwaiter(Thenable<T> &thenable) noexcept : awaiter(std::move(thenable).operator co_await()) {}
+
+			bool await_ready() const noexcept {
+				return this->awaiter.await_ready();
+			}
+
+			bool await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+				return this->awaiter.await_suspend(awaitingCoroutine);
+			}
+
+			ResultOf<T> await_resume() noexcept {
+				if constexpr (std::is_void_v<T>) {
+					this->awaiter.await_resume();
+					return {};
+				} else {
+					return std::move(this->awaiter.await_resume());
+				}
+			}
+	};
+
+	// Resolves once every thenable has finished, with their results in order
+	// Thenables start running as soon as they are created so awaiting them one after another
+	// still lets them overlap and the parent is only resumed by the ones still running
+	// The thenables are taken by value since their results are moved out of them
+	template<typename... T>
+	Thenable<std::tuple<ResultOf<T>...>> whenAll(Thenable<T>... thenables) {
+		co_return std::tuple<ResultOf<T>...>{(co_await ResultAwaiter<T>(thenables))...};
+	}
+
+	template<typename T>
+	requires (!std::is_void_v<T>)
+	Thenable<std::vector<T>> whenAll(std::vector<Thenable<T>> thenables) {
+		std::vector<T> results;
+		results.reserve(thenables.size());
+		for (auto &thenable : thenables) {
+			results.push_back(co_await ResultAwaiter<T>(thenable));
+		}
+		co_return std::move(results);
+	}
+
+	inline Thenable<void> whenAll(std::vector<Thenable<void>> thenables) {
+		for (const auto &thenable : thenables) {
+			co_await thenable;
+		}
+		co_return;
+	}
+
+	// Shared by whenAny and the nodes it leaves in every thenable's awaiting list
+	// The first thenable to finish records its index, the last of them and whenAny to let go deletes it
+	// The waiter is resumed once both the first finisher and the registering awaiter are done with it
+	struct WhenAnyState {
+		std::atomic<size_t> references;
+		std::atomic<uint8_t> wakeParties = 2;
+		std::atomic<bool> settled = false;
+		size_t winner = SIZE_MAX;
+		std::coroutine_handle<> waiter = nullptr;
+		AwaitingNode *nodes;
+
+		explicit WhenAnyState(size_t count) : references(count + 1), nodes(new AwaitingNode[count]) {}
+
+		~WhenAnyState() {
+			delete[] this->nodes;
+		}
+
+		void release() noexcept {
+			if (this->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				delete this;
+			}
+		}
+
+		template<typename T>
+		void watch(const Thenable<T> &thenable, size_t index) noexcept {
+			AwaitingNode &node = this->nodes[index];
+			node.callback = finished;
+			node.context = this;
+			if (!thenable.addAwaitingNode(node)) {
+				finished(node);
+			}
+		}
+
+		static void finished(AwaitingNode &node) noexcept {
+			WhenAnyState *state = (WhenAnyState*)node.context;
+			if (!state->settled.exchange(true, std::memory_order_acq_rel)) {
+				state->winner = &node - state->nodes;
+				if (state->wakeParties.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					Kernel::Scheduler::queueEvent(state->waiter);
+				}
+			}
+			state->release();
+		}
+	};
+
+	template<typename Watch>
+	class [[nodiscard]] WhenAnyAwaiter {
+		private:
+			WhenAnyState *state;
+			Watch watchAll;
+
+		public:
+			WhenAnyAwaiter(WhenAnyState *state, Watch watchAll) noexcept : state(state), watchAll(watchAll) {}
+
+			bool await_ready() const noexcept {
+				return false;
+			}
+
+			bool await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept {
+				// The waiter must be known before any thenable can settle
+				this->state->waiter = awaitingCoroutine;
+				this->watchAll(this->state);
+				// Resume right away if a thenable had finished before or while the nodes were added
+				return this->state->wakeParties.fetch_sub(1, std::memory_order_acq_rel) != 1;
+			}
+
+			void await_resume() const noexcept {}
+	};
+
+	// Resolves to the index of the first thenable to finish, whose result can then be awaited without suspending
+	// The others keep running and their results stay available through their own thenables
+	template<typename... T>
+	Thenable<size_t> whenAny(const Thenable<T>&... thenables) {
+		static_assert(sizeof...(T) > 0, "whenAny needs at least one thenable");
+		WhenAnyState *state = new WhenAnyState(sizeof...(T));
+		co_await WhenAnyAwaiter(state, [&](WhenAnyState *state) {
+			size_t index = 0;
+			(state->watch(thenables, index++), ...);
+		});
+		size_t winner = state->winner;
+		state->release();
+		co_return std::move(winner);
+	}
+
+	template<typename T>
+	Thenable<size_t> whenAny(const std::vector<Thenable<T>> &thenables) {
+		if (thenables.empty()) {
+			co_return SIZE_MAX;
+		}
+		WhenAnyState *state = new WhenAnyState(thenables.size());
+		co_await WhenAnyAwaiter(state, [&](WhenAnyState *state) {
+			for (size_t index = 0; index < thenables.size(); ++index) {
+				state->watch(thenables[index], index);
+			}
+		});
+		size_t winner = state->winner;
+		state->release();
+		co_return std::move(winner);
+	}
 }
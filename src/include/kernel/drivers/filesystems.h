@@ -51,7 +51,6 @@ namespace FS {
 
 	struct FileBuffer {
 		size_t base = SIZE_MAX;
-		bool isBusy = false;	// TODO: Change to mutex and use it while reading/writing
 		Storage::Buffer buffer;
 	};
 
@@ -69,7 +68,8 @@ namespace FS {
 		std::vector<std::shared_ptr<FileDescriptor>> openFileDescriptors;
 		std::vector<FileBuffer> fileBuffers;
 		bool isLocked = false;
-		bool isBusy = false;	// TODO: Change to mutex and use it while manipulating children, descriptors, buffers
+		// Shared while reading children or buffers, exclusive while filling them
+		Async::RWLock lock;
 	};
 
 	struct InfoResult {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <kernel.h>
 
 namespace Drivers {
 	namespace PS2 {
@@ -259,7 +260,4 @@ namespace Drivers {
 }
 
 // keyboard.cpp
-extern "C" void ps2KeyboardHandler();
-
-// keyboardasm.asm
-extern "C" void ps2KeyboardHandlerWrapper();
+void ps2KeyboardHandler(void*, Kernel::Threads::InterruptFrame*);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <kernel.h>
 
 namespace Drivers {
 	namespace PS2 {
@@ -15,7 +16,4 @@ namespace Drivers {
 }
 
 // mouse.cpp
-extern "C" void ps2MouseHandler();
-
-// mouseasm.asm
-extern "C" void ps2MouseHandlerWrapper();
+void ps2MouseHandler(void*, Kernel::Threads::InterruptFrame*);
@@ -7,7 +7,12 @@
 
 #define AHCI_COMMAND_LIST_SIZE 1024
 #define AHCI_COMMAND_READ_DMA_EX 0x25
+#define AHCI_COMMAND_READ_DMA_EX_MAX_BLOCKS 0xffff	// the count is 16 bits and 0 would mean 65536
 #define AHCI_COMMAND_ATAPI_PACKET 0xa0
+#define AHCI_COMMAND_TIMEOUT 10000000000UL	// in nanoseconds
+
+#define AHCI_COMRESET_HOLD_TIME 1000000	// in nanoseconds
+#define AHCI_PORT_RECOVERY_TIMEOUT 500000000	// in nanoseconds
 
 #define AHCI_DEVICE_BUSY 0x80
 #define AHCI_DEVICE_DRQ 0x08
@@ -22,6 +27,9 @@
 #define AHCI_PORT_COUNT 32
 #define AHCI_PORT_DEVICE_PRESENT 3
 
+#define AHCI_PRDT_BYTE_LIMIT (4 * 1024 * 1024UL)
+#define AHCI_PRDT_COUNT 24
+
 #define AHCI_SECTOR_SIZE 512
 
 #define AHCI_BUFFER_ALIGN_AT 2
@@ -581,5 +589,4 @@ namespace AHCI {
 }
 }
 
-extern "C" void ahciMsiHandler();
-extern "C" void ahciMsiHandlerWrapper();
+void ahciMsiHandler(void*, Kernel::Threads::InterruptFrame*);
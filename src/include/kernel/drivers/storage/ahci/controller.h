@@ -1,5 +1,6 @@
 #pragma once
 
+#include <apic.h>
 #include <drivers/storage/ahci.h>
 #include <memory>
 
@@ -7,13 +8,18 @@ class Drivers::Storage::AHCI::Controller {
 	private:
 		volatile HostBusAdapter *hba;
 		std::vector<std::shared_ptr<Device>> devices;
+		// Heap allocated since controllers move when AHCI::controllers grows
+		APIC::InterruptRoute *msiRoute = nullptr;	// of the MSI or MSI-X entry 0 shared with other controllers
+		volatile PCIe::MSIXTableEntry *msixTable = nullptr;
+		size_t msixEntryCount = 0;
 
 	public:
 		const std::vector<std::shared_ptr<Device>>& getDevices() const;
 		Async::Thenable<bool> initialize(const PCIe::Function &pcieFunction);
 		// TODO: implement destructor that releases the virtual pages mapped to the controller's HBA
 
-	friend void ::ahciMsiHandler();
+	friend void ::ahciMsiHandler(void*, Kernel::Threads::InterruptFrame*);
+	friend Async::Thenable<bool> AHCI::initialize(const PCIe::Function &pcieFunction);
 	friend class Device;
 	friend class SataDevice;
 	friend class SatapiDevice;
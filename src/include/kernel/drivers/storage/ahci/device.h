@@ -1,5 +1,6 @@
 #pragma once
 
+#include <apic.h>
 #include <drivers/storage/ahci.h>
 #include <drivers/storage/blockdevice.h>
 
@@ -11,32 +12,37 @@ class Drivers::Storage::AHCI::Device : public BlockDevice {
 			Satapi
 		};
 
+		// Issues the command in freeSlot and resumes the awaiting coroutine with its result
+		// The result is false if the device reported an error, the command timed out, or cancellation was cancelled
 		class [[nodiscard]] Command {
 			private:
 				Device *device;
 				size_t freeSlot;
-				std::coroutine_handle<> *awaitingCoroutine;
-				bool *result;
+				Async::CancellationToken *cancellation;
+				Async::AwaitingNode cancellationNode;
+				std::coroutine_handle<> awaitingCoroutine;
+				bool result;
+				bool hasResult;
 
 			public:
-				Command(Device *device, size_t freeSlot);
+				Command(Device *device, size_t freeSlot, Async::CancellationToken *cancellation = nullptr);
 				Command() = delete;
 				Command(const Command&) = delete;
 				Command(Command&&) = delete;
 				Command& operator=(const Command&) = delete;
 				Command& operator=(Command&&) = delete;
 
-				~Command();
-
 				constexpr bool await_ready() const noexcept {
 					return false;
 				};
 
-				void await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept;
+				bool await_suspend(std::coroutine_handle<> awaitingCoroutine) noexcept;
 
 				bool await_resume() const noexcept;
 
 				void setResult(bool result) noexcept;
+
+			friend class Device;
 		};
 
 	protected:
@@ -45,22 +51,42 @@ class Drivers::Storage::AHCI::Device : public BlockDevice {
 		CommandHeader *commandHeaders;
 		void *fisBase;
 		CommandTable *commandTables[AHCI_COMMAND_LIST_SIZE / sizeof(CommandHeader)];
+		// Guards runningCommandsBitmap, claimedCommandsBitmap, commands, deadlines, and watchdogArmed
+		Async::Spinlock commandLock;
 		uint32_t runningCommandsBitmap;
+		uint32_t claimedCommandsBitmap;	// slots handed out by findFreeCommandSlot but not issued yet, a subset of runningCommandsBitmap
 		Command *commands[AHCI_COMMAND_LIST_SIZE / sizeof(CommandHeader)];
+		uint64_t deadlines[AHCI_COMMAND_LIST_SIZE / sizeof(CommandHeader)];	// in Time::nowNs() nanoseconds
+		Kernel::Scheduler::Timer watchdog;
+		bool watchdogArmed;
+		std::atomic<uint32_t> pendingInterruptStatus;	// port interrupt status bits not yet handled by completeCommands
+		std::atomic<uint32_t> cancelledCommands;	// slots whose cancellation token was cancelled
+		Kernel::Scheduler::DeferredWork completionWork;
+		APIC::InterruptRoute interruptRoute;	// of the port's own MSI-X entry, unused when ports share a vector
+		uint8_t interruptVector;
 		IdentifyDeviceData *info;
 		Controller *controller;
 		Type type;
 
-		Storage::Buffer setupRead(size_t blockCount, size_t &freeSlot);
+		void abortCommands(uint32_t abortedCommands);
+		void armWatchdog(uint64_t deadline);
+		void expireCommands();
+		void finishCommands(uint32_t finishedCommands, bool result);
+		void handleInterrupt();
+		bool recoverPort();
+		void releaseCommandSlot(size_t slot);
+		size_t setupRead(const Storage::Buffer &buffer, size_t firstBlock, size_t blockCount, size_t &freeSlot);
 
 	public:
 		Device(Controller *controller, size_t portNumber);
-		size_t findFreeCommandSlot() const;
+		void acknowledgeInterrupt();
+		void completeCommands();
+		size_t findFreeCommandSlot();
 		size_t getPortNumber() const;
 		Type getType() const;
 		Async::Thenable<bool> identify();
 		bool initialize();
-		void msiHandler();
+		bool routeInterrupt(volatile PCIe::MSIXTableEntry *entry);
 		// TODO: implement destructor that releases the virtual pages used for command list and tables
 
 	friend class Controller;
@@ -10,5 +10,9 @@ class Drivers::Storage::AHCI::SatapiDevice : public Device {
 		// Reads maximum of 32MiB data from an ATA/ATAPI device attached to an AHCI controller.
 		// Returns Storage::Buffer containing the data read
 		// Returns nullptr if the read failed or size constraints are not met
-		Async::Thenable<Storage::Buffer> read(size_t startBlock, size_t blockCount) override;
+		Async::Thenable<Storage::Buffer> read(
+			size_t startBlock,
+			size_t blockCount,
+			Async::CancellationToken *cancellation = nullptr
+		) override;
 };
@@ -11,7 +11,12 @@ namespace Storage {
 
 		public:
 			size_t getBlockSize() const;
-			virtual Async::Thenable<Buffer> read(size_t startBlock, size_t blockCount) = 0;
+			// The read fails early if cancellation is cancelled before it completes
+			virtual Async::Thenable<Buffer> read(
+				size_t startBlock,
+				size_t blockCount,
+				Async::CancellationToken *cancellation = nullptr
+			) = 0;
 	};
 }
 }
@@ -2,6 +2,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <kernel.h>
 
 namespace Drivers {
 namespace Storage {
@@ -9,7 +10,7 @@ namespace Storage {
 		private:
 			void *data = nullptr;
 			size_t pageCount = 0;
-			uint64_t physicalAddress = UINT64_MAX;
+			Kernel::Memory::PhysicalSegmentList segments;
 			size_t size = 0;
 
 		public:
@@ -24,7 +25,7 @@ namespace Storage {
 			Buffer& operator=(Buffer &&other);
 			explicit operator bool() const;
 			void* getData() const;
-			uint64_t getPhysicalAddress() const;
+			const Kernel::Memory::PhysicalSegmentList& getSegments() const;
 			size_t getSize() const;
 	};
 }
@@ -70,16 +70,11 @@ namespace Drivers {
 			} __attribute__((packed));
 
 			extern Registers *registers;
-			extern Timer *periodicTimer;
-			extern void (*timerInterruptCallback)();
 
 			extern bool initialize();
+			extern uint64_t nanosecondsToTicks(uint64_t nanoseconds);
+			extern uint64_t readCounter();
+			extern uint64_t ticksToNanoseconds(uint64_t ticks);
 		}
 	}
 }
-
-// hpet.cpp
-extern "C" void hpetHandler();
-
-// hpetasm.asm
-extern "C" void hpetHandlerWrapper();
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <coroutine>
 #include <cstddef>
 #include <cstdint>
@@ -14,12 +15,28 @@
 #define APU_BOOTLOADER_PADDING 32
 #define APU_BOOTLOADER_ORIGIN 0x8000
 #define CPU_STACK_SIZE 0x10000
+#define DIRECT_MAP_MAX_RANGES 64
+#define DIRECT_MAP_ORIGIN 0xffff800000000000
+#define IDT_DYNAMIC_VECTOR_START 0x20
+#define IDT_DYNAMIC_VECTOR_END 0xf0	// vectors from here on are left for IPIs and the spurious interrupt
+#define IDT_VECTOR_STUB_SIZE 16
 #define INVALID_ADDRESS ((void*) 0x8000000000000000)
 #define KERNEL_ORIGIN 0xffffffff80000000
 #define L32_IDENTITY_MAP_SIZE 32
 #define L32K64_SCRATCH_BASE 0x80000
 #define L32K64_SCRATCH_LENGTH 0x10000
+#define PAGE_TABLE_POOL_SIZE 32
 #define PHY_MEM_BUDDY_MAX_ORDER 10
+#define SCHEDULER_HISTOGRAM_BUCKETS 32
+#define SCHEDULER_PRIORITY_LEVELS 4
+#define SYSCALL_BENCHMARK_ITERATIONS 100000
+#define THREAD_PREEMPTION_RETRY 50000
+#define THREAD_STACK_SIZE 0x10000
+#define THREAD_TIME_SLICE 1000000
+#define TSC_CALIBRATION_TIME 50000000
+#define TSC_SYNC_ROUNDS 64
+#define UNMAP_BATCH_SIZE 32
+#define USER_SPACE_ORIGIN 0x8000000000
 
 namespace Kernel {
 	enum IRQ : uint8_t {
@@ -30,17 +47,30 @@ namespace Kernel {
 
 	enum MSR : uint32_t {
 		x2ApicEnable = 0x1b,
+		tscAdjust = 0x3b,
+		pageAttributeTable = 0x277,
+		tscDeadline = 0x6e0,
 		x2ApicId = 0x802,
 		x2ApicEOI = 0x80b,
 		x2ApicSpuriousInterrupt = 0x80f,
 		x2ApicErrorStatus = 0x828,
-		x2ApicInterruptCommand = 0x830
+		x2ApicInterruptCommand = 0x830,
+		x2ApicLvtTimer = 0x832,
+		x2ApicInitialCount = 0x838,
+		x2ApicCurrentCount = 0x839,
+		x2ApicDivideConfiguration = 0x83e,
+		efer = 0xc0000080,
+		star = 0xc0000081,
+		lstar = 0xc0000082,
+		fmask = 0xc0000084,
+		gsBase = 0xc0000101,
+		kernelGsBase = 0xc0000102
 	};
 
 	class [[nodiscard]] ApuAwaiter {
 		private:
 			uint32_t apicId;
-			std::coroutine_handle<> *awaitingCoroutine;
+			std::coroutine_handle<> awaitingCoroutine;
 
 		public:
 			ApuAwaiter(uint32_t apicId);
@@ -71,9 +101,15 @@ namespace Kernel {
 
 	extern "C" [[noreturn]] void panic();
 
+	// Flush the virtual->physical address cache and the paging-structure caches by reloading cr3 with its current value
+	extern "C" void flushCurrentTLB();
+
 	// Flush the virtual->physical address cache by reloading cr3 register
 	extern "C" void flushTLB(void *newPml4Root);
 
+	// Flush the virtual->physical address cache entry of a virtual address and all paging-structure caches
+	extern "C" void flushTLBEntry(void *virtualAddress);
+
 	// Halts the system and returns if execution resumed due to any interrupt
 	extern "C" void haltSystem();
 
@@ -113,6 +149,10 @@ namespace Kernel {
 		uint16_t getAvailableSelector();
 	};
 
+	namespace Threads {
+		struct InterruptFrame;
+	};
+
 	namespace IDT {
 		struct Entry {
 			uint16_t offsetLow;
@@ -128,8 +168,20 @@ namespace Kernel {
 			uint32_t reserved2;
 		} __attribute__((packed));
 
-		extern "C" size_t availableInterrupt;
+		// Runs in interrupt context and must acknowledge the local APIC itself
+		// frame is the interrupt return frame pushed by the CPU
+		typedef void (*InterruptHandler)(void *context, Threads::InterruptFrame *frame);
+
+		// Looked up by the interrupt entries in idt64.asm, keep it 16 bytes
+		struct VectorHandler {
+			InterruptHandler handler;
+			void *context;
+		};
+
 		extern "C" Entry *idt64Base;
+		extern "C" VectorHandler vectorHandlers[256];
+		extern "C" uint8_t extendedStateVectorStubs[];
+		extern "C" uint8_t vectorStubs[];
 
 		extern "C" void boundRangeHandler();
 		extern "C" void breakpointHandler();
@@ -145,6 +197,8 @@ namespace Kernel {
 		extern "C" void noSseHandler();
 		extern "C" void overflowHandler();
 		extern "C" void pageFaultHandler();
+		[[nodiscard]] uint8_t allocateVector(InterruptHandler handler, void *context, bool saveExtendedState = false);
+		void freeVector(uint8_t vector);
 		bool installEntry(uint8_t interruptNumber, void (*handler)(), uint8_t ist);
 		bool setup();
 	};
@@ -155,11 +209,69 @@ namespace Kernel {
 			HPET = 1
 		};
 
+		// Run queue levels, lower values are dispatched first
+		// Events queued from interrupt context default to InterruptCompletion
+		// and events queued by a running event inherit its priority
+		enum Priority : uint8_t {
+			InterruptCompletion = 0,
+			Interactive = 1,
+			Normal = 2,
+			Background = 3
+		};
+
+		class RunQueue;
+		class TimerWheel;
+
+		// Bottom half of an interrupt handler, queued by the handler on the CPU that took the interrupt
+		// The CPU's dispatch loop runs it with interrupts enabled ahead of timers, events, and threads
+		// Queueing work that is still pending does nothing, so interrupts arriving before it runs are handled in one pass
+		struct DeferredWork {
+			DeferredWork *next = nullptr;
+			std::atomic<bool> pending = false;
+			void (*callback)(DeferredWork &work) = nullptr;
+			void *context = nullptr;
+		};
+
+		// Intrusive timer entry linked in the timer wheel of the CPU it was added on
+		// On expiry callback is called if set, otherwise event is queued
+		struct Timer {
+			Timer *next = nullptr;
+			Timer **previousNext = nullptr;
+			TimerWheel *wheel = nullptr;
+			uint64_t expiry = 0;	// in Time::nowNs() nanoseconds
+			std::coroutine_handle<> event = nullptr;
+			void (*callback)(Timer &timer) = nullptr;
+			void *context = nullptr;
+		};
+
+		// Dispatch counters of a CPU, written only by that CPU and read racily by anyone
+		// Histogram bucket 0 counts zeros, bucket n counts values in [2^(n - 1), 2^n)
+		// and the last bucket also counts everything larger
+		struct Statistics {
+			uint64_t dispatchLatency[SCHEDULER_HISTOGRAM_BUCKETS] = {};	// TSC cycles from queueing to resumption
+			uint64_t queueDepth[SCHEDULER_HISTOGRAM_BUCKETS] = {};	// events in the CPU's run queue when a dispatch round starts
+			uint64_t eventsPerDispatch[SCHEDULER_HISTOGRAM_BUCKETS] = {};	// events run by a dispatch round that ran any
+			uint64_t dispatchedEvents = 0;
+			uint64_t stolenEvents = 0;	// taken from other CPUs' run queues or the shared queues
+			uint64_t dispatchLimitHits = 0;	// rounds stopped by SCHEDULER_EVENT_DISPATCH_LIMIT with events left
+		};
+
 		extern TimerType timerUsed;
 
+		void addTimer(Timer &timer, uint64_t nanoseconds);
+		[[nodiscard]] bool cancelTimer(Timer &timer);
+		Priority currentPriority();
+		[[nodiscard]] bool getStatistics(size_t cpuIndex, Statistics &statistics);
+		[[noreturn]] void dispatchLoop();
+		void queueDeferredWork(DeferredWork &work);
+		extern "C" void enableInterruptsAndMwait(uint32_t hints);
+		extern "C" uint32_t getMwaitSubStates();
+		void initializeCpu();
+		void printStatistics();
+		extern "C" bool isMwaitSupported();
 		void queueEvent(std::coroutine_handle<> event);
+		void queueEvent(std::coroutine_handle<> event, Priority priority);
 		bool start();
-		void timerLoop();
 	}
 
 	namespace TSS {
@@ -187,6 +299,59 @@ namespace Kernel {
 		extern "C" void loadTss(uint16_t selector);
 	}
 
+	namespace Threads {
+		// Stackful kernel thread for long running work that would otherwise hold up coroutine dispatch
+		// Threads stay on the CPU they were created on and take turns with its coroutine dispatch
+		// A thread is preempted once it has run for THREAD_TIME_SLICE nanoseconds
+		struct Thread {
+			void *stackPointer = nullptr;	// saved while the thread is switched out
+			void *stack = nullptr;
+			void (*entry)(void *argument) = nullptr;
+			void *argument = nullptr;
+			Thread *next = nullptr;
+			void *addressSpace = nullptr;	// physical address of the PML4 if the thread runs a user task
+			bool finished = false;
+		};
+
+		// Pushed by the CPU on interrupt entry
+		struct InterruptFrame {
+			uint64_t rip;
+			uint64_t cs;
+			uint64_t rflags;
+			uint64_t rsp;
+			uint64_t ss;
+		};
+
+		[[nodiscard]] bool create(void (*entry)(void *argument), void *argument);
+		void disablePreemption();
+		void enablePreemption();
+		[[noreturn]] void exit();
+		void preemptIfDue(InterruptFrame *frame);
+		[[nodiscard]] bool runNext();
+		void yield();
+
+		// threadsasm.asm
+		extern "C" void preemptionTrampoline();
+		extern "C" void switchContext(void **savedStackPointer, void *stackPointer);
+		extern "C" void threadStart();
+	}
+
+	namespace Time {
+		extern bool invariantTsc;
+		extern uint64_t tscFrequency;
+
+		[[nodiscard]] uint64_t cyclesToNanoseconds(uint64_t cycles);
+		[[nodiscard]] bool initialize();
+		[[nodiscard]] uint64_t nanosecondsToCycles(uint64_t nanoseconds);
+		[[nodiscard]] uint64_t nowNs();
+		void serveTscSync();
+		void syncTsc();
+
+		// timeasm.asm
+		extern "C" bool isInvariantTscSupported();
+		extern "C" bool isTscAdjustSupported();
+	}
+
 	namespace Memory {
 		extern const size_t pageSize;
 		extern const size_t pageSizeShift;
@@ -199,6 +364,10 @@ namespace Kernel {
 			VirtualContiguous = 16,
 			Executable = 32,
 			Writable = 64,
+			WriteCombining = 128,
+			WriteThrough = 256,
+			UncachedMinus = 512,
+			User = 1024,
 		};
 
 		enum MarkPageType {
@@ -211,6 +380,14 @@ namespace Kernel {
 			size_t allocatedCount = 0;
 		};
 
+		// Run of physically contiguous pages backing part of a virtually contiguous region
+		struct PhysicalSegment {
+			void *address = INVALID_ADDRESS;
+			size_t pageCount = 0;
+		};
+
+		using PhysicalSegmentList = std::vector<Kernel::Memory::PhysicalSegment>;
+
 		namespace Physical {
 			class [[nodiscard]] BuddyBitmapIndex {
 				public:
@@ -257,24 +434,44 @@ namespace Kernel {
 				size_t pageCount = 0;
 			};
 
+			// Zeroed physical pages kept by every CPU for use as page tables by mapPages
+			struct PageTablePool {
+				void *pages[PAGE_TABLE_POOL_SIZE];
+				size_t count = 0;
+			};
+
 			// TODO: Should perhaps use std::list as the container instead of std::vector
 			using AddressSpaceList = std::vector<Kernel::Memory::Virtual::AddressSpaceNode>;
 
 			extern AddressSpaceList generalAddressSpaceList;
 			extern AddressSpaceList kernelAddressSpaceList;
 
+			[[nodiscard]] void* createAddressSpace();
+			void destroyAddressSpace(void *pml4Physical);
 			void displayCrawlPageTablesResult(void *virtualAddress);
 			[[nodiscard]] bool freePages(void *virtualAddress, size_t count, uint32_t flags);
+			[[nodiscard]] void* getKernelAddressSpace();
 			[[nodiscard]] bool initialize(
 				void *usableKernelSpaceStart,
 				size_t phyMemBuddyPagesCount,
 				GlobalConstructor (&globalCtors)[]
 			);
+			[[nodiscard]] bool initializeTlbShootdown();
 			[[nodiscard]] bool isCanonical(void *address);
+			void loadPat();
 			[[nodiscard]] bool mapPages(void *virtualAddress, void *physicalAddress, size_t count, uint32_t flags);
-			[[nodiscard]] PageRequestResult requestPages(size_t count, uint32_t flags);
+			[[nodiscard]] void* physToVirt(void *physicalAddress);
+			void refillPageTablePool();
+			[[nodiscard]] PageRequestResult requestPages(
+				size_t count,
+				uint32_t flags,
+				PhysicalSegmentList *segments = nullptr
+			);
+			[[nodiscard]] void* reserveAddressSpace(AddressSpaceList &list, size_t count);
 			void showAddressSpaceList(bool kernelList = true);
+			void* switchAddressSpace(void *pml4Physical);
 			[[nodiscard]] bool unmapPages(void *virtualAddress, size_t count, bool freePhysicalPage);
+			[[nodiscard]] void* virtToPhys(void *virtualAddress);
 		}
 
 		namespace Heap {
@@ -309,4 +506,41 @@ namespace Kernel {
 			void listRegions(bool forwardDirection = true);
 		}
 	}
+
+	namespace Tasks {
+		enum Syscall : uint64_t {
+			Null = 0,
+			Exit,
+			Yield,
+			Count
+		};
+
+		typedef int64_t(*SyscallHandler)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+		// Ring 3 program with its own address space, run by a kernel thread on the CPU that started it
+		// The lower half from USER_SPACE_ORIGIN belongs to the task, everything else is shared with the kernel
+		struct Task {
+			void *addressSpace = nullptr;	// physical address of the PML4
+			Memory::Virtual::AddressSpaceList addressSpaceList;
+			void *entry = nullptr;
+			void *stackTop = nullptr;
+			uint64_t argument = 0;
+			int64_t exitCode = 0;
+			void (*onExit)(Task *task) = nullptr;	// called in kernel mode before the task is destroyed
+		};
+
+		[[nodiscard]] Task* create();
+		void destroy(Task *task);
+		void initializeCpu();
+		[[nodiscard]] void* map(Task *task, const void *contents, size_t size, uint32_t flags);
+		[[nodiscard]] bool start(Task *task, void *entry, void *stackTop, uint64_t argument);
+		[[nodiscard]] bool startSyscallBenchmark(uint64_t iterations);
+
+		// tasksasm.asm
+		extern "C" [[noreturn]] void enterUserMode(void *entry, void *stackPointer, uint64_t argument);
+		extern "C" void syscallEntry();
+		extern "C" void userPreemptionTrampoline();
+		extern "C" const uint8_t userSyscallBenchmark[];
+		extern "C" const uint8_t userSyscallBenchmarkEnd[];
+	}
 }
@@ -95,15 +95,36 @@ namespace PCIe {
 		uint32_t pending;
 	} __attribute__((packed));
 
+	struct MSIXCapability {
+		uint8_t capabilityId;
+		uint8_t next;
+		uint16_t tableSize : 11;	// entry count - 1
+		uint16_t reserved0 : 3;
+		uint16_t functionMask : 1;
+		uint16_t enable : 1;
+		uint32_t table;	// BAR index in bits 0 to 2, offset into the BAR in the rest
+		uint32_t pendingBitArray;	// BAR index in bits 0 to 2, offset into the BAR in the rest
+	} __attribute__((packed));
+
+	struct MSIXTableEntry {
+		uint32_t messageAddress;
+		uint32_t messageAddressUpper;
+		uint32_t data;
+		uint32_t vectorControl;	// bit 0 masks the entry
+	} __attribute__((packed));
+
 	struct Function {
 		uint8_t bus = 0xff;
 		uint8_t device = 0xff;
 		uint8_t function = 0xff;
 		BaseHeader *configurationSpace = (BaseHeader*)INVALID_ADDRESS;
 		MSICapability *msi = (MSICapability*)INVALID_ADDRESS;
+		MSIXCapability *msix = nullptr;
 	};
 
 	extern std::vector<Function> functions;
 
 	extern bool enumerate();
+	extern void* mapBar(const Function &function, size_t barIndex, size_t pageCount);
+	extern volatile MSIXTableEntry* mapMsixTable(const Function &function);
 }
@@ -12,7 +12,11 @@ struct PML4E {
 	uint8_t pageWriteThrough : 1;
 	uint8_t cacheDisable : 1;
 	uint8_t accessed : 1;
-	uint16_t ignore1 : 6;
+	uint8_t dirty : 1;
+	// Maps a 2MiB page when set in a PDE, acts as the PAT bit in a PTE
+	uint8_t largePage : 1;
+	uint8_t global : 1;
+	uint16_t ignore1 : 3;
 	uint64_t physicalAddress : 40;
 	uint16_t ignore2 : 11;
 	uint8_t executeDisable : 1;